@@ -16,6 +16,8 @@
 
 #include <gavran/infrastructure.h>
 #include <gavran/pal.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
 
 enable_defer_imp(close, -1, *(int *), "%d");
 
@@ -147,6 +149,7 @@ result_t pal_create_file(const char *path, file_handle_t **handle_out,
   try_defer(free, handle->filename, cancel_defer);
 
   // <4>
+  handle->flags = flags;
   int open_flags = O_CLOEXEC | O_CREAT | O_RDWR;
   if (flags & pal_file_creation_flags_durable) {
     open_flags |= O_DIRECT | O_DSYNC;
@@ -254,6 +257,25 @@ void defer_pal_unmap(cancel_defer_t *cd) {
 }
 // end::pal_map_defer[]
 
+// tag::pal_allocate_file_range[]
+static result_t pal_allocate_file_range(file_handle_t *handle,
+                                        uint64_t from, uint64_t to) {
+  // <1>
+  if (!fallocate(handle->fd, 0, (off_t)from, (off_t)(to - from)))
+    return success();
+  if (errno != EOPNOTSUPP) {
+    failed(errno, msg("Unable to preallocate file range"),
+           with(handle->filename, "%s"), with(to, "%lu"));
+  }
+  // <2>
+  if (ftruncate(handle->fd, (off_t)to) == -1) {
+    failed(errno, msg("Unable to change file to size"),
+           with(handle->filename, "%s"), with(to, "%lu"));
+  }
+  return success();
+}
+// end::pal_allocate_file_range[]
+
 // tag::pal_set_file_size[]
 result_t pal_set_file_size(file_handle_t *handle,
                            uint64_t minimum_size,
@@ -275,12 +297,22 @@ result_t pal_set_file_size(file_handle_t *handle,
 
   if (!new_size) return success();
 
-  if (ftruncate(handle->fd, (off_t)new_size) == -1) {
+  if (new_size > (uint64_t)st.st_size &&
+      (handle->flags & pal_file_creation_flags_preallocate)) {
+    ensure(pal_allocate_file_range(handle, (uint64_t)st.st_size,
+                                   new_size));
+  } else if (ftruncate(handle->fd, (off_t)new_size) == -1) {
     failed(errno, msg("Unable to change file to size"),
            with(handle->filename, "%s"), with(new_size, "%lu"));
   }
   handle->size = new_size;
 
+  // <1>
+  if (st.st_size) {
+    ensure(pal_fsync(handle));
+    return success();
+  }
+
   char *mutable;
   ensure(mem_duplicate_string(&mutable, handle->filename));
   defer(free, mutable);
@@ -331,3 +363,354 @@ result_t pal_read_file(file_handle_t *handle, uint64_t offset,
   return success();
 }
 // end::pal_write_file[]
+
+// tag::pal_write_file_vectored[]
+#define PAL_IOV_BATCH 64
+result_t pal_write_file_vectored(file_handle_t *handle,
+                                 uint64_t offset, span_t *buffers,
+                                 size_t count, uint64_t *syscalls) {
+  errors_assert_empty();
+  struct iovec iov[PAL_IOV_BATCH];
+  while (count) {
+    // <1>
+    int iov_count = (int)MIN(count, PAL_IOV_BATCH);
+    for (int i = 0; i < iov_count; i++) {
+      iov[i].iov_base = buffers[i].address;
+      iov[i].iov_len = buffers[i].size;
+    }
+    buffers += iov_count;
+    count -= (size_t)iov_count;
+    struct iovec *cur = iov;
+    while (iov_count) {
+      ssize_t result =
+          pwritev(handle->fd, cur, iov_count, (off_t)offset);
+      if (syscalls) (*syscalls)++;
+      if (result == -1) {
+        if (errno == EINTR) continue;  // repeat on signal
+
+        failed(errno, msg("Unable to write buffers to file"),
+               with(iov_count, "%d"), with(handle->filename, "%s"));
+      }
+      offset += (size_t)result;
+      // <2>
+      size_t written = (size_t)result;
+      while (iov_count && written >= cur->iov_len) {
+        written -= cur->iov_len;
+        cur++;
+        iov_count--;
+      }
+      if (iov_count) {
+        cur->iov_base = (char *)cur->iov_base + written;
+        cur->iov_len -= written;
+      }
+    }
+  }
+  return success();
+}
+// end::pal_write_file_vectored[]
+
+// tag::pal_io_ring[]
+struct pal_io_ring {
+  int fd;
+  uint32_t in_flight;
+  uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+  uint32_t *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  span_t sq_ring, cq_ring, sqes_ring;
+  uint64_t syscalls;
+  int first_error;
+  uint32_t unsubmitted;  // queued, but not yet consumed by the kernel
+};
+
+// spans are passed to the kernel as iovecs directly
+_Static_assert(sizeof(span_t) == sizeof(struct iovec) &&
+                   offsetof(span_t, address) ==
+                       offsetof(struct iovec, iov_base) &&
+                   offsetof(span_t, size) ==
+                       offsetof(struct iovec, iov_len),
+               "span_t must match struct iovec");
+
+static result_t pal_io_ring_map(int fd, uint64_t offset,
+                                size_t size, span_t *span) {
+  void *addr = mmap(0, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, (off_t)offset);
+  if (addr == MAP_FAILED) {
+    failed(errno, msg("Unable to map io_uring ring"),
+           with(offset, "%lx"));
+  }
+  span->address = addr;
+  span->size = size;
+  return success();
+}
+
+result_t pal_io_ring_create(uint32_t depth, pal_io_ring_t **ring) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+  if (fd < 0) {
+    failed(errno, msg("Unable to setup io_uring"),
+           with(depth, "%u"));
+  }
+  size_t done = 0;
+  try_defer(close, fd, done);
+  pal_io_ring_t *r;
+  ensure(mem_calloc((void *)&r, sizeof(pal_io_ring_t)));
+  try_defer(free, r, done);
+  r->fd = fd;
+  // <1>
+  ensure(pal_io_ring_map(
+      fd, IORING_OFF_SQ_RING,
+      params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+      &r->sq_ring));
+  try_defer(pal_unmap, r->sq_ring, done);
+  ensure(pal_io_ring_map(
+      fd, IORING_OFF_CQ_RING,
+      params.cq_off.cqes +
+          params.cq_entries * sizeof(struct io_uring_cqe),
+      &r->cq_ring));
+  try_defer(pal_unmap, r->cq_ring, done);
+  ensure(pal_io_ring_map(
+      fd, IORING_OFF_SQES,
+      params.sq_entries * sizeof(struct io_uring_sqe),
+      &r->sqes_ring));
+
+  char *sq = r->sq_ring.address;
+  char *cq = r->cq_ring.address;
+  r->sq_head = (void *)(sq + params.sq_off.head);
+  r->sq_tail = (void *)(sq + params.sq_off.tail);
+  r->sq_mask = (void *)(sq + params.sq_off.ring_mask);
+  r->sq_array = (void *)(sq + params.sq_off.array);
+  r->cq_head = (void *)(cq + params.cq_off.head);
+  r->cq_tail = (void *)(cq + params.cq_off.tail);
+  r->cq_mask = (void *)(cq + params.cq_off.ring_mask);
+  r->cqes = (void *)(cq + params.cq_off.cqes);
+  r->sqes = r->sqes_ring.address;
+  *ring = r;
+  done = 1;
+  return success();
+}
+
+result_t pal_io_ring_close(pal_io_ring_t *ring) {
+  if (!ring) return success();
+  bool failure = ring->in_flight && flopped(pal_io_ring_wait(ring));
+  failure |= !pal_unmap(&ring->sqes_ring);
+  failure |= !pal_unmap(&ring->cq_ring);
+  failure |= !pal_unmap(&ring->sq_ring);
+  if (close(ring->fd) == -1) {
+    failure = true;
+    errors_push(errno, msg("Unable to close io_uring"));
+  }
+  free(ring);
+  if (failure) return failure_code();
+  return success();
+}
+
+void defer_pal_io_ring_close(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  if (flopped(pal_io_ring_close(*(pal_io_ring_t **)cd->target))) {
+    errors_push(EINVAL, msg("Failure to close ring during defer"));
+  }
+}
+
+uint64_t pal_io_ring_syscalls(pal_io_ring_t *ring) {
+  return ring->syscalls;
+}
+
+// drops the queued entries the kernel refused, they never run
+static void pal_io_ring_unqueue(pal_io_ring_t *ring) {
+  uint32_t tail = *ring->sq_tail - ring->unsubmitted;
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  ring->in_flight -= ring->unsubmitted;
+  ring->unsubmitted = 0;
+}
+
+// submits everything queued. On a partial submit the kernel
+// returns without waiting, the rest goes on the next call
+static result_t pal_io_ring_enter(pal_io_ring_t *ring,
+                                  uint32_t min_complete) {
+  while (true) {
+    ring->syscalls++;
+    uint32_t to_submit = ring->unsubmitted;
+    int rc = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit,
+                          min_complete,
+                          min_complete ? IORING_ENTER_GETEVENTS : 0,
+                          0, 0);
+    if (rc >= 0) {
+      ring->unsubmitted -= MIN((uint32_t)rc, to_submit);
+      break;
+    }
+    if (errno == EINTR) continue;  // repeat on signal
+    int err = errno;
+    pal_io_ring_unqueue(ring);
+    failed(err, msg("Unable to enter io_uring"),
+           with(to_submit, "%u"), with(min_complete, "%u"));
+  }
+  return success();
+}
+
+// <2>
+static result_t pal_io_complete_remainder(pal_io_request_t *req,
+                                          size_t transferred) {
+  uint64_t offset = req->offset;
+  for (size_t i = 0; i < req->count; i++) {
+    span_t rest = req->buffers[i];
+    size_t skip = MIN(transferred, rest.size);
+    transferred -= skip;
+    offset += skip;
+    if (skip == rest.size) continue;
+    rest.address = (char *)rest.address + skip;
+    rest.size -= skip;
+    if (req->op == pal_io_op_write) {
+      ensure(pal_write_file(req->handle, offset, rest.address,
+                            rest.size));
+    } else {
+      ensure(pal_read_file(req->handle, offset, rest.address,
+                           rest.size));
+    }
+    offset += rest.size;
+  }
+  return success();
+}
+
+static void pal_io_ring_reap(pal_io_ring_t *ring) {
+  uint32_t head = *ring->cq_head;
+  uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    pal_io_request_t *req =
+        (pal_io_request_t *)(uintptr_t)cqe->user_data;
+    size_t expected = 0;
+    for (size_t i = 0; i < req->count; i++)
+      expected += req->buffers[i].size;
+    req->result = cqe->res < 0 ? -cqe->res : 0;
+    if (cqe->res >= 0 && (size_t)cqe->res < expected &&
+        flopped(pal_io_complete_remainder(req, (size_t)cqe->res))) {
+      size_t number_of_errors;
+      int *codes = errors_get_codes(&number_of_errors);
+      req->result = number_of_errors ? codes[0] : EIO;
+      errors_clear();
+    }
+    if (req->result && !ring->first_error)
+      ring->first_error = req->result;
+    ring->in_flight--;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+result_t pal_io_ring_submit(pal_io_ring_t *ring,
+                            pal_io_request_t *requests,
+                            size_t count) {
+  errors_assert_empty();
+  uint32_t entries = *ring->sq_mask + 1;
+  size_t index = 0;
+  while (index < count || ring->unsubmitted) {
+    uint32_t tail = *ring->sq_tail;
+    uint32_t head =
+        __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    uint32_t queued = 0;
+    // <3>
+    while (index < count && tail - head < entries &&
+           ring->in_flight + queued < entries) {
+      pal_io_request_t *req = &requests[index++];
+      uint32_t slot = tail & *ring->sq_mask;
+      struct io_uring_sqe *sqe = &ring->sqes[slot];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = req->op == pal_io_op_write ? IORING_OP_WRITEV
+                                               : IORING_OP_READV;
+      sqe->fd = req->handle->fd;
+      sqe->off = req->offset;
+      sqe->addr = (uint64_t)(uintptr_t)req->buffers;
+      sqe->len = (uint32_t)req->count;
+      sqe->user_data = (uint64_t)(uintptr_t)req;
+      ring->sq_array[slot] = slot;
+      req->result = 0;
+      tail++;
+      queued++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    ring->in_flight += queued;
+    ring->unsubmitted += queued;
+    // the ring is full, wait for at least one to complete
+    uint32_t wait = index < count ? 1 : 0;
+    ensure(pal_io_ring_enter(ring, wait));
+    pal_io_ring_reap(ring);
+  }
+  return success();
+}
+
+result_t pal_io_ring_wait(pal_io_ring_t *ring) {
+  pal_io_ring_reap(ring);
+  while (ring->in_flight) {
+    // a partial submit leaves entries queued, they go first
+    ensure(pal_io_ring_enter(ring, ring->in_flight));
+    pal_io_ring_reap(ring);
+  }
+  int error = ring->first_error;
+  ring->first_error = 0;
+  if (error) {
+    failed(error, msg("Asynchronous I/O operation failed"));
+  }
+  return success();
+}
+// end::pal_io_ring[]
+
+// tag::pal_reserve_address_space[]
+result_t pal_reserve_address_space(uint64_t size, span_t *range) {
+  errors_assert_empty();
+  // <1>
+  range->address = mmap(0, size, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1, 0);
+  if (range->address == MAP_FAILED) {
+    range->address = 0;
+    failed(errno, msg("Unable to reserve address space"),
+           with(size, "%lu"));
+  }
+  range->size = size;
+  return success();
+}
+
+result_t pal_mmap_fixed(file_handle_t *handle, uint64_t offset,
+                        span_t *m) {
+  errors_assert_empty();
+  // <2>
+  void *address = mmap(m->address, m->size, PROT_READ,
+                       MAP_SHARED | MAP_FIXED, handle->fd,
+                       (off_t)offset);
+  if (address == MAP_FAILED) {
+    failed(errno, msg("Unable to map file at a fixed address"),
+           with(handle->filename, "%s"), with(m->address, "%p"),
+           with(m->size, "%lu"));
+  }
+  return success();
+}
+// end::pal_reserve_address_space[]
+
+// tag::pal_commit_address_space[]
+result_t pal_commit_address_space(span_t *range,
+                                  enum pal_commit_flags flags) {
+  errors_assert_empty();
+  bool huge = flags & pal_commit_flags_huge_pages;
+  // <1>
+  int populate = (flags & pal_commit_flags_populate) && !huge
+                     ? MAP_POPULATE
+                     : 0;
+  void *address =
+      mmap(range->address, range->size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | populate, -1, 0);
+  if (address == MAP_FAILED) {
+    failed(errno, msg("Unable to commit reserved address space"),
+           with(range->address, "%p"), with(range->size, "%lu"));
+  }
+  if (!huge) return success();
+  // <2>
+  // only advice, the range is usable without huge pages
+  madvise(range->address, range->size, MADV_HUGEPAGE);
+#ifdef MADV_POPULATE_WRITE
+  if (flags & pal_commit_flags_populate)
+    madvise(range->address, range->size, MADV_POPULATE_WRITE);
+#endif
+  return success();
+}
+// end::pal_commit_address_space[]
@@ -1,5 +1,7 @@
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <gavran/infrastructure.h>
 #include <gavran/pal.h>
@@ -40,6 +42,99 @@ static result_t read_write_io(const char* file) {
 }
 // end::read_write_io[]
 
+// tag::io_ring_read_write[]
+static result_t io_ring_batch(pal_io_ring_t* ring, file_handle_t* h,
+                              char* data, enum pal_io_op op) {
+  // more requests than the ring depth, two buffers each
+  pal_io_request_t requests[32];
+  span_t buffers[64];
+  for (size_t i = 0; i < 32; i++) {
+    buffers[i * 2] = (span_t){.address = data + i * 4096,
+                              .size = 1024};
+    buffers[i * 2 + 1] = (span_t){
+        .address = data + i * 4096 + 1024, .size = 3072};
+    requests[i] = (pal_io_request_t){.handle = h,
+                                     .buffers = &buffers[i * 2],
+                                     .count = 2,
+                                     .offset = i * 4096,
+                                     .op = op};
+  }
+  ensure(pal_io_ring_submit(ring, requests, 32));
+  ensure(pal_io_ring_wait(ring));
+  for (size_t i = 0; i < 32; i++) ensure(requests[i].result == 0);
+  return success();
+}
+
+static result_t io_ring_read_write(const char* file) {
+  file_handle_t* h;
+  ensure(pal_create_file(file, &h, pal_file_creation_flags_none));
+  defer(pal_close_file, h);
+  ensure(pal_set_file_size(h, 1024 * 128, 1024 * 128));
+
+  pal_io_ring_t* ring;
+  ensure(pal_io_ring_create(8, &ring));
+  size_t done = 0;
+  try_defer(pal_io_ring_close, ring, done);
+
+  char* data;
+  ensure(mem_alloc((void*)&data, 1024 * 128 * 2));
+  defer(free, data);
+  for (size_t i = 0; i < 1024 * 128; i++) data[i] = (char)(i % 251);
+  ensure(io_ring_batch(ring, h, data, pal_io_op_write));
+  ensure(io_ring_batch(ring, h, data + 1024 * 128, pal_io_op_read));
+  ensure(memcmp(data, data + 1024 * 128, 1024 * 128) == 0);
+
+  done = 1;
+  ensure(pal_io_ring_close(ring));
+  return success();
+}
+// end::io_ring_read_write[]
+
+// tag::write_file_vectored[]
+static result_t write_file_vectored(const char* file) {
+  file_handle_t* h;
+  ensure(pal_create_file(file, &h, pal_file_creation_flags_none));
+  defer(pal_close_file, h);
+  ensure(pal_set_file_size(h, 1024 * 128, 1024 * 128));
+
+  // more buffers than a single pwritev takes
+  char data[100 * 512], check[100 * 512];
+  span_t buffers[100];
+  for (size_t i = 0; i < 100; i++) {
+    memset(data + i * 512, (int)i, 512);
+    buffers[i] = (span_t){.address = data + i * 512, .size = 512};
+  }
+  uint64_t syscalls = 0;
+  ensure(pal_write_file_vectored(h, 4096, buffers, 100, &syscalls));
+  ensure(syscalls == 2);
+  ensure(pal_read_file(h, 4096, check, sizeof(check)));
+  ensure(memcmp(data, check, sizeof(check)) == 0);
+  return success();
+}
+// end::write_file_vectored[]
+
+// tag::preallocate_file[]
+static result_t preallocate_file(const char* file) {
+  file_handle_t* h;
+  ensure(pal_create_file(file, &h,
+                         pal_file_creation_flags_preallocate));
+  defer(pal_close_file, h);
+  ensure(pal_set_file_size(h, 1024 * 128, UINT64_MAX));
+  ensure(pal_set_file_size(h, 1024 * 1024, UINT64_MAX));
+  ensure(h->size == 1024 * 1024);
+
+  struct stat st;
+  ensure(stat(file, &st) == 0);
+  ensure((uint64_t)st.st_size == 1024 * 1024);
+  // the blocks are allocated, not a sparse hole
+  ensure((uint64_t)st.st_blocks * 512 >= 1024 * 1024);
+
+  ensure(pal_set_file_size(h, 0, 1024 * 64));
+  ensure(h->size == 1024 * 64);
+  return success();
+}
+// end::preallocate_file[]
+
 // tag::tests[]
 describe(pal_tests) {
   const char file[] = "/tmp/files/try";
@@ -54,6 +149,16 @@ describe(pal_tests) {
 
   it("can read and write") { assert(read_write_io(file)); }
 
+  it("can preallocate file space") { assert(preallocate_file(file)); }
+
+  it("counts each vectored write") {
+    assert(write_file_vectored(file));
+  }
+
+  it("can batch reads and writes with io_uring") {
+    assert(io_ring_read_write(file));
+  }
+
   it("can get file name") {
     file_handle_t* h;
     assert(pal_create_file(file, &h, pal_file_creation_flags_none));
@@ -1,25 +1,165 @@
 #include <gavran/internal.h>
 #include <string.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// tag::pagesmap_layout[]
+#define PAGESMAP_GROUP 16
+#define PAGESMAP_EMPTY 0x80
+#define PAGESMAP_DELETED 0xFE  // only in a table being moved over
+#define PAGESMAP_MIGRATE_PER_PUT 32
+
+// the tags, keys and entries follow the header in one allocation
+static size_t pagesmap_size(size_t buckets) {
+  return sizeof(pages_map_t) + buckets + PAGESMAP_GROUP +
+         buckets * (sizeof(uint64_t) + sizeof(page_t));
+}
+
+static void pagesmap_init(pages_map_t *table, size_t buckets) {
+  table->number_of_buckets = buckets;
+  table->tags              = table->data;
+  table->keys = (uint64_t *)(table->data + buckets + PAGESMAP_GROUP);
+  table->entries = (page_t *)(table->keys + buckets);
+  memset(table->tags, PAGESMAP_EMPTY, buckets + PAGESMAP_GROUP);
+}
+
+// <1>
+// page numbers are mostly dense, folding the higher bits in keeps a
+// dense range in distinct slots, like the modulo did, and spreads
+// strided ones. Only pages a large power of two apart still share a
+// home. The tag must tell neighbors apart, so it hashes the number
+static size_t pagesmap_home(uint64_t page_num) {
+  return (size_t)(page_num ^ (page_num >> 6));
+}
+
+static uint8_t pagesmap_tag(uint64_t page_num) {
+  return (uint8_t)((page_num * 0x9E3779B97F4A7C15UL) >> 57);
+}
+
+// <2>
+// the first group of tags is mirrored past the end, so a group can
+// be loaded from any slot without wrapping
+static void pagesmap_set_tag(
+    pages_map_t *table, size_t index, uint8_t tag) {
+  table->tags[index] = tag;
+  if (index < PAGESMAP_GROUP)
+    table->tags[table->number_of_buckets + index] = tag;
+}
+
+static void pagesmap_match_group(const uint8_t *tags, uint8_t tag,
+    uint32_t *match, uint32_t *empty) {
+#if defined(__x86_64__)
+  __m128i group = _mm_loadu_si128((const __m128i *)tags);
+  *match        = (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+  *empty = (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)PAGESMAP_EMPTY)));
+#else
+  *match = *empty = 0;
+  for (uint32_t i = 0; i < PAGESMAP_GROUP; i++) {
+    *match |= (uint32_t)(tags[i] == tag) << i;
+    *empty |= (uint32_t)(tags[i] == PAGESMAP_EMPTY) << i;
+  }
+#endif
+}
+
+// <3>
+// linear probing, sixteen slots at a time, up to the first empty
+// slot, which is where the page would go
+static bool pagesmap_find(
+    pages_map_t *table, uint64_t page_num, size_t *index) {
+  size_t mask = table->number_of_buckets - 1;
+  uint8_t tag = pagesmap_tag(page_num);
+  size_t pos  = pagesmap_home(page_num) & mask;
+  for (;; pos = (pos + PAGESMAP_GROUP) & mask) {
+    uint32_t match, empty;
+    pagesmap_match_group(table->tags + pos, tag, &match, &empty);
+    if (empty) match &= (1u << __builtin_ctz(empty)) - 1;
+    for (; match; match &= match - 1) {
+      size_t i = (pos + (size_t)__builtin_ctz(match)) & mask;
+      if (table->keys[i] == page_num) {
+        *index = i;
+        return true;
+      }
+    }
+    if (empty) {
+      *index = (pos + (size_t)__builtin_ctz(empty)) & mask;
+      return false;
+    }
+  }
+}
+
+// <4>
+// most pages sit in their home slot, and only a slot that holds a
+// page has an address, so a hit costs one cache line and no tags
+static page_t *pagesmap_get(pages_map_t *table, uint64_t page_num) {
+  size_t mask = table->number_of_buckets - 1;
+  page_t *home = &table->entries[pagesmap_home(page_num) & mask];
+  if (home->page_num == page_num && home->address) return home;
+  size_t index;
+  if (!pagesmap_find(table, page_num, &index)) return 0;
+  return &table->entries[index];
+}
+
+static void pagesmap_place(
+    pages_map_t *table, size_t index, page_t *page) {
+  pagesmap_set_tag(table, index, pagesmap_tag(page->page_num));
+  table->keys[index] = page->page_num;
+  memcpy(&table->entries[index], page, sizeof(page_t));
+  table->used++;
+  size_t load_factor     = (table->number_of_buckets * 3 / 4);
+  table->resize_required = (table->used > load_factor);
+}
+
+static void pagesmap_clear_slot(
+    pages_map_t *table, size_t index, uint8_t tag) {
+  pagesmap_set_tag(table, index, tag);
+  memset(&table->entries[index], 0, sizeof(page_t));
+}
+// end::pagesmap_layout[]
+
 // tag::pagesmap_expand_table[]
+// <1>
+// a few buckets of the previous table move over on each put, it is
+// done well before the next resize, see pagesmap_expand_table
+static void pagesmap_migrate(pages_map_t *table, size_t buckets) {
+  pages_map_t *previous = table->previous;
+  if (!previous) return;
+  size_t end =
+      MIN(table->migrated + buckets, previous->number_of_buckets);
+  for (; table->migrated < end; table->migrated++) {
+    size_t i = table->migrated;
+    if (previous->tags[i] & PAGESMAP_EMPTY) continue;
+    size_t index;
+    pagesmap_find(table, previous->keys[i], &index);
+    pagesmap_place(table, index, &previous->entries[i]);
+    // the probes that pass here must go on
+    pagesmap_clear_slot(previous, i, PAGESMAP_DELETED);
+  }
+  if (table->migrated == previous->number_of_buckets) {
+    free(previous);
+    table->previous = 0;
+  }
+}
+
+// <2>
+// the table doubles, but the pages are moved over incrementally, so
+// no single put pays for a full rehash
 static result_t pagesmap_expand_table(pages_map_t **state_ptr) {
-  pages_map_t *state           = *state_ptr;
+  pages_map_t *state = *state_ptr;
+  // 3/8 of the new buckets are put before it fills up again, much
+  // more than it takes to move this many pages
+  pagesmap_migrate(state, SIZE_MAX);
   size_t new_number_of_entries = state->number_of_buckets * 2;
-  size_t new_size =
-      sizeof(pages_map_t) + (new_number_of_entries * sizeof(page_t));
   pages_map_t *new_state;
-  ensure(mem_calloc((void *)&new_state, new_size));
-  size_t done = 0;
-  try_defer(free, new_state, done);
-  new_state->number_of_buckets = new_number_of_entries;
-  size_t iter_state            = 0;
-  page_t *p;
-  while (pagesmap_get_next(state, &iter_state, &p)) {
-    ensure(pagesmap_put_new(&new_state, p));
-  }
-  *state_ptr = new_state;  // update caller's reference
-  free(state);
-  done = 1;
+  ensure(mem_calloc(
+      (void *)&new_state, pagesmap_size(new_number_of_entries)));
+  pagesmap_init(new_state, new_number_of_entries);
+  new_state->count    = state->count;
+  new_state->previous = state;
+  *state_ptr          = new_state;  // update caller's reference
   return success();
 }
 // end::pagesmap_expand_table[]
@@ -29,37 +169,91 @@ result_t pagesmap_put_new(pages_map_t **table_p, page_t *page) {
   if ((*table_p)->resize_required) {
     ensure(pagesmap_expand_table(table_p));
   }
-  pages_map_t *state  = *table_p;
-  uint64_t page_num   = page->page_num;
-  size_t starting_pos = (size_t)(page_num % state->number_of_buckets);
-  for (size_t i = 0; i < state->number_of_buckets; i++) {
-    size_t index = (i + starting_pos) % state->number_of_buckets;
-    if (state->entries[index].page_num == page_num &&
-        state->entries[index].address) {
+  pages_map_t *state = *table_p;
+  pagesmap_migrate(state, PAGESMAP_MIGRATE_PER_PUT);
+  uint64_t page_num = page->page_num;
+  page_t *existing  = pagesmap_get(state, page_num);
+  if (!existing && state->previous)
+    existing = pagesmap_get(state->previous, page_num);
+  if (existing) {
+    if (existing->address) {
       failed(EINVAL, msg("Page already exists in table"),
           with(page_num, "%lu"));
     }
-
-    if (!state->entries[index].address) {
-      state->entries[index].page_num = page_num;
-      memcpy(&state->entries[index], page, sizeof(page_t));
-      state->count++;
-      size_t load_factor     = (state->number_of_buckets * 3 / 4);
-      state->resize_required = (state->count > load_factor);
-      return success();
-    }
+    // its owner took the page away, see txn_merge_unique_pages
+    memcpy(existing, page, sizeof(page_t));
+    return success();
   }
-  failed(ENOSPC, msg("No room for entry, should not happen"));
+  size_t index;
+  pagesmap_find(state, page_num, &index);
+  pagesmap_place(state, index, page);
+  state->count++;
+  return success();
 }
 // end::pagesmap_put_new[]
 
+// tag::pagesmap_remove[]
+// <1>
+// no tombstones, the rest of the cluster is shifted back instead, so
+// lookups never scan past removed pages
+static void pagesmap_remove_slot(pages_map_t *table, size_t hole) {
+  size_t mask = table->number_of_buckets - 1;
+  for (size_t next = (hole + 1) & mask;
+       table->tags[next] != PAGESMAP_EMPTY;
+       next = (next + 1) & mask) {
+    size_t home = pagesmap_home(table->keys[next]) & mask;
+    // only move it if that doesn't put it before its home
+    if (((next - home) & mask) < ((next - hole) & mask)) continue;
+    pagesmap_set_tag(table, hole, table->tags[next]);
+    table->keys[hole] = table->keys[next];
+    memcpy(
+        &table->entries[hole], &table->entries[next], sizeof(page_t));
+    hole = next;
+  }
+  pagesmap_clear_slot(table, hole, PAGESMAP_EMPTY);
+  table->used--;
+  size_t load_factor     = (table->number_of_buckets * 3 / 4);
+  table->resize_required = (table->used > load_factor);
+}
+
+bool pagesmap_remove(pages_map_t *table, page_t *page) {
+  if (!table) return false;
+  uint64_t page_num = page->page_num;
+  size_t index;
+  if (pagesmap_find(table, page_num, &index)) {
+    memcpy(page, &table->entries[index], sizeof(page_t));
+    pagesmap_remove_slot(table, index);
+  } else {
+    // shifting would mix moved and unmoved pages, so the table that
+    // is being moved over gets a tombstone, it is freed soon anyway
+    pages_map_t *previous = table->previous;
+    if (!previous || !pagesmap_find(previous, page_num, &index))
+      return false;
+    memcpy(page, &previous->entries[index], sizeof(page_t));
+    pagesmap_clear_slot(previous, index, PAGESMAP_DELETED);
+  }
+  table->count--;
+  return true;
+}
+// end::pagesmap_remove[]
+
 // tag::pagesmap_get_next[]
+// the pages still in the previous table come after ours
 bool pagesmap_get_next(
     pages_map_t *table, size_t *state, page_t **page) {
   if (!table) return false;
-  for (; *state < table->number_of_buckets; (*state)++) {
-    if (!table->entries[*state].address) continue;
-    *page = &table->entries[*state];
+  for (;; (*state)++) {
+    pages_map_t *cur = table;
+    size_t index     = *state;
+    if (index >= table->number_of_buckets) {
+      cur = table->previous;
+      index -= table->number_of_buckets;
+      if (!cur || index >= cur->number_of_buckets) break;
+    }
+    if ((cur->tags[index] & PAGESMAP_EMPTY) ||
+        !cur->entries[index].address)
+      continue;
+    *page = &cur->entries[index];
     (*state)++;
     return true;
   }
@@ -71,29 +265,27 @@ bool pagesmap_get_next(
 // tag::pagesmap_new_and_lookup[]
 result_t pagesmap_new(
     size_t initial_number_of_elements, pages_map_t **table) {
-  size_t initial_size = sizeof(pages_map_t) +
-                        initial_number_of_elements * sizeof(page_t);
-  ensure(mem_calloc((void *)table, initial_size));
-  (*table)->number_of_buckets = initial_number_of_elements;
+  size_t buckets = next_power_of_two(
+      MAX(initial_number_of_elements, PAGESMAP_GROUP));
+  ensure(mem_calloc((void *)table, pagesmap_size(buckets)));
+  pagesmap_init(*table, buckets);
   return success();
 }
 
+void pagesmap_free(pages_map_t *table) {
+  if (!table) return;
+  free(table->previous);
+  free(table);
+}
+
 bool pagesmap_lookup(pages_map_t *table, page_t *page) {
   if (!table) return false;
-  uint64_t page_num = page->page_num;
-  if (!table->number_of_buckets) return false;
-  size_t starting_pos = (size_t)(page_num % table->number_of_buckets);
-  for (size_t i = 0; i < table->number_of_buckets; i++) {
-    size_t index = (i + starting_pos) % table->number_of_buckets;
-    if (!table->entries[index].address) {
-      // empty value, so there is no match
-      return false;
-    }
-    if (table->entries[index].page_num == page_num) {
-      memcpy(page, &table->entries[index], sizeof(page_t));
-      return true;
-    }
-  }
-  return false;
+  page_t *entry = pagesmap_get(table, page->page_num);
+  if (!entry && table->previous)
+    entry = pagesmap_get(table->previous, page->page_num);
+  // the entry was taken away by its owner
+  if (!entry || !entry->address) return false;
+  memcpy(page, entry, sizeof(page_t));
+  return true;
 }
 // end::pagesmap_new_and_lookup[]
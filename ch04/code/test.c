@@ -3,9 +3,11 @@
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <gavran/db.h>
+#include <gavran/internal.h>
 #include <gavran/test.h>
 
 // tag::create_and_write_file[]
@@ -196,3 +198,245 @@ describe(db_basic_tests) {
   }
 }
 // end::tests[]
+
+// tag::tests_pages_map[]
+// <1>
+// random puts and removes, checked against a plain array
+static result_t pages_map_matches_reference(size_t operations) {
+  enum { range = 4096 };
+  static bool present[range];
+  memset(present, 0, sizeof(present));
+  pages_map_t* pages;
+  ensure(pagesmap_new(8, &pages));
+  defer(pagesmap_free, pages);
+  uint64_t seed  = 42;
+  size_t count   = 0;
+  char marker[1] = {0};
+  for (size_t i = 0; i < operations; i++) {
+    seed      = seed * 6364136223846793005UL + 1442695040888963407UL;
+    uint64_t page_num = (seed >> 33) % range;
+    page_t p = {.page_num = page_num, .address = marker};
+    if (present[page_num]) {
+      ensure(pagesmap_remove(pages, &p));
+      ensure(p.page_num == page_num && p.address == marker);
+      count--;
+    } else {
+      ensure(pagesmap_put_new(&pages, &p));
+      count++;
+    }
+    present[page_num] = !present[page_num];
+    ensure(pages->count == count);
+    page_t check = {.page_num = (seed >> 17) % range};
+    ensure(pagesmap_lookup(pages, &check) == present[check.page_num],
+        msg("Lookup doesn't match"), with(check.page_num, "%lu"));
+  }
+  size_t iter_state = 0, seen = 0;
+  page_t* p;
+  while (pagesmap_get_next(pages, &iter_state, &p)) {
+    ensure(present[p->page_num]);
+    seen++;
+  }
+  ensure(seen == count);
+  return success();
+}
+
+// <2>
+// the table as it was before, to compare against
+typedef struct legacy_map {
+  size_t number_of_buckets;
+  size_t count;
+  page_t entries[];
+} legacy_map_t;
+
+__attribute__((noinline)) static bool legacy_map_lookup(
+    legacy_map_t* table, page_t* page) {
+  size_t start = (size_t)(page->page_num % table->number_of_buckets);
+  for (size_t i = 0; i < table->number_of_buckets; i++) {
+    size_t index = (i + start) % table->number_of_buckets;
+    if (!table->entries[index].address) return false;
+    if (table->entries[index].page_num == page->page_num) {
+      memcpy(page, &table->entries[index], sizeof(page_t));
+      return true;
+    }
+  }
+  return false;
+}
+
+static void legacy_map_put(legacy_map_t* table, page_t* page) {
+  size_t start = (size_t)(page->page_num % table->number_of_buckets);
+  for (size_t i = 0; i < table->number_of_buckets; i++) {
+    size_t index = (i + start) % table->number_of_buckets;
+    if (table->entries[index].address) continue;
+    memcpy(&table->entries[index], page, sizeof(page_t));
+    table->count++;
+    return;
+  }
+}
+
+static double elapsed_ns(struct timespec* start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) * 1e9 +
+         (double)(end.tv_nsec - start->tv_nsec);
+}
+
+// a stride of zero scatters the pages over a 40 bits range
+static uint64_t benchmark_page_num(uint64_t stride, size_t i) {
+  if (stride) return 1024 + stride * i;
+  uint64_t x = (i + 1) * 0x9E3779B97F4A7C15UL;
+  x          = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9UL;
+  return (x ^ (x >> 31)) >> 24;
+}
+
+// <3>
+// a working set of pages spaced _stride_ apart, and lookups of which
+// most hit
+static result_t benchmark_pages_map(
+    size_t size, uint64_t stride, size_t lookups) {
+  uint64_t* trace;
+  ensure(mem_alloc((void*)&trace, lookups * sizeof(uint64_t)));
+  defer(free, trace);
+  uint64_t seed = 7;
+  for (size_t i = 0; i < lookups; i++) {
+    seed     = seed * 6364136223846793005UL + 1442695040888963407UL;
+    trace[i] = benchmark_page_num(
+        stride, (seed >> 33) % (size + size / 8));
+  }
+  pages_map_t* pages;
+  ensure(pagesmap_new(8, &pages));
+  defer(pagesmap_free, pages);
+  size_t buckets = next_power_of_two(size * 2);
+  legacy_map_t* legacy;
+  ensure(mem_calloc((void*)&legacy,
+      sizeof(legacy_map_t) + buckets * sizeof(page_t)));
+  defer(free, legacy);
+  legacy->number_of_buckets = buckets;
+  for (size_t i = 0; i < size; i++) {
+    page_t p = {
+        .page_num = benchmark_page_num(stride, i), .address = trace};
+    ensure(pagesmap_put_new(&pages, &p));
+    legacy_map_put(legacy, &p);
+  }
+  size_t hits[2] = {0};
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < lookups; i++) {
+    page_t p = {.page_num = trace[i]};
+    hits[0] += legacy_map_lookup(legacy, &p);
+  }
+  double legacy_ns = elapsed_ns(&start);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < lookups; i++) {
+    page_t p = {.page_num = trace[i]};
+    hits[1] += pagesmap_lookup(pages, &p);
+  }
+  double ns = elapsed_ns(&start);
+  ensure(hits[0] == hits[1]);
+  printf("pages map %zu, stride %lu: %.1f ns per lookup, was %.1f\n",
+      size, stride, ns / (double)lookups,
+      legacy_ns / (double)lookups);
+  return success();
+}
+
+describe(pages_map) {
+  before_each() { errors_clear(); }
+
+  it("matches a reference under random puts and removes") {
+    assert(pages_map_matches_reference(100000));
+  }
+
+  it("grows and finds every page") {
+    pages_map_t* pages;
+    assert(pagesmap_new(8, &pages));
+    defer(pagesmap_free, pages);
+    char marker[1] = {0};
+    for (uint64_t i = 0; i < 10000; i++) {
+      page_t p = {.page_num = i * 7919, .address = marker};
+      assert(pagesmap_put_new(&pages, &p));
+    }
+    assert(pages->count == 10000);
+    assert(pages->number_of_buckets == 16384);
+    for (uint64_t i = 0; i < 10000; i++) {
+      page_t p = {.page_num = i * 7919};
+      assert(pagesmap_lookup(pages, &p));
+      assert(p.address == marker);
+      p.page_num = i * 7919 + 1;
+      assert(!pagesmap_lookup(pages, &p));
+    }
+    page_t dup = {.page_num = 7919, .address = marker};
+    assert(!pagesmap_put_new(&pages, &dup));
+    errors_clear();
+  }
+
+  it("moves pages over to the grown table on each put") {
+    pages_map_t* pages;
+    assert(pagesmap_new(8, &pages));
+    defer(pagesmap_free, pages);
+    char marker[1] = {0};
+    uint64_t next  = 0;
+    while (!pages->previous) {
+      page_t p = {.page_num = next++ * 3, .address = marker};
+      assert(pagesmap_put_new(&pages, &p));
+    }
+    // half of the pages are still in the previous table
+    page_t p = {.page_num = 0};
+    assert(pagesmap_remove(pages, &p));
+    uint64_t last = next - 1;
+    p.page_num    = last * 3;
+    assert(pagesmap_remove(pages, &p));
+    assert(!pagesmap_remove(pages, &p));
+    for (uint64_t i = 1; i < last; i++) {
+      page_t check = {.page_num = i * 3};
+      assert(pagesmap_lookup(pages, &check));
+    }
+    size_t iter_state = 0, seen = 0;
+    page_t* entry;
+    while (pagesmap_get_next(pages, &iter_state, &entry)) seen++;
+    assert(seen == last - 1 && pages->count == last - 1);
+    while (pages->previous) {
+      page_t more = {.page_num = next++ * 3, .address = marker};
+      assert(pagesmap_put_new(&pages, &more));
+    }
+    p.page_num = 0;
+    assert(!pagesmap_lookup(pages, &p));
+    for (uint64_t i = 1; i < next; i++) {
+      page_t check = {.page_num = i * 3};
+      assert(pagesmap_lookup(pages, &check) == (i != last));
+    }
+  }
+
+  it("hides pages whose owner took them away") {
+    pages_map_t* pages;
+    assert(pagesmap_new(8, &pages));
+    defer(pagesmap_free, pages);
+    char marker[1] = {0};
+    page_t p       = {.page_num = 3, .address = marker};
+    assert(pagesmap_put_new(&pages, &p));
+    size_t iter_state = 0;
+    page_t* entry;
+    assert(pagesmap_get_next(pages, &iter_state, &entry));
+    entry->address = 0;
+    assert(!pagesmap_lookup(pages, &p));
+    iter_state = 0;
+    assert(!pagesmap_get_next(pages, &iter_state, &entry));
+    p.address = marker;
+    assert(pagesmap_put_new(&pages, &p));
+    assert(pagesmap_lookup(pages, &p));
+  }
+
+  // GAVRAN_BENCHMARK=1 to compare with the previous table
+  it("benchmark lookups") {
+    if (getenv("GAVRAN_BENCHMARK")) {
+      size_t lookups = 10 * 1000 * 1000;
+      assert(benchmark_pages_map(64, 1, lookups));
+      assert(benchmark_pages_map(4096, 1, lookups));
+      assert(benchmark_pages_map(256 * 1024, 1, lookups));
+      assert(benchmark_pages_map(64, 64, lookups));
+      assert(benchmark_pages_map(4096, 64, lookups));
+      assert(benchmark_pages_map(4096, PAGES_IN_METADATA, lookups));
+      assert(benchmark_pages_map(4096, 0, lookups));
+      assert(benchmark_pages_map(256 * 1024, 0, lookups));
+    }
+  }
+}
+// end::tests_pages_map[]
@@ -91,7 +91,7 @@ result_t txn_close(txn_t *tx) {
     free(p->address);
     p->address = 0;
   }
-  free(tx->state->modified_pages);
+  pagesmap_free(tx->state->modified_pages);
   free(tx->state);
 
   tx->state = 0;
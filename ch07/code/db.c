@@ -13,7 +13,8 @@ db_initialize_default_read_tx(db_state_t *db_state) {
   tx->number_of_pages = db_state->number_of_pages;
   tx->flags = TX_READ | TX_COMMITED | db_state->options.flags;
   tx->can_free_after_tx_id = UINT64_MAX;
-  db_state->last_write_tx = db_state->default_read_tx;
+  db_state->last_write_tx   = db_state->default_read_tx;
+  db_state->last_visible_tx = db_state->default_read_tx;
   return success();
 }
 // end::db_initialize_default_read_tx[]
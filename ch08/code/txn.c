@@ -128,7 +128,7 @@ implementation_detail void txn_free_single_tx_state(
   while (pagesmap_get_next(state->modified_pages, &iter_state, &p)) {
     free(p->address);
   }
-  free(state->modified_pages);
+  pagesmap_free(state->modified_pages);
   free(state);
 }
 // end::txn_free_single_tx_state[]
@@ -194,7 +194,7 @@ static result_t free_hash_table_and_contents(pages_map_t **pages) {
   while (pagesmap_get_next(*pages, &iter_state, &p)) {
     free(p->address);
   }
-  free(*pages);
+  pagesmap_free(*pages);
   return success();
 }
 enable_defer(free_hash_table_and_contents);
@@ -272,7 +272,7 @@ static result_t wal_recover(db_t *db, wal_state_t *wal) {
   wal_init_recover_state(db, wal, &recovery_state);
   pages_map_t *recovered_pages;
   ensure(pagesmap_new(16, &recovered_pages));
-  defer(free, recovered_pages);
+  defer(pagesmap_free, recovered_pages);
 
   while (true) {
     wal_txn_t *tx;
@@ -62,6 +62,10 @@ static result_t db_move_free_space_bitmap(
   ensure(txn_raw_modify_page(tx, &new_page));
   memcpy(new_page.address, new_map, pages * PAGE_SIZE);
   // <8>
+  uint64_t wal_dictionary_page =
+      old_metadata->free_space.wal_dictionary_page;
+  uint64_t wal_retired_dictionary_page =
+      old_metadata->free_space.wal_retired_dictionary_page;
   page_metadata_t *free_space_metadata;
   ensure(txn_modify_metadata(tx, search.output.found_position,
                              &free_space_metadata));
@@ -69,6 +73,10 @@ static result_t db_move_free_space_bitmap(
       page_flags_free_space_bitmap;
   // <9>
   free_space_metadata->free_space.number_of_pages = pages;
+  free_space_metadata->free_space.wal_dictionary_page =
+      wal_dictionary_page;
+  free_space_metadata->free_space.wal_retired_dictionary_page =
+      wal_retired_dictionary_page;
   // <10>
   ensure(txn_free_page(tx, old));  // release the old space
   return success();
@@ -124,16 +132,60 @@ static result_t db_new_size_can_fit_free_space_bitmap(
   *new_size += required_pages * PAGE_SIZE;
   return success();
 }
+// tag::db_align_to_file_extent[]
+implementation_detail uint64_t db_align_to_file_extent(
+    db_options_t *options, uint64_t size) {
+  if (!(options->flags & db_flags_preallocate)) return size;
+  uint64_t extent = options->file_extent_size;
+  // <1>
+  uint64_t aligned = ROUND_UP(size, extent) * extent;
+  return aligned < options->maximum_size ? aligned : size;
+}
+// end::db_align_to_file_extent[]
+
+// tag::db_extend_reserved_map[]
+implementation_detail bool db_can_extend_map_in_place(
+    db_state_t *db, span_t *map, uint64_t new_size) {
+  return map->address &&
+         map->address == db->map_reservation.address &&
+         new_size <= db->map_reservation.size;
+}
+
+implementation_detail result_t db_extend_map_in_place(
+    db_state_t *db, span_t *map, uint64_t new_size) {
+  if (new_size <= map->size) return success();
+  // <1>
+  span_t delta = {.address = (char *)map->address + map->size,
+                  .size = new_size - map->size};
+  ensure(pal_mmap_fixed(db->handle, map->size, &delta),
+         msg("Unable to extend the map in place"),
+         with(new_size, "%lu"));
+  map->size = new_size;
+  return success();
+}
+// end::db_extend_reserved_map[]
+
 implementation_detail result_t
 db_increase_file_size(txn_t *tx, uint64_t new_size) {
   ensure(db_new_size_can_fit_free_space_bitmap(tx->state->map.size,
                                                &new_size));
+  new_size =
+      db_align_to_file_extent(&tx->state->db->options, new_size);
   ensure(new_size < tx->state->db->options.maximum_size,
          msg("Unable to grow the database beyond the maximum size"),
          with(new_size, "%lu"),
          with(tx->state->db->options.maximum_size, "%lu"));
   file_handle_t *handle = tx->state->db->handle;
   ensure(pal_set_file_size(handle, new_size, UINT64_MAX));
+  // <2>
+  if (db_can_extend_map_in_place(tx->state->db, &tx->state->map,
+                                 new_size)) {
+    // existing pages keep their addresses, nothing to clean up
+    ensure(db_extend_map_in_place(tx->state->db, &tx->state->map,
+                                  new_size));
+    tx->state->number_of_pages = new_size / PAGE_SIZE;
+    return success();
+  }
   span_t new_map = {.size = new_size};
   ensure(pal_mmap(handle, 0, &new_map),
          msg("Unable to map the file again"),
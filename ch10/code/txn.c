@@ -142,7 +142,7 @@ implementation_detail void txn_free_single_tx_state(
     state->on_forget = cur->next;
     free(cur);
   }
-  free(state->modified_pages);
+  pagesmap_free(state->modified_pages);
   free(state);
 }
 // end::txn_free_single_tx_state[]
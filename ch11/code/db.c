@@ -2,6 +2,74 @@
 #include <gavran/internal.h>
 #include <string.h>
 
+// tag::db_init_locks[]
+static result_t db_init_locks(db_state_t *state) {
+  // recursive, a writer may open and close read transactions
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  int rc = pthread_mutex_init(&state->txn_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (rc) {
+    failed(rc, msg("Unable to initialize the transactions lock"));
+  }
+  pthread_mutex_init(&state->publish_lock, 0);
+  pthread_mutex_init(&state->checkpointer.lock, 0);
+  pthread_cond_init(&state->checkpointer.work, 0);
+  pthread_cond_init(&state->checkpointer.done, 0);
+  pthread_mutex_init(&state->finalizer.lock, 0);
+  pthread_cond_init(&state->finalizer.work, 0);
+  pthread_cond_init(&state->finalizer.done, 0);
+  pthread_mutex_init(&state->page_cache.lock, 0);
+  pthread_mutex_init(&state->subkey_cache.lock, 0);
+  pthread_mutex_init(&state->decrypted_cache.lock, 0);
+  pthread_mutex_init(&state->page_slab.lock, 0);
+  return success();
+}
+
+static void db_destroy_locks(db_state_t *state) {
+  pthread_mutex_destroy(&state->txn_lock);
+  pthread_mutex_destroy(&state->publish_lock);
+  pthread_mutex_destroy(&state->checkpointer.lock);
+  pthread_cond_destroy(&state->checkpointer.work);
+  pthread_cond_destroy(&state->checkpointer.done);
+  pthread_mutex_destroy(&state->finalizer.lock);
+  pthread_cond_destroy(&state->finalizer.work);
+  pthread_cond_destroy(&state->finalizer.done);
+  pthread_mutex_destroy(&state->page_cache.lock);
+  pthread_mutex_destroy(&state->subkey_cache.lock);
+  pthread_mutex_destroy(&state->decrypted_cache.lock);
+  pthread_mutex_destroy(&state->page_slab.lock);
+}
+// end::db_init_locks[]
+
+// tag::db_file_creation_flags[]
+implementation_detail enum pal_file_creation_flags
+db_file_creation_flags(db_options_t *options) {
+  return (options->flags & db_flags_preallocate)
+             ? pal_file_creation_flags_preallocate
+             : pal_file_creation_flags_none;
+}
+// end::db_file_creation_flags[]
+
+// tag::db_map_file[]
+static result_t db_map_file(db_state_t *state) {
+  uint64_t reserve = state->options.map_reserve_size;
+  if (reserve <= state->map.size) {
+    ensure(pal_mmap(state->handle, 0, &state->map));
+    return success();
+  }
+  // <1>
+  ensure(pal_reserve_address_space(reserve, &state->map_reservation));
+  state->map.address = state->map_reservation.address;
+  ensure(pal_mmap_fixed(state->handle, 0, &state->map));
+  return success();
+}
+// end::db_map_file[]
+
+// requests in flight when flushing pages with io_uring
+#define DB_IO_RING_DEPTH 64
+
 // tag::db_create[]
 result_t db_create(const char *path, db_options_t *options,
                    db_t *db) {
@@ -13,8 +81,9 @@ result_t db_create(const char *path, db_options_t *options,
   size_t done = 0;
   ensure(mem_calloc((void *)&db->state, sizeof(db_state_t)));
   try_defer(db_close, *db, done);
+  ensure(db_init_locks(db->state));
   ensure(pal_create_file(path, &db->state->handle,
-                         pal_file_creation_flags_none));
+                         db_file_creation_flags(&owned_options)));
   memcpy(&db->state->options, &owned_options, sizeof(db_options_t));
   ensure(pal_set_file_size(db->state->handle,
                            owned_options.minimum_size, UINT64_MAX));
@@ -22,9 +91,12 @@ result_t db_create(const char *path, db_options_t *options,
   db->state->number_of_pages = db->state->handle->size / PAGE_SIZE;
   // tag::db_create_32_bits[]
   if (!(owned_options.flags & db_flags_avoid_mmap_io)) {
-    ensure(pal_mmap(db->state->handle, 0, &db->state->map));
+    ensure(db_map_file(db->state));
   }
   // end::db_create_32_bits[]
+  if (owned_options.flags & db_flags_io_uring) {
+    ensure(pal_io_ring_create(DB_IO_RING_DEPTH, &db->state->io_ring));
+  }
   ensure(db_initialize_default_read_tx(db->state));
   ensure(wal_open_and_recover(db));
   ensure(db_init(db));
@@ -42,8 +114,59 @@ implementation_detail result_t db_validate_options(
     options->minimum_size = user_options->minimum_size;
   if (user_options->maximum_size)
     options->maximum_size = user_options->maximum_size;
+  options->map_reserve_size = user_options->map_reserve_size;
+  if (user_options->file_extent_size) {
+    if (user_options->file_extent_size % PAGE_SIZE) {
+      failed(EINVAL,
+             msg("The file extent size must be a multiple of the "
+                 "page size"),
+             with(user_options->file_extent_size, "%lu"));
+    }
+    options->file_extent_size = user_options->file_extent_size;
+  }
   if (user_options->wal_size)
     options->wal_size = user_options->wal_size;
+  options->wal_compression_level =
+      user_options->wal_compression_level;
+  options->wal_dictionary_size = user_options->wal_dictionary_size;
+  if (user_options->wal_segments) {
+    if (user_options->wal_segments < 2 ||
+        user_options->wal_segments > WAL_MAX_SEGMENTS) {
+      failed(EINVAL,
+             msg("The number of WAL segments must be between 2 and "
+                 "WAL_MAX_SEGMENTS"),
+             with(user_options->wal_segments, "%u"));
+    }
+    options->wal_segments = user_options->wal_segments;
+  }
+  options->wal_recovery_workers = user_options->wal_recovery_workers;
+  if (user_options->checksum_algorithm > checksum_crc32c) {
+    failed(EINVAL, msg("Unknown checksum algorithm"),
+           with(user_options->checksum_algorithm, "%d"));
+  }
+  options->checksum_algorithm = user_options->checksum_algorithm;
+  if (user_options->finalize_workers > TXN_FINALIZER_MAX_WORKERS) {
+    failed(EINVAL,
+           msg("The number of finalize workers must be at most "
+               "TXN_FINALIZER_MAX_WORKERS"),
+           with(user_options->finalize_workers, "%u"));
+  }
+  options->finalize_workers = user_options->finalize_workers;
+  options->subkey_cache_size = user_options->subkey_cache_size;
+  options->decrypted_cache_size = user_options->decrypted_cache_size;
+  options->page_slab_size = user_options->page_slab_size;
+  options->wal_archive_callback = user_options->wal_archive_callback;
+  options->wal_archive_callback_state =
+      user_options->wal_archive_callback_state;
+  if (user_options->wal_async_flush_ms)
+    options->wal_async_flush_ms = user_options->wal_async_flush_ms;
+  if (user_options->wal_async_flush_bytes)
+    options->wal_async_flush_bytes =
+        user_options->wal_async_flush_bytes;
+  if (user_options->checkpoint_dirty_limit)
+    options->checkpoint_dirty_limit =
+        user_options->checkpoint_dirty_limit;
+  options->page_cache_size = user_options->page_cache_size;
   options->flags = user_options->flags;
   if (!(options->flags & db_flags_page_validation_none))
     options->flags |= db_flags_page_validation_once;
@@ -90,6 +213,11 @@ implementation_detail void db_initialize_default_options(
   options->minimum_size = 1024 * 1024;
   options->maximum_size = UINT64_MAX;
   options->wal_size = 256 * 1024;
+  options->wal_async_flush_ms = 10;
+  options->wal_async_flush_bytes = 1024 * 1024;
+  options->checkpoint_dirty_limit = 64 * 1024 * 1024;
+  options->file_extent_size = 16 * 1024 * 1024;
+  options->wal_segments = 2;
 }
 // end::db_initialize_default_options[]
 
@@ -97,23 +225,45 @@ implementation_detail void db_initialize_default_options(
 result_t db_close(db_t *db) {
   if (!db || !db->state) return success();  // double close?
 
+  // run registered shutdown hooks, such as background threads
+  while (db->state->on_close) {
+    cleanup_callback_t *cur = db->state->on_close;
+    cur->func(cur->state);
+    db->state->on_close = cur->next;
+    free(cur);
+  }
+
   bool failure = false;
-  failure |= !pal_unmap(&db->state->map);
+  // a map inside the reservation goes away with it
+  if (db->state->map.address != db->state->map_reservation.address)
+    failure |= !pal_unmap(&db->state->map);
+  failure |= !pal_unmap(&db->state->map_reservation);
   failure |= !pal_close_file(db->state->handle);
   failure |= !wal_close(db->state);
+  failure |= !pal_io_ring_close(db->state->io_ring);
 
   if (failure) {
     errors_push(EIO, msg("Unable to properly close the database"));
   }
 
-  while (db->state->last_write_tx &&
-         db->state->default_read_tx != db->state->last_write_tx) {
-    txn_state_t *cur = db->state->last_write_tx;
-    db->state->last_write_tx = cur->prev_tx;
+  // unlinked states are still on the list, so walk it forward
+  txn_state_t *cur = db->state->default_read_tx
+                         ? db->state->default_read_tx->next_tx
+                         : 0;
+  while (cur) {
+    txn_state_t *next = cur->next_tx;
     txn_free_single_tx_state(cur);
+    cur = next;
+  }
+  // every page was returned to it by now
+  if (!pal_unmap(&db->state->page_slab.reservation)) {
+    errors_push(EIO, msg("Unable to release the page slab"));
+    failure = true;
   }
+  free(db->state->page_versions);
   free(db->state->first_read_bitmap);
   free(db->state->default_read_tx);
+  db_destroy_locks(db->state);
   free(db->state);
   db->state = 0;
 
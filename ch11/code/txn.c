@@ -414,7 +414,7 @@ implementation_detail void txn_free_single_tx_state(
     state->on_forget = cur->next;
     free(cur);
   }
-  free(state->modified_pages);
+  pagesmap_free(state->modified_pages);
   free(state);
 }
 // end::txn_free_single_tx_state[]
@@ -529,7 +529,7 @@ result_t txn_close(txn_t *tx) {
       }
       free(p->address);
     }
-    free(tx->working_set);
+    pagesmap_free(tx->working_set);
   }
   // end::working_set_txn_close[]
   if (!(tx->state->flags & TX_COMMITED)) {  // rollback
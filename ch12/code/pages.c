@@ -1,9 +1,293 @@
 #include <gavran/db.h>
 #include <gavran/internal.h>
+#include <sodium.h>
+#include <string.h>
+
+// tag::page_cache[]
+static void page_cache_free_entry(
+    page_cache_t *cache, page_cache_entry_t *entry) {
+  size_t size = entry->number_of_pages * PAGE_SIZE;
+  // also zeroes the plain text
+  if (cache->locked_memory) sodium_munlock(entry->address, size);
+  free(entry->address);
+  free(entry);
+}
+
+static void page_cache_destroy(void *state) {
+  page_cache_t *cache = *(page_cache_t **)state;
+  for (size_t i = 0; i < cache->capacity; i++) {
+    if (cache->ring[i]) page_cache_free_entry(cache, cache->ring[i]);
+  }
+  free(cache->ring);
+  free(cache->buckets);
+  cache->ring     = 0;
+  cache->buckets  = 0;
+  cache->capacity = 0;
+}
+
+implementation_detail result_t page_cache_init(db_state_t *db,
+    page_cache_t *cache, uint64_t budget, bool locked_memory) {
+  size_t capacity = MAX(1, budget / PAGE_SIZE);
+  size_t buckets  = next_power_of_two(capacity);
+  page_cache_entry_t **ring, **hash;
+  ensure(mem_calloc((void *)&ring, capacity * sizeof(void *)));
+  size_t cancel_defer = 0;
+  try_defer(free, ring, cancel_defer);
+  ensure(mem_calloc((void *)&hash, buckets * sizeof(void *)));
+  try_defer(free, hash, cancel_defer);
+  ensure(txn_register_cleanup_action(&db->on_close,
+      page_cache_destroy, &cache, sizeof(page_cache_t *)));
+  cache->ring              = ring;
+  cache->buckets           = hash;
+  cache->capacity          = capacity;
+  cache->number_of_buckets = buckets;
+  cache->budget            = budget;
+  cache->locked_memory     = locked_memory;
+  cancel_defer             = 1;
+  return success();
+}
+
+static page_cache_entry_t **page_cache_bucket(
+    page_cache_t *cache, uint64_t page_num) {
+  return &cache->buckets[page_num & (cache->number_of_buckets - 1)];
+}
+
+static page_cache_entry_t *page_cache_lookup(page_cache_t *cache,
+    uint64_t page_num, page_crypto_metadata_t *version) {
+  page_cache_entry_t *cur = *page_cache_bucket(cache, page_num);
+  while (cur && (cur->page_num != page_num ||
+                    (version && memcmp(&cur->version, version,
+                                    sizeof(page_crypto_metadata_t)))))
+    cur = cur->next;
+  return cur;
+}
+
+// the entry is no longer reachable, pinned entries are freed
+// by the last page_cache_unpin
+static void page_cache_remove(
+    page_cache_t *cache, page_cache_entry_t *entry) {
+  page_cache_entry_t **cur =
+      page_cache_bucket(cache, entry->page_num);
+  while (*cur != entry) cur = &(*cur)->next;
+  *cur                     = entry->next;
+  cache->ring[entry->slot] = 0;
+  cache->used_bytes -= entry->number_of_pages * PAGE_SIZE;
+  if (entry->pins)
+    entry->detached = true;
+  else
+    page_cache_free_entry(cache, entry);
+}
+
+// <1>
+static bool page_cache_find_slot(
+    page_cache_t *cache, uint64_t size, size_t *slot) {
+  // two full sweeps, the first may only clear the referenced bits.
+  // Old versions of decrypted pages are never pinned again, so
+  // they age out here as well
+  for (size_t i = 0; i < cache->capacity * 2; i++) {
+    size_t cur  = cache->hand;
+    cache->hand = (cache->hand + 1) % cache->capacity;
+    page_cache_entry_t *entry = cache->ring[cur];
+    if (entry) {
+      if (entry->pins) continue;
+      if (entry->referenced) {
+        entry->referenced = false;  // second chance
+        continue;
+      }
+      page_cache_remove(cache, entry);
+      cache->evictions++;
+    }
+    if (cache->used_bytes + size <= cache->budget) {
+      *slot = cur;
+      return true;
+    }
+  }
+  return false;  // everything is pinned, caller will not cache
+}
+
+implementation_detail page_cache_entry_t *page_cache_pin(
+    page_cache_t *cache, uint64_t page_num, uint64_t pages,
+    page_crypto_metadata_t *version) {
+  page_cache_entry_t *entry =
+      page_cache_lookup(cache, page_num, version);
+  if (!entry) return 0;
+  if (entry->number_of_pages != pages) {
+    // the page size changed since we loaded it
+    page_cache_remove(cache, entry);
+    return 0;
+  }
+  entry->pins++;
+  entry->referenced = true;
+  return entry;
+}
+
+// <2>
+implementation_detail result_t page_cache_insert(
+    page_cache_t *cache, uint64_t page_num, uint64_t pages,
+    page_crypto_metadata_t *version, void *buffer,
+    page_cache_entry_t **entry) {
+  size_t size = pages * PAGE_SIZE;
+  size_t slot;
+  *entry = 0;
+  if (!page_cache_find_slot(cache, size, &slot)) return success();
+  // plain text is only shared when it can't be swapped out
+  if (cache->locked_memory && sodium_mlock(buffer, size))
+    return success();
+  page_cache_entry_t *e;
+  if (flopped(mem_calloc((void *)&e, sizeof(page_cache_entry_t)))) {
+    if (cache->locked_memory) sodium_munlock(buffer, size);
+    return failure_code();
+  }
+  page_cache_entry_t **bucket = page_cache_bucket(cache, page_num);
+  e->address                  = buffer;
+  e->page_num                 = page_num;
+  e->number_of_pages          = (uint32_t)pages;
+  e->slot                     = slot;
+  e->pins                     = 1;
+  e->referenced               = true;
+  e->next                     = *bucket;
+  if (version) e->version = *version;
+  *bucket           = e;
+  cache->ring[slot] = e;
+  cache->used_bytes += size;
+  *entry = e;
+  return success();
+}
+
+implementation_detail void page_cache_unpin(
+    page_cache_t *cache, page_cache_entry_t *entry) {
+  pthread_mutex_lock(&cache->lock);
+  entry->pins--;
+  if (entry->detached && !entry->pins)
+    page_cache_free_entry(cache, entry);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+static result_t pages_read(db_state_t *db, uint64_t page_num,
+    uint64_t pages, void **buffer) {
+  ensure(mem_alloc_page_aligned(buffer, pages * PAGE_SIZE));
+  size_t cancel_defer = 0;
+  try_defer(free, *buffer, cancel_defer);
+  ensure(pal_read_file(
+      db->handle, PAGE_SIZE * page_num, *buffer, pages * PAGE_SIZE));
+  cancel_defer = 1;
+  return success();
+}
+
+static result_t pages_get_cached_locked(db_state_t *db,
+    uint64_t page_num, uint64_t pages, uint64_t invalidations,
+    void **buffer, page_cache_entry_t **entry) {
+  page_cache_t *cache = &db->page_cache;
+  if (!cache->ring)
+    ensure(page_cache_init(
+        db, cache, db->options.page_cache_size, false));
+  // someone may have loaded it while we were reading
+  *entry = page_cache_pin(cache, page_num, pages, 0);
+  if (*entry) return success();
+  // pages were written while we read, our copy may be stale
+  if (invalidations != cache->invalidations) return success();
+  ensure(page_cache_insert(
+      cache, page_num, pages, 0, *buffer, entry));
+  if (*entry) *buffer = 0;  // owned by the cache now
+  return success();
+}
+
+static result_t pages_get_cached(
+    txn_t *tx, page_t *p, uint64_t pages) {
+  db_state_t *db            = tx->state->db;
+  page_cache_t *cache       = &db->page_cache;
+  page_cache_entry_t *entry = 0;
+  // <3>
+  pthread_mutex_lock(&cache->lock);
+  if (cache->ring)
+    entry = page_cache_pin(cache, p->page_num, pages, 0);
+  if (entry)
+    cache->hits++;
+  else
+    cache->misses++;
+  uint64_t invalidations = cache->invalidations;
+  pthread_mutex_unlock(&cache->lock);
+
+  void *buffer = 0;
+  defer(free, buffer);
+  if (!entry) {
+    ensure(pages_read(db, p->page_num, pages, &buffer));
+    pthread_mutex_lock(&cache->lock);
+    bool loaded = !flopped(pages_get_cached_locked(
+        db, p->page_num, pages, invalidations, &buffer, &entry));
+    pthread_mutex_unlock(&cache->lock);
+    ensure(loaded, msg("Unable to add page to the cache"),
+        with(p->page_num, "%lu"));
+  }
+  // <4>
+  if (entry && (tx->state->flags & db_flags_encrypted)) {
+    // decryption happens in place, we need a private copy
+    bool copied =
+        !flopped(mem_alloc_page_aligned(&buffer, pages * PAGE_SIZE));
+    if (copied) memcpy(buffer, entry->address, pages * PAGE_SIZE);
+    page_cache_unpin(cache, entry);
+    entry = 0;
+    ensure(copied, msg("Unable to copy the cached page"),
+        with(p->page_num, "%lu"));
+  }
+  p->address  = entry ? entry->address : buffer;
+  p->previous = entry;
+  // a failed put must not leave the entry pinned for good
+  if (flopped(pagesmap_put_new(&tx->working_set, p))) {
+    if (entry) page_cache_unpin(cache, entry);
+    return failure_code();
+  }
+  buffer = 0;
+  return success();
+}
+
+void pages_release(db_state_t *db, page_t *p) {
+  page_cache_entry_t *entry = p->previous;
+  // encrypted pages are always private copies, see pages_get_cached
+  if (!entry || (db->options.flags & db_flags_encrypted)) {
+    free(p->address);
+    return;
+  }
+  page_cache_unpin(&db->page_cache, entry);
+}
+
+bool pages_needs_validation(db_state_t *db, page_t *p) {
+  page_cache_entry_t *entry = p->previous;
+  if (!entry) return true;
+  pthread_mutex_lock(&db->page_cache.lock);
+  bool validated = entry->validated;
+  pthread_mutex_unlock(&db->page_cache.lock);
+  return !validated;
+}
+
+void pages_mark_validated(db_state_t *db, page_t *p) {
+  page_cache_entry_t *entry = p->previous;
+  if (!entry) return;
+  pthread_mutex_lock(&db->page_cache.lock);
+  entry->validated = true;
+  pthread_mutex_unlock(&db->page_cache.lock);
+}
+
+// <5>
+void pages_invalidate_cache(
+    db_state_t *db, page_t *pages, size_t count) {
+  page_cache_t *cache = &db->page_cache;
+  if (!db->options.page_cache_size) return;
+  pthread_mutex_lock(&cache->lock);
+  cache->invalidations++;
+  for (size_t i = 0; cache->ring && i < count; i++) {
+    page_cache_entry_t *entry =
+        page_cache_lookup(cache, pages[i].page_num, 0);
+    if (entry) page_cache_remove(cache, entry);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+// end::page_cache[]
 
 // tag::pages_get[]
 result_t pages_get(txn_t *tx, page_t *p) {
   uint64_t offset = p->page_num * PAGE_SIZE;
+  p->previous     = 0;  // set to the cache entry, if cached
   if (offset + p->number_of_pages * PAGE_SIZE > tx->state->map.size) {
     failed(ERANGE,
         msg("Requests for a page that is outside of the bounds of "
@@ -17,8 +301,12 @@ result_t pages_get(txn_t *tx, page_t *p) {
     return success();
   }
   // <2>
-  void *buffer;
   uint64_t pages = MAX(1, p->number_of_pages);
+  if (tx->state->db->options.page_cache_size) {
+    ensure(pages_get_cached(tx, p, pages));
+    return success();
+  }
+  void *buffer;
   ensure(mem_alloc_page_aligned(&buffer, pages * PAGE_SIZE));
   size_t cancel_defer = 0;
   try_defer(free, buffer, cancel_defer);
@@ -37,5 +325,87 @@ result_t pages_write(db_state_t *db, page_t *p) {
   ensure(pal_write_file(db->handle, p->page_num * PAGE_SIZE,
              p->address, PAGE_SIZE * p->number_of_pages),
       msg("Unable to write page"), with(p->page_num, "%lu"));
+  pages_invalidate_cache(db, p, 1);
+  return success();
+}
+
+// tag::pages_write_batch[]
+// each run is a single pwritev, keep within IOV_MAX
+#define PAGES_WRITE_MAX_IOV 64
+
+static int pages_compare_page_num(const void *a, const void *b) {
+  uint64_t x = ((const page_t *)a)->page_num;
+  uint64_t y = ((const page_t *)b)->page_num;
+  return (x > y) - (x < y);
+}
+
+static result_t pages_write_runs(
+    db_state_t *db, pal_io_request_t *runs, size_t count) {
+  // <4>
+  if (db->io_ring) {
+    uint64_t syscalls = pal_io_ring_syscalls(db->io_ring);
+    bool submitted =
+        !flopped(pal_io_ring_submit(db->io_ring, runs, count));
+    // requests in flight point to our buffers, must always wait
+    bool completed = !flopped(pal_io_ring_wait(db->io_ring));
+    ensure(submitted && completed, msg("Unable to write pages"),
+        with(count, "%zu"));
+    db->write_stats.number_of_syscalls +=
+        pal_io_ring_syscalls(db->io_ring) - syscalls;
+    return success();
+  }
+  for (size_t i = 0; i < count; i++) {
+    // short writes are retried inside, each one counts
+    ensure(pal_write_file_vectored(db->handle, runs[i].offset,
+               runs[i].buffers, runs[i].count,
+               &db->write_stats.number_of_syscalls),
+        msg("Unable to write pages"),
+        with(runs[i].offset / PAGE_SIZE, "%lu"),
+        with(runs[i].count, "%zu"));
+  }
+  return success();
+}
+
+result_t pages_write_batch(
+    db_state_t *db, page_t *pages, size_t count) {
+  // <1>
+  qsort(pages, count, sizeof(page_t), pages_compare_page_num);
+  span_t *buffers;
+  ensure(mem_alloc((void *)&buffers, count * sizeof(span_t)));
+  defer(free, buffers);
+  pal_io_request_t *runs;
+  ensure(mem_alloc((void *)&runs, count * sizeof(pal_io_request_t)));
+  defer(free, runs);
+  size_t number_of_runs = 0;
+  size_t index          = 0;
+  uint64_t bytes        = 0;
+  uint64_t total_pages  = 0;
+  while (index < count) {
+    // <2>
+    pal_io_request_t *run = &runs[number_of_runs++];
+    memset(run, 0, sizeof(pal_io_request_t));
+    run->handle   = db->handle;
+    run->buffers  = &buffers[index];
+    run->offset   = pages[index].page_num * PAGE_SIZE;
+    run->op       = pal_io_op_write;
+    uint64_t next = pages[index].page_num;
+    while (index < count && run->count < PAGES_WRITE_MAX_IOV &&
+           pages[index].page_num == next) {
+      uint64_t size          = pages[index].number_of_pages;
+      buffers[index].address = pages[index].address;
+      buffers[index].size    = size * PAGE_SIZE;
+      bytes += buffers[index].size;
+      total_pages += size;
+      next += size;
+      run->count++;
+      index++;
+    }
+  }
+  // <3>
+  ensure(pages_write_runs(db, runs, number_of_runs));
+  db->write_stats.number_of_pages += total_pages;
+  db->write_stats.bytes_written += bytes;
+  pages_invalidate_cache(db, pages, count);
   return success();
 }
+// end::pages_write_batch[]
@@ -427,7 +427,7 @@ implementation_detail void txn_free_single_tx_state(
     state->on_forget = cur->next;
     free(cur);
   }
-  free(state->modified_pages);
+  pagesmap_free(state->modified_pages);
   free(state);
 }
 // end::txn_free_single_tx_state[]
@@ -540,9 +540,9 @@ result_t txn_close(txn_t *tx) {
       if (tx->state->flags & db_flags_encrypted) {
         sodium_memzero(p->address, p->number_of_pages * PAGE_SIZE);
       }
-      free(p->address);
+      pages_release(tx->state->db, p);
     }
-    free(tx->working_set);
+    pagesmap_free(tx->working_set);
   }
   // end::working_set_txn_close[]
   if (!(tx->state->flags & TX_COMMITED)) {  // rollback
@@ -0,0 +1,95 @@
+#include <errno.h>
+#include <gavran/db.h>
+#include <gavran/internal.h>
+#include <pthread.h>
+#include <sodium.h>
+#include <string.h>
+
+// tag::checksum_crc32c[]
+typedef uint32_t (*checksum_crc32c_t)(
+    uint32_t crc, const uint8_t *data, size_t size);
+
+static uint32_t checksum_crc32c_table[256];
+
+static void checksum_crc32c_init_table(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (size_t j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    checksum_crc32c_table[i] = crc;
+  }
+}
+
+static uint32_t checksum_crc32c_scalar(
+    uint32_t crc, const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; i++)
+    crc = checksum_crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// <1>
+__attribute__((target("sse4.2"))) static uint32_t
+checksum_crc32c_sse42(
+    uint32_t crc, const uint8_t *data, size_t size) {
+  uint64_t c = crc;
+  size_t i   = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    c = _mm_crc32_u64(c, word);
+  }
+  return checksum_crc32c_scalar((uint32_t)c, data + i, size - i);
+}
+#endif
+
+static checksum_crc32c_t checksum_crc32c_impl;
+static pthread_once_t checksum_crc32c_once = PTHREAD_ONCE_INIT;
+
+// <2>
+static void checksum_crc32c_select(void) {
+  checksum_crc32c_init_table();
+  checksum_crc32c_impl = checksum_crc32c_scalar;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+    checksum_crc32c_impl = checksum_crc32c_sse42;
+#endif
+}
+
+static uint32_t checksum_crc32c_of(const void *data, size_t size) {
+  pthread_once(&checksum_crc32c_once, checksum_crc32c_select);
+  return ~checksum_crc32c_impl(UINT32_MAX, data, size);
+}
+// end::checksum_crc32c[]
+
+// tag::checksum_compute[]
+implementation_detail bool checksum_is_known(
+    checksum_algorithm_t algorithm) {
+  return algorithm == checksum_blake2b ||
+         algorithm == checksum_crc32c;
+}
+
+implementation_detail result_t checksum_compute(
+    checksum_algorithm_t algorithm, const void *data, size_t size,
+    uint8_t checksum[CHECKSUM_SIZE]) {
+  switch (algorithm) {
+    case checksum_blake2b:
+      ensure(!crypto_generichash(
+                 checksum, CHECKSUM_SIZE, data, size, 0, 0),
+          msg("Unable to compute blake2b checksum"));
+      return success();
+    case checksum_crc32c: {
+      // the rest of the field stays zeroed, so a plain memcmp works
+      uint32_t crc = checksum_crc32c_of(data, size);
+      memset(checksum, 0, CHECKSUM_SIZE);
+      memcpy(checksum, &crc, sizeof(crc));
+      return success();
+    }
+  }
+  failed(EINVAL, msg("Unknown checksum algorithm"),
+      with(algorithm, "%d"));
+}
+// end::checksum_compute[]
@@ -309,3 +309,728 @@ describe(log_shipping) {
   }
 }
 // end::tests13[]
+
+// tag::tests_wal_diff_page[]
+static result_t diff_matches_scalar(
+    uint64_t* origin, uint64_t* modified, size_t size) {
+  size_t bytes = size * sizeof(uint64_t);
+  void *expected, *actual;
+  ensure(mem_alloc(&expected, bytes));
+  defer(free, expected);
+  ensure(mem_alloc(&actual, bytes));
+  defer(free, actual);
+  void* expected_end =
+      wal_diff_page_scalar(origin, modified, size, expected);
+  void* actual_end =
+      wal_diff_page_simd(origin, modified, size, actual);
+  size_t len = (size_t)(expected_end - expected);
+  ensure(len == (size_t)(actual_end - actual));
+  ensure(memcmp(expected, actual, len) == 0);
+  return success();
+}
+
+describe(wal_diff_page) {
+  const size_t size = 4 * PAGE_SIZE / sizeof(uint64_t);
+  uint64_t* origin;
+  uint64_t* modified;
+
+  before_each() {
+    errors_clear();
+    srand(42);
+  }
+
+  it("matches the scalar diff for single changes") {
+    assert(mem_alloc((void*)&origin, size * sizeof(uint64_t)));
+    defer(free, origin);
+    assert(mem_alloc((void*)&modified, size * sizeof(uint64_t)));
+    defer(free, modified);
+    for (size_t i = 0; i < size; i++) origin[i] = (uint64_t)rand();
+    memcpy(modified, origin, size * sizeof(uint64_t));
+    assert(diff_matches_scalar(origin, modified, size));
+    // every offset within and across the vector blocks
+    for (size_t i = 0; i < 96; i++) {
+      size_t pos = i < 48 ? i : size - 96 + i;
+      modified[pos] = ~origin[pos];
+      assert(diff_matches_scalar(origin, modified, size));
+      modified[pos] = 0;
+      assert(diff_matches_scalar(origin, modified, size));
+      modified[pos] = origin[pos];
+    }
+  }
+
+  it("matches the scalar diff for random changes") {
+    assert(mem_alloc((void*)&origin, size * sizeof(uint64_t)));
+    defer(free, origin);
+    assert(mem_alloc((void*)&modified, size * sizeof(uint64_t)));
+    defer(free, modified);
+    for (size_t round = 0; round < 64; round++) {
+      for (size_t i = 0; i < size; i++)
+        origin[i] = rand() % 4 ? (uint64_t)rand() : 0;
+      memcpy(modified, origin, size * sizeof(uint64_t));
+      size_t changes = (size_t)rand() % (round + 1) * 8;
+      for (size_t i = 0; i < changes; i++) {
+        size_t pos = (size_t)rand() % size;
+        size_t len = (size_t)rand() % 24 + 1;
+        bool zero  = rand() % 2;
+        for (size_t j = pos; j < pos + len && j < size; j++)
+          modified[j] = zero ? 0 : (uint64_t)rand();
+      }
+      assert(diff_matches_scalar(origin, modified, size));
+      assert(diff_matches_scalar(origin, modified, size - 3));
+    }
+  }
+}
+// end::tests_wal_diff_page[]
+
+// tag::tests_wal_dictionary[]
+static result_t write_record(db_t* db, uint64_t* page_num, size_t i) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t p = {.page_num = *page_num, .number_of_pages = 1};
+  if (p.page_num) {
+    ensure(txn_modify_page(&w, &p));
+  } else {
+    ensure(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+  }
+  for (size_t j = 0; j < 64; j++) {
+    sprintf(p.address + j * 96,
+        "{\"id\": %zu, \"name\": \"user-%zu\", \"tags\": "
+        "[\"gavran\", \"wal\"]}",
+        i * 64 + j, (i * 7 + j) % 1000);
+  }
+  *page_num = p.page_num;
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t verify_record(db_t* db, uint64_t page_num, size_t i) {
+  txn_t r;
+  ensure(txn_create(db, TX_READ, &r));
+  defer(txn_close, r);
+  page_t p = {.page_num = page_num};
+  ensure(txn_get_page(&r, &p));
+  char expected[96];
+  sprintf(expected, "{\"id\": %zu, ", i * 64);
+  ensure(strncmp(p.address, expected, strlen(expected)) == 0);
+  return success();
+}
+
+static result_t count_busy_pages(db_t* db, uint64_t* busy) {
+  txn_t r;
+  ensure(txn_create(db, TX_READ, &r));
+  defer(txn_close, r);
+  *busy = 0;
+  for (uint64_t i = 0; i < r.state->number_of_pages; i++) {
+    bool is_busy;
+    ensure(txn_is_page_busy(&r, i, &is_busy));
+    *busy += is_busy;
+  }
+  return success();
+}
+
+static result_t train_after_writes(db_t* db, uint64_t* pages,
+    size_t writes, uint64_t* busy) {
+  for (size_t i = 0; i < writes; i++) {
+    size_t slot = i % 32;
+    ensure(write_record(db, &pages[slot], slot));
+  }
+  ensure(wal_train_dictionary(db));
+  ensure(count_busy_pages(db, busy));
+  return success();
+}
+
+static result_t retrain_dictionary(void) {
+  db_t db;
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .wal_size                         = 128 * 1024,
+      .wal_compression_level            = 9,
+      .wal_dictionary_size              = 4096};
+  ensure(db_create("/tmp/db/try", &options, &db));
+  uint64_t pages[32] = {0};
+  uint64_t first, second, third;
+  ensure(train_after_writes(&db, pages, 32, &first));
+  uint64_t dictionary = db.state->wal_state.compression.cdict_page;
+  // the WAL still has records compressed with the first one
+  ensure(train_after_writes(&db, pages, 32, &second));
+  ensure(second == first + 1, msg("Retired dictionary was freed"),
+      with(first, "%lu"), with(second, "%lu"));
+  // those records were recycled by now, it is replaced in place
+  ensure(train_after_writes(&db, pages, 64, &third));
+  ensure(third == second, msg("Retired dictionary was not freed"),
+      with(second, "%lu"), with(third, "%lu"));
+  {
+    txn_t r;
+    ensure(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    bool busy;
+    ensure(txn_is_page_busy(&r, dictionary, &busy));
+    ensure(!busy);
+  }
+  ensure(db_close(&db));
+
+  ensure(db_create("/tmp/db/try", &options, &db));
+  defer(db_close, db);
+  for (size_t i = 0; i < 32; i++)
+    ensure(verify_record(&db, pages[i], i));
+  return success();
+}
+
+describe(wal_dictionary) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("recovers records compressed with a trained dictionary") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .wal_size                         = 4 * 1024 * 1024,
+        .wal_compression_level            = 9,
+        .wal_dictionary_size              = 4096};
+    uint64_t pages[64] = {0};
+    assert(db_create("/tmp/db/try", &options, &db));
+    txn_t rtx;  // prevents checkpoints, forcing recovery
+    assert(txn_create(&db, TX_READ, &rtx));
+    for (size_t i = 0; i < 32; i++)
+      assert(write_record(&db, &pages[i], i));
+    assert(wal_train_dictionary(&db));
+    uint64_t dictionary = db.state->wal_state.compression.cdict_page;
+    assert(dictionary != 0);
+    for (size_t i = 32; i < 64; i++)
+      assert(write_record(&db, &pages[i], i));
+    assert(db_close(&db));
+
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(db.state->wal_state.compression.cdict_page == dictionary);
+    for (size_t i = 0; i < 64; i++)
+      assert(verify_record(&db, pages[i], i));
+  }
+
+  it("ships records compressed with a dictionary") {
+    db_t src, dst;
+    db_options_t dst_options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_log_shipping_target};
+    assert(db_create("/tmp/db/try-dst", &dst_options, &dst));
+    defer(db_close, dst);
+
+    db_and_error_state_t state = {.db = &dst};
+    db_options_t src_options   = {.minimum_size = 4 * 1024 * 1024,
+        .wal_write_callback                   = ship_wal_logs,
+        .wal_write_callback_state             = &state,
+        .wal_dictionary_size                  = 4096};
+    assert(db_create("/tmp/db/try-src", &src_options, &src));
+    defer(db_close, src);
+
+    uint64_t pages[48] = {0};
+    for (size_t i = 0; i < 32; i++)
+      assert(write_record(&src, &pages[i], i));
+    assert(wal_train_dictionary(&src));
+    for (size_t i = 32; i < 48; i++)
+      assert(write_record(&src, &pages[i], i));
+    assert(!state.has_errors);
+    assert(dst.state->wal_state.compression.ddict_page ==
+           src.state->wal_state.compression.cdict_page);
+    for (size_t i = 0; i < 48; i++)
+      assert(verify_record(&dst, pages[i], i));
+  }
+
+  it("frees a retired dictionary once the WAL is recycled") {
+    assert(retrain_dictionary());
+  }
+
+  it("requires a dictionary size to train") {
+    db_t db;
+    assert(db_create("/tmp/db/try", 0, &db));
+    defer(db_close, db);
+    assert(!wal_train_dictionary(&db));
+    errors_clear();
+  }
+}
+// end::tests_wal_dictionary[]
+
+// tag::tests_wal_shipped_batches[]
+typedef struct shipped_records {
+  span_t* records;
+  uint64_t first_tx_id;
+  size_t count;
+  size_t capacity;
+  bool has_errors;
+  uint8_t _padding[7];
+} shipped_records_t;
+
+static void collect_wal_logs(
+    void* state, uint64_t tx_id, span_t* wal_record) {
+  shipped_records_t* shipped = state;
+  if (!shipped->count) shipped->first_tx_id = tx_id;
+  if (shipped->count == shipped->capacity) {
+    shipped->capacity = MAX(64, shipped->capacity * 2);
+    if (flopped(mem_realloc((void*)&shipped->records,
+            shipped->capacity * sizeof(span_t)))) {
+      shipped->has_errors = true;
+      return;
+    }
+  }
+  span_t* copy = &shipped->records[shipped->count];
+  copy->size   = wal_record->size;
+  if (flopped(mem_alloc_page_aligned(&copy->address, copy->size))) {
+    shipped->has_errors = true;
+    return;
+  }
+  memcpy(copy->address, wal_record->address, copy->size);
+  shipped->count++;
+}
+
+static void defer_shipped_records_free(cancel_defer_t* cd) {
+  shipped_records_t* shipped = cd->target;
+  for (size_t i = 0; i < shipped->count; i++)
+    free(shipped->records[i].address);
+  free(shipped->records);
+}
+
+static result_t apply_in_batches(
+    db_t* db, shipped_records_t* shipped, size_t batch_size) {
+  for (size_t i = 0; i < shipped->count; i += batch_size) {
+    size_t count = MIN(batch_size, shipped->count - i);
+    ensure(wal_apply_wal_records(db, shipped->first_tx_id + i,
+        shipped->records + i, count));
+  }
+  return success();
+}
+
+static result_t write_shipped_records(db_options_t* options,
+    shipped_records_t* shipped, uint64_t* pages, size_t n,
+    size_t txs) {
+  db_t src;
+  options->wal_write_callback       = collect_wal_logs;
+  options->wal_write_callback_state = shipped;
+  ensure(db_create("/tmp/db/try-src", options, &src));
+  defer(db_close, src);
+  for (size_t i = 0; i < txs; i++) {
+    uint64_t* page_num = &pages[i % n];
+    ensure(write_record(&src, page_num, i));
+  }
+  ensure(!shipped->has_errors);
+  return success();
+}
+
+describe(wal_shipped_batches) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("applies shipped records in batches") {
+    shipped_records_t shipped = {0};
+    defer(shipped_records_free, shipped);
+    db_options_t src_options = {.minimum_size = 4 * 1024 * 1024};
+    uint64_t pages[16]       = {0};
+    assert(write_shipped_records(
+        &src_options, &shipped, pages, 16, 200));
+
+    db_options_t dst_options = {.minimum_size = 4 * 1024 * 1024,
+        .wal_recovery_workers             = 4,
+        .flags = db_flags_log_shipping_target};
+    {
+      db_t dst;
+      assert(db_create("/tmp/db/try-dst", &dst_options, &dst));
+      defer(db_close, dst);
+      assert(apply_in_batches(&dst, &shipped, 32));
+      assert(dst.state->last_tx_id ==
+             shipped.first_tx_id + shipped.count - 1);
+      for (size_t i = 200 - 16; i < 200; i++)
+        assert(verify_record(&dst, pages[i % 16], i));
+    }
+    // the batches went to the local WAL as well
+    db_t dst;
+    assert(db_create("/tmp/db/try-dst", &dst_options, &dst));
+    defer(db_close, dst);
+    for (size_t i = 200 - 16; i < 200; i++)
+      assert(verify_record(&dst, pages[i % 16], i));
+  }
+
+  it("splits a batch when the dictionary changes") {
+    shipped_records_t shipped = {0};
+    defer(shipped_records_free, shipped);
+    db_options_t src_options = {.minimum_size = 4 * 1024 * 1024,
+        .wal_dictionary_size                  = 4096};
+    uint64_t pages[48]       = {0};
+    {
+      db_t src;
+      src_options.wal_write_callback       = collect_wal_logs;
+      src_options.wal_write_callback_state = &shipped;
+      assert(db_create("/tmp/db/try-src", &src_options, &src));
+      defer(db_close, src);
+      for (size_t i = 0; i < 32; i++)
+        assert(write_record(&src, &pages[i], i));
+      assert(wal_train_dictionary(&src));
+      for (size_t i = 32; i < 48; i++)
+        assert(write_record(&src, &pages[i], i));
+      assert(!shipped.has_errors);
+    }
+    db_t dst;
+    db_options_t dst_options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_log_shipping_target};
+    assert(db_create("/tmp/db/try-dst", &dst_options, &dst));
+    defer(db_close, dst);
+    assert(apply_in_batches(&dst, &shipped, shipped.count));
+    assert(dst.state->wal_state.compression.ddict_page != 0);
+    for (size_t i = 0; i < 48; i++)
+      assert(verify_record(&dst, pages[i], i));
+  }
+
+  it("rejects records out of order") {
+    shipped_records_t shipped = {0};
+    defer(shipped_records_free, shipped);
+    db_options_t src_options = {.minimum_size = 4 * 1024 * 1024};
+    uint64_t pages[4]        = {0};
+    assert(
+        write_shipped_records(&src_options, &shipped, pages, 4, 8));
+
+    db_t dst;
+    db_options_t dst_options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_log_shipping_target};
+    assert(db_create("/tmp/db/try-dst", &dst_options, &dst));
+    defer(db_close, dst);
+    assert(!wal_apply_wal_records(&dst, shipped.first_tx_id + 1,
+        shipped.records + 1, shipped.count - 1));
+    errors_clear();
+    assert(apply_in_batches(&dst, &shipped, 3));
+    assert(verify_record(&dst, pages[3], 7));
+  }
+}
+// end::tests_wal_shipped_batches[]
+
+// tag::tests_wal_buffer_pool[]
+describe(wal_buffer_pool) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("reuses transaction buffers across commits") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t page_num = 0;
+    for (size_t i = 0; i < 32; i++)
+      assert(write_record(&db, &page_num, i));
+    wal_buffer_pool_t *pool = &db.state->wal_state.buffer_pool;
+    assert(pool->reuses >= 31);
+    assert(pool->allocations <= 2);
+    assert(pool->count >= 1);
+  }
+
+  it("sizes the buffer for multi page overflows") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    txn_t rtx;  // prevents checkpoints, forcing recovery
+    assert(txn_create(&db, TX_READ, &rtx));
+    uint64_t page_num;
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      page_t p = {.number_of_pages = 8};
+      assert(txn_allocate_page(&w, &p, 0));
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 8;
+      for (size_t i = 0; i < 8 * PAGE_SIZE / sizeof(uint64_t); i++)
+        ((uint64_t*)p.address)[i] = i * 2654435761u;
+      page_num = p.page_num;
+      assert(txn_commit(&w));
+    }
+    assert(db_close(&db));
+
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&r, &p));
+    uint64_t *words = p.address;
+    assert(words[0] == 0);
+    assert(words[8 * PAGE_SIZE / sizeof(uint64_t) - 1] ==
+           (8 * PAGE_SIZE / sizeof(uint64_t) - 1) * 2654435761u);
+  }
+}
+// end::tests_wal_buffer_pool[]
+
+// tag::tests_wal_segments[]
+describe(wal_segments) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -rf /tmp/db/*");
+  }
+
+  it("rotates into recycled segments instead of growing") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .wal_size                         = 128 * 1024,
+        .wal_segments                     = 4};
+    uint64_t pages[96] = {0};
+    assert(db_create("/tmp/db/try", &options, &db));
+    txn_t rtx;  // prevents checkpoints, forcing recovery
+    assert(txn_create(&db, TX_READ, &rtx));
+    for (size_t i = 0; i < 96; i++)
+      assert(write_record(&db, &pages[i], i));
+    wal_state_t* wal = &db.state->wal_state;
+    assert(wal->number_of_files == 4);
+    for (size_t i = 0; i < 3; i++) {
+      assert(wal->files[i].last_write_pos > 0);
+      assert(wal->files[i].span.size == options.wal_size);
+    }
+    assert(db_close(&db));
+
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(db.state->last_tx_id == 97);
+    for (size_t i = 0; i < 96; i++)
+      assert(verify_record(&db, pages[i], i));
+  }
+
+  it("archives segments and restores to a target tx") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .wal_size                         = 128 * 1024,
+        .wal_segments                     = 3,
+        .wal_archive_callback             = wal_archive_to_directory,
+        .wal_archive_callback_state       = "/tmp/db/archive"};
+    assert(db_create("/tmp/db/try", &options, &db));
+    uint64_t page_num = 0, target = 0;
+    for (size_t i = 0; i < 96; i++) {
+      assert(write_record(&db, &page_num, i));
+      if (i == 40) target = db.state->last_tx_id;
+    }
+    assert(db_close(&db));
+
+    db_options_t restore = {.minimum_size = 4 * 1024 * 1024};
+    assert(wal_restore_archive(
+        "/tmp/db/archive", "/tmp/db/restored", &restore, target));
+    assert(db_create("/tmp/db/restored", &restore, &db));
+    defer(db_close, db);
+    assert(db.state->last_tx_id == target);
+    assert(verify_record(&db, page_num, 40));
+  }
+
+  it("fails to restore past the end of the archive") {
+    db_t db;
+    db_options_t options = {
+        .wal_archive_callback       = wal_archive_to_directory,
+        .wal_archive_callback_state = "/tmp/db/archive"};
+    assert(db_create("/tmp/db/try", &options, &db));
+    uint64_t page_num = 0;
+    for (size_t i = 0; i < 64; i++)
+      assert(write_record(&db, &page_num, i));
+    assert(db_close(&db));
+
+    assert(!wal_restore_archive(
+        "/tmp/db/archive", "/tmp/db/restored", 0, 10000));
+    size_t count;
+    int* codes = errors_get_codes(&count);
+    assert(count > 0 && codes[0] == ENODATA);
+    errors_clear();
+  }
+
+  it("rejects an invalid number of segments") {
+    db_t db;
+    db_options_t options = {.wal_segments = 1};
+    assert(!db_create("/tmp/db/try", &options, &db));
+    size_t count;
+    int* codes = errors_get_codes(&count);
+    assert(count > 0 && codes[0] == EINVAL);
+    errors_clear();
+  }
+}
+// end::tests_wal_segments[]
+
+// tag::tests_wal_recovery[]
+static result_t write_without_checkpoint(
+    db_options_t* options, uint64_t* pages, size_t n, size_t txs) {
+  db_t db;
+  ensure(db_create("/tmp/db/try", options, &db));
+  defer(db_close, db);
+  txn_t rtx;  // prevents checkpoints, forcing recovery
+  ensure(txn_create(&db, TX_READ, &rtx));
+  defer(txn_close, rtx);
+  for (size_t i = 0; i < txs; i++) {
+    uint64_t* page_num = &pages[i % n];
+    ensure(write_record(&db, page_num, i));
+  }
+  // closing the reader checkpoints, keep the files as they are now
+  ensure(!system("mkdir -p /tmp/db/crash && "
+                 "cp /tmp/db/try* /tmp/db/crash/"));
+  return success();
+}
+
+// the files are put back as they were before the database closed,
+// as if the process crashed
+static result_t write_and_crash(
+    db_options_t* options, uint64_t* pages, size_t n, size_t txs) {
+  ensure(write_without_checkpoint(options, pages, n, txs));
+  ensure(!system("rm -f /tmp/db/try* && "
+                 "cp /tmp/db/crash/* /tmp/db/ && "
+                 "rm -rf /tmp/db/crash"));
+  return success();
+}
+
+static result_t recover_and_verify(db_options_t* options,
+    uint64_t* pages, size_t n, size_t txs, wal_recovery_stats_t* st) {
+  db_t db;
+  ensure(db_create("/tmp/db/try", options, &db));
+  defer(db_close, db);
+  *st = db.state->wal_state.recovery;
+  for (size_t i = txs - n; i < txs; i++) {
+    uint64_t page_num = pages[i % n];
+    ensure(verify_record(&db, page_num, i));
+  }
+  return success();
+}
+
+describe(wal_recovery) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -rf /tmp/db/*");
+  }
+
+  it("replays in order and writes each page once") {
+    for (uint32_t workers = 1; workers <= 4; workers += 3) {
+      system("rm -rf /tmp/db/*");
+      db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+          .wal_recovery_workers             = workers};
+      uint64_t pages[8] = {0};
+      assert(write_and_crash(&options, pages, 8, 200));
+      wal_recovery_stats_t st;
+      assert(recover_and_verify(&options, pages, 8, 200, &st));
+      assert(st.number_of_workers == workers);
+      assert(st.number_of_records > 200);
+      assert(st.number_of_pages_written < st.number_of_records);
+      assert(st.elapsed_ns > 0);
+    }
+  }
+
+  it("flushes the recovered pages at the dirty limit") {
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .checkpoint_dirty_limit           = 8 * PAGE_SIZE};
+    uint64_t pages[32] = {0};
+    assert(write_and_crash(&options, pages, 32, 96));
+    wal_recovery_stats_t st;
+    assert(recover_and_verify(&options, pages, 32, 96, &st));
+    assert(st.number_of_pages_written > 32);
+  }
+
+  it("validates the recovered pages in batches") {
+    uint32_t flags[] = {db_flags_page_validation_always,
+        db_flags_page_validation_always | db_flags_avoid_mmap_io};
+    for (size_t i = 0; i < 2; i++) {
+      system("rm -rf /tmp/db/*");
+      db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+          .wal_recovery_workers             = 4,
+          .flags                            = flags[i]};
+      uint64_t pages[300] = {0};
+      assert(write_and_crash(&options, pages, 300, 300));
+      wal_recovery_stats_t st;
+      assert(recover_and_verify(&options, pages, 300, 300, &st));
+      assert(st.number_of_records >= 300);
+    }
+  }
+
+  // GAVRAN_BENCHMARK=1 to report recovery time for a larger log
+  it("benchmark recovery time") {
+    const size_t txs = getenv("GAVRAN_BENCHMARK") ? 20000 : 0;
+    const size_t n   = 512;
+    uint64_t* pages  = calloc(n, sizeof(uint64_t));
+    defer(free, pages);
+    db_options_t options = {.minimum_size = 64 * 1024 * 1024};
+    if (txs) {
+      assert(write_and_crash(&options, pages, n, txs));
+      system("mkdir -p /tmp/db/bench");
+      system("cp /tmp/db/try* /tmp/db/bench");
+    }
+    for (uint32_t workers = 1; txs && workers <= 8; workers *= 2) {
+      system("cp /tmp/db/bench/* /tmp/db/");  // same log every time
+      options.wal_recovery_workers = workers;
+      wal_recovery_stats_t st;
+      assert(recover_and_verify(&options, pages, n, txs, &st));
+      printf("recovery: %u workers, %lu records, %lu MB, "
+             "%lu pages written, %.2f ms\n",
+          workers, st.number_of_records, st.bytes_replayed >> 20,
+          st.number_of_pages_written, (double)st.elapsed_ns / 1e6);
+    }
+  }
+}
+// end::tests_wal_recovery[]
+
+// tag::tests_checksums[]
+describe(checksums) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -rf /tmp/db/*");
+  }
+
+  it("computes the standard crc32c") {
+    uint8_t checksum[CHECKSUM_SIZE];
+    assert(checksum_compute(
+        checksum_crc32c, "123456789", 9, checksum));
+    uint32_t crc;
+    memcpy(&crc, checksum, sizeof(crc));
+    assert(crc == 0xE3069283);
+    assert(sodium_is_zero(checksum + 4, CHECKSUM_SIZE - 4));
+  }
+
+  it("keeps the algorithm of the file across restarts") {
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .checksum_algorithm               = checksum_crc32c,
+        .flags = db_flags_page_validation_always};
+    uint64_t pages[8] = {0};
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      for (size_t i = 0; i < 8; i++)
+        assert(write_record(&db, &pages[i], i));
+    }
+    options.checksum_algorithm = checksum_blake2b;
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(db.state->options.checksum_algorithm == checksum_crc32c);
+    for (size_t i = 0; i < 8; i++)
+      assert(verify_record(&db, pages[i], i));
+  }
+
+  it("recovers WAL records checked with crc32c") {
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .checksum_algorithm               = checksum_crc32c,
+        .flags = db_flags_page_validation_always};
+    uint64_t pages[8] = {0};
+    assert(write_and_crash(&options, pages, 8, 64));
+    wal_recovery_stats_t st;
+    assert(recover_and_verify(&options, pages, 8, 64, &st));
+    assert(st.number_of_records >= 64);
+  }
+
+  it("rejects an unknown algorithm") {
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .checksum_algorithm               = (checksum_algorithm_t)7};
+    db_t db;
+    assert(!db_create("/tmp/db/try", &options, &db));
+    size_t count;
+    int* codes = errors_get_codes(&count);
+    assert(codes[count - 1] == EINVAL);
+    errors_clear();
+  }
+}
+// end::tests_checksums[]
@@ -54,20 +54,19 @@ result_t txn_create(db_t *db, db_flags_t flags, txn_t *tx) {
 }
 // end::txn_create[]
 
-static result_t txn_hash_page(
-    page_t *page, uint8_t hash[crypto_generichash_BYTES]);
+static result_t txn_hash_page(checksum_algorithm_t algorithm,
+    page_t *page, uint8_t hash[CHECKSUM_SIZE]);
 
 // tag::txn_validate_page[]
-static result_t txn_validate_page_hash(
-    page_t *page, uint8_t expected_hash[crypto_generichash_BYTES]) {
+static result_t txn_validate_page_hash(checksum_algorithm_t algorithm,
+    page_t *page, uint8_t expected_hash[CHECKSUM_SIZE]) {
   // <1>
-  uint8_t hash[crypto_generichash_BYTES];
-  ensure(txn_hash_page(page, hash));
+  uint8_t hash[CHECKSUM_SIZE];
+  ensure(txn_hash_page(algorithm, page, hash));
   // <2>
-  if (!memcmp(hash, expected_hash, crypto_generichash_BYTES))
-    return success();
+  if (!memcmp(hash, expected_hash, CHECKSUM_SIZE)) return success();
   // <3>
-  if (sodium_is_zero(expected_hash, crypto_generichash_BYTES) &&
+  if (sodium_is_zero(expected_hash, CHECKSUM_SIZE) &&
       sodium_is_zero(
           page->address, page->number_of_pages * PAGE_SIZE))
     return success();
@@ -83,7 +82,9 @@ static result_t txn_validate_page(txn_t *tx, page_t *page) {
   } else {
     metadata = page->address;
   }
-  ensure(txn_validate_page_hash(page, metadata->cyrpto.hash_blake2b));
+  ensure(txn_validate_page_hash(
+      tx->state->db->options.checksum_algorithm, page,
+      metadata->cyrpto.hash_blake2b));
   return success();
 }
 // end::txn_validate_page[]
@@ -302,8 +303,8 @@ result_t txn_raw_modify_page(txn_t *tx, page_t *page) {
 }
 
 // tag::txn_hash_page[]
-static result_t txn_hash_page(
-    page_t *page, uint8_t hash[crypto_generichash_BYTES]) {
+static result_t txn_hash_page(checksum_algorithm_t algorithm,
+    page_t *page, uint8_t hash[CHECKSUM_SIZE]) {
   bool is_metadata_page =
       (page->page_num & PAGES_IN_METADATA_MASK) == page->page_num;
 
@@ -313,12 +314,9 @@ static result_t txn_hash_page(
   size_t size = is_metadata_page ? PAGE_SIZE - sizeof(page_metadata_t)
                                  : page->number_of_pages * PAGE_SIZE;
 
-  if (crypto_generichash(
-          hash, crypto_generichash_BYTES, start, size, 0, 0)) {
-    failed(ENODATA,
-        msg("Unable to compute page hash for page, shouldn't happen"),
-        with(page->page_num, "%lu"));
-  }
+  ensure(checksum_compute(algorithm, start, size, hash),
+      msg("Unable to compute page hash for page, shouldn't happen"),
+      with(page->page_num, "%lu"));
   return success();
 }
 // end::txn_hash_page[]
@@ -335,7 +333,8 @@ static result_t tx_finalize_page(
     return txn_encrypt_page(tx, page->page_num, page->address,
         page->number_of_pages * PAGE_SIZE, metadata);
   } else {
-    return txn_hash_page(page, metadata->cyrpto.hash_blake2b);
+    return txn_hash_page(tx->state->db->options.checksum_algorithm,
+        page, metadata->cyrpto.hash_blake2b);
   }
 }
 // end::tx_finalize_page[]
@@ -438,7 +437,7 @@ implementation_detail void txn_free_single_tx_state(
     state->on_forget = cur->next;
     free(cur);
   }
-  free(state->modified_pages);
+  pagesmap_free(state->modified_pages);
   free(state);
 }
 // end::txn_free_single_tx_state[]
@@ -546,9 +545,9 @@ implementation_detail void txn_clear_working_set(txn_t *tx) {
       if (tx->state->flags & db_flags_encrypted) {
         sodium_memzero(p->address, p->number_of_pages * PAGE_SIZE);
       }
-      free(p->address);
+      pages_release(tx->state->db, p);
     }
-    free(tx->working_set);
+    pagesmap_free(tx->working_set);
   }
 }
 result_t txn_close(txn_t *tx) {
@@ -1,7 +1,13 @@
+#include <dirent.h>
+#include <errno.h>
 #include <gavran/db.h>
 #include <gavran/internal.h>
 #include <sodium.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zdict.h>
 #include <zstd.h>
 
 // tag::wal_txn_t[]
@@ -20,19 +26,27 @@ typedef struct wal_txn_page {
 enum wal_txn_flags {
   wal_txn_flags_none       = 0,
   wal_txn_flags_compressed = 1,
+  wal_txn_flags_sealed     = 2,  // encrypted db, plain text pages
 };
 
 typedef struct wal_txn {
-  uint8_t hash_blake2b[32];
+  uint8_t hash_blake2b[CHECKSUM_SIZE];  // using checksum_algorithm
   uint64_t tx_id;
   uint64_t page_aligned_tx_size;
   uint64_t tx_size;
   uint64_t number_of_modified_pages;
   uint64_t total_number_of_pages_in_database;
   enum wal_txn_flags flags;
-  uint8_t padding[4];
+  checksum_algorithm_t checksum_algorithm;
+  uint8_t padding[3];
   wal_txn_page_t pages[];
 } wal_txn_t;
+
+// follows the header of sealed transactions
+typedef struct wal_txn_seal {
+  uint8_t nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
+  uint8_t mac[crypto_aead_xchacha20poly1305_ietf_ABYTES];
+} wal_txn_seal_t;
 // end::wal_txn_t[]
 
 // tag::wal_page_diff[]
@@ -60,9 +74,67 @@ static void *wal_apply_diff(
 }
 // end::wal_apply_diff[]
 
+// tag::wal_find_difference[]
+typedef size_t (*wal_find_difference_t)(uint64_t *restrict origin,
+    uint64_t *restrict modified, size_t i, size_t size);
+
+static size_t wal_find_difference_scalar(uint64_t *restrict origin,
+    uint64_t *restrict modified, size_t i, size_t size) {
+  while (i < size && origin[i] == modified[i]) i++;
+  return i;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// <1>
+__attribute__((target("avx2"))) static size_t
+wal_find_difference_avx2(uint64_t *restrict origin,
+    uint64_t *restrict modified, size_t i, size_t size) {
+  for (; i + 8 <= size; i += 8) {  // 64 bytes per iteration
+    __m256i a0 = _mm256_loadu_si256((__m256i *)(origin + i));
+    __m256i b0 = _mm256_loadu_si256((__m256i *)(modified + i));
+    __m256i a1 = _mm256_loadu_si256((__m256i *)(origin + i + 4));
+    __m256i b1 = _mm256_loadu_si256((__m256i *)(modified + i + 4));
+    __m256i eq = _mm256_and_si256(
+        _mm256_cmpeq_epi64(a0, b0), _mm256_cmpeq_epi64(a1, b1));
+    if ((uint32_t)_mm256_movemask_epi8(eq) != UINT32_MAX) break;
+  }
+  return wal_find_difference_scalar(origin, modified, i, size);
+}
+
+__attribute__((target("sse4.1"))) static size_t
+wal_find_difference_sse4(uint64_t *restrict origin,
+    uint64_t *restrict modified, size_t i, size_t size) {
+  for (; i + 4 <= size; i += 4) {  // 32 bytes per iteration
+    __m128i a0 = _mm_loadu_si128((__m128i *)(origin + i));
+    __m128i b0 = _mm_loadu_si128((__m128i *)(modified + i));
+    __m128i a1 = _mm_loadu_si128((__m128i *)(origin + i + 2));
+    __m128i b1 = _mm_loadu_si128((__m128i *)(modified + i + 2));
+    __m128i eq = _mm_and_si128(
+        _mm_cmpeq_epi64(a0, b0), _mm_cmpeq_epi64(a1, b1));
+    if (_mm_movemask_epi8(eq) != 0xFFFF) break;
+  }
+  return wal_find_difference_scalar(origin, modified, i, size);
+}
+#endif
+
+// <2>
+static wal_find_difference_t wal_select_find_difference(void) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return wal_find_difference_avx2;
+  if (__builtin_cpu_supports("sse4.1"))
+    return wal_find_difference_sse4;
+#endif
+  return wal_find_difference_scalar;
+}
+// end::wal_find_difference[]
+
 // tag::wal_diff_page[]
-static void *wal_diff_page(uint64_t *restrict origin,
-    uint64_t *restrict modified, size_t size, void *output) {
+static void *wal_diff_page_with(wal_find_difference_t find,
+    uint64_t *restrict origin, uint64_t *restrict modified,
+    size_t size, void *output) {
   if (!origin) {  // no previous definition
     memcpy(output, modified, size * sizeof(uint64_t));
     return output + (size * sizeof(uint64_t));
@@ -70,9 +142,9 @@ static void *wal_diff_page(uint64_t *restrict origin,
   void *current = output;
   void *end     = output + size * sizeof(uint64_t);
   for (size_t i = 0; i < size; i++) {
-    if (origin[i] == modified[i]) {
-      continue;
-    }
+    // <3>
+    i = find(origin, modified, i, size);
+    if (i == size) break;
     bool zeroes       = true;
     size_t diff_start = i;
     for (; i < size && (i - diff_start) < (1024 * 1024); i++) {
@@ -107,8 +179,284 @@ static void *wal_diff_page(uint64_t *restrict origin,
 
   return current;
 }
+
+implementation_detail void *wal_diff_page_scalar(uint64_t *origin,
+    uint64_t *modified, size_t size, void *output) {
+  return wal_diff_page_with(
+      wal_find_difference_scalar, origin, modified, size, output);
+}
+
+implementation_detail void *wal_diff_page_simd(uint64_t *origin,
+    uint64_t *modified, size_t size, void *output) {
+  static wal_find_difference_t find;
+  wal_find_difference_t cur =
+      __atomic_load_n(&find, __ATOMIC_RELAXED);
+  if (!cur) {
+    cur = wal_select_find_difference();
+    __atomic_store_n(&find, cur, __ATOMIC_RELAXED);
+  }
+  return wal_diff_page_with(cur, origin, modified, size, output);
+}
+
+static void *wal_diff_page(uint64_t *restrict origin,
+    uint64_t *restrict modified, size_t size, void *output) {
+  return wal_diff_page_simd(origin, modified, size, output);
+}
 // end::wal_diff_page[]
 
+// tag::wal_compression[]
+static result_t wal_reserve(reusable_buffer_t *buffer, size_t size) {
+  if (buffer->size >= size) return success();
+  ensure(mem_realloc(&buffer->address, size));
+  buffer->size = size;
+  return success();
+}
+
+static result_t wal_compression_init(wal_compression_t *c) {
+  if (!c->cctx) c->cctx = ZSTD_createCCtx();
+  if (!c->dctx) c->dctx = ZSTD_createDCtx();
+  ensure(c->cctx && c->dctx, msg("Unable to create zstd contexts"));
+  return success();
+}
+
+static void wal_compression_free(wal_compression_t *c) {
+  ZSTD_freeCCtx(c->cctx);
+  ZSTD_freeDCtx(c->dctx);
+  ZSTD_freeCDict(c->cdict);
+  ZSTD_freeDDict(c->ddict);
+  free(c->output.address);
+  free(c->samples.address);
+  free(c->sample_sizes.address);
+  pthread_mutex_destroy(&c->lock);
+}
+
+// zdict ignores larger samples, and we want many small ones
+#define WAL_DICTIONARY_MAX_SAMPLE (64 * 1024)
+
+static void wal_drop_older_samples(wal_compression_t *c) {
+  size_t *sizes = c->sample_sizes.address;
+  size_t count  = c->sample_sizes.used / sizeof(size_t);
+  size_t bytes = 0, i = 0;
+  while (i < count && bytes < c->samples.used / 2)
+    bytes += sizes[i++];
+  memmove(c->samples.address, c->samples.address + bytes,
+      c->samples.used - bytes);
+  memmove(sizes, sizes + i, (count - i) * sizeof(size_t));
+  c->samples.used -= bytes;
+  c->sample_sizes.used -= i * sizeof(size_t);
+}
+
+// <1>
+static void wal_collect_dictionary_sample(
+    db_state_t *db, void *data, size_t size) {
+  if (!db->options.wal_dictionary_size) return;
+  wal_compression_t *c = &db->wal_state.compression;
+  size = MIN(size, WAL_DICTIONARY_MAX_SAMPLE);
+  size_t budget = (size_t)db->options.wal_dictionary_size * 100;
+  pthread_mutex_lock(&c->lock);
+  if (c->samples.used + size > budget) wal_drop_older_samples(c);
+  if (flopped(wal_reserve(&c->samples, budget)) ||
+      flopped(wal_reserve(&c->sample_sizes,
+          c->sample_sizes.used + sizeof(size_t)))) {
+    errors_clear();  // samples are best effort
+  } else if (c->samples.used + size <= budget) {
+    memcpy(c->samples.address + c->samples.used, data, size);
+    c->samples.used += size;
+    memcpy(c->sample_sizes.address + c->sample_sizes.used, &size,
+        sizeof(size_t));
+    c->sample_sizes.used += sizeof(size_t);
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+// <2>
+static result_t wal_read_dictionary(
+    db_t *db, uint64_t page_num, span_t *dictionary) {
+  txn_t tx;
+  ensure(txn_create(db, TX_READ, &tx));
+  defer(txn_close, tx);
+  page_t page = {.page_num = page_num};
+  ensure(txn_get_page(&tx, &page));
+  overflow_page_t *overflow = &page.metadata->overflow;
+  uint64_t size = overflow->size_of_value;
+  ensure(overflow->page_flags == page_flags_overflow &&
+             size <= page.number_of_pages * PAGE_SIZE,
+      msg("WAL dictionary page is not a valid overflow page"),
+      with(page_num, "%lu"));
+  ensure(ZDICT_getDictID(page.address, size) == page_num,
+      msg("WAL dictionary id does not match its page"),
+      with(page_num, "%lu"));
+  ensure(mem_alloc(&dictionary->address, size));
+  memcpy(dictionary->address, page.address, size);
+  dictionary->size = size;
+  return success();
+}
+
+static result_t wal_use_compression_dictionary(
+    db_state_t *db, uint64_t page_num, span_t *dictionary) {
+  ZSTD_CDict *cdict = ZSTD_createCDict(dictionary->address,
+      dictionary->size, db->options.wal_compression_level);
+  ensure(cdict, msg("Unable to create zstd compression dictionary"),
+      with(page_num, "%lu"));
+  wal_compression_t *c = &db->wal_state.compression;
+  pthread_mutex_lock(&c->lock);
+  ZSTD_freeCDict(c->cdict);
+  c->cdict            = cdict;
+  c->cdict_page       = page_num;
+  c->retired_tx_id    = MAX(c->retired_tx_id, c->cdict_last_tx_id);
+  c->cdict_last_tx_id = 0;
+  pthread_mutex_unlock(&c->lock);
+  return success();
+}
+
+// <3>
+static result_t wal_load_current_dictionary(db_t *db) {
+  if (db->state->options.flags & db_flags_encrypted)
+    return success();  // sealed records don't use the dictionary
+  // the recovered records may use any of the retired dictionaries
+  db->state->wal_state.compression.retired_tx_id =
+      db->state->last_tx_id;
+  txn_t tx;
+  ensure(txn_create(db, TX_READ, &tx));
+  defer(txn_close, tx);
+  page_metadata_t *header;
+  ensure(txn_get_metadata(&tx, 0, &header));
+  if (header->file_header.page_flags != page_flags_file_header)
+    return success();  // new database
+  page_metadata_t *free_space;
+  ensure(txn_get_metadata(
+      &tx, header->file_header.free_space_bitmap_start, &free_space));
+  uint64_t page_num = free_space->free_space.wal_dictionary_page;
+  if (!page_num) return success();
+  span_t dictionary;
+  ensure(wal_read_dictionary(db, page_num, &dictionary));
+  defer(free, dictionary.address);
+  ensure(wal_use_compression_dictionary(
+      db->state, page_num, &dictionary));
+  return success();
+}
+
+static void wal_acquire_writer(wal_group_commit_t *group);
+static void wal_release_writer(wal_group_commit_t *group);
+
+// a retired dictionary may be needed until the WAL segments holding
+// the records compressed with it are recycled
+static bool wal_has_records_up_to(db_state_t *db, uint64_t tx_id) {
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  wal_acquire_writer(group);
+  bool found = false;
+  for (size_t i = 0; i < db->wal_state.number_of_files; i++) {
+    wal_file_state_t *file = &db->wal_state.files[i];
+    found |= file->last_write_pos && file->first_tx_id <= tx_id;
+  }
+  wal_release_writer(group);
+  return found;
+}
+
+static result_t wal_release_retired_dictionaries(
+    txn_t *w, page_metadata_t *free_space) {
+  db_state_t *db       = w->state->db;
+  wal_compression_t *c = &db->wal_state.compression;
+  pthread_mutex_lock(&c->lock);
+  uint64_t retired_tx_id = c->retired_tx_id;
+  pthread_mutex_unlock(&c->lock);
+  uint64_t page_num =
+      free_space->free_space.wal_retired_dictionary_page;
+  // shipped records may still be replayed by another WAL
+  if (!page_num || db->options.wal_write_callback ||
+      wal_has_records_up_to(db, retired_tx_id))
+    return success();
+  while (page_num) {
+    page_t page = {.page_num = page_num};
+    ensure(txn_get_page(w, &page));
+    page_num = page.metadata->overflow.container_item_id;
+    ensure(txn_free_page(w, &page));
+  }
+  free_space->free_space.wal_retired_dictionary_page = 0;
+  return success();
+}
+
+static result_t wal_retire_dictionary(
+    txn_t *w, page_metadata_t *free_space) {
+  uint64_t page_num = free_space->free_space.wal_dictionary_page;
+  if (!page_num) return success();
+  page_metadata_t *metadata;
+  ensure(txn_modify_metadata(w, page_num, &metadata));
+  metadata->overflow.container_item_id =
+      free_space->free_space.wal_retired_dictionary_page;
+  free_space->free_space.wal_retired_dictionary_page = page_num;
+  return success();
+}
+
+static result_t wal_store_dictionary(
+    db_t *db, span_t *dictionary, uint64_t *page_num) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t page = {
+      .number_of_pages = (uint32_t)TO_PAGES(dictionary->size)};
+  ensure(txn_allocate_page(&w, &page, 0));
+  ensure(page.page_num <= UINT32_MAX,
+      msg("WAL dictionary page is beyond the dictionary id range"),
+      with(page.page_num, "%lu"));
+  page.metadata->overflow.page_flags      = page_flags_overflow;
+  page.metadata->overflow.number_of_pages = page.number_of_pages;
+  page.metadata->overflow.size_of_value   = dictionary->size;
+  // <4>
+  uint32_t dict_id = (uint32_t)page.page_num;
+  memcpy(dictionary->address + 4, &dict_id, sizeof(uint32_t));
+  memcpy(page.address, dictionary->address, dictionary->size);
+
+  page_metadata_t *header, *free_space;
+  ensure(txn_get_metadata(&w, 0, &header));
+  ensure(txn_modify_metadata(
+      &w, header->file_header.free_space_bitmap_start, &free_space));
+  ensure(wal_release_retired_dictionaries(&w, free_space));
+  ensure(wal_retire_dictionary(&w, free_space));
+  free_space->free_space.wal_dictionary_page = page.page_num;
+  ensure(txn_commit(&w));
+  *page_num = page.page_num;
+  return success();
+}
+
+result_t wal_train_dictionary(db_t *db) {
+  uint32_t size = db->state->options.wal_dictionary_size;
+  ensure(size, msg("WAL dictionary size was not set"));
+  ensure(!(db->state->options.flags & db_flags_encrypted),
+      msg("Encrypted WAL records are not compressed"));
+  wal_compression_t *c = &db->state->wal_state.compression;
+  reusable_buffer_t samples = {0}, sizes = {0};
+  defer(free, samples.address);
+  defer(free, sizes.address);
+  pthread_mutex_lock(&c->lock);  // copy, train outside of the lock
+  samples       = c->samples;
+  sizes         = c->sample_sizes;
+  c->samples    = (reusable_buffer_t){0};
+  c->sample_sizes = (reusable_buffer_t){0};
+  pthread_mutex_unlock(&c->lock);
+
+  span_t dictionary = {.size = size};
+  ensure(mem_alloc(&dictionary.address, size));
+  defer(free, dictionary.address);
+  size_t res = ZDICT_trainFromBuffer(dictionary.address, size,
+      samples.address, sizes.address,
+      (unsigned)(sizes.used / sizeof(size_t)));
+  if (ZDICT_isError(res)) {
+    const char *zdict_error = ZDICT_getErrorName(res);
+    failed(ENODATA, msg("Unable to train WAL dictionary"),
+        with(sizes.used / sizeof(size_t), "%zu"),
+        with(zdict_error, "%s"));
+  }
+  dictionary.size = res;
+  uint64_t page_num;
+  ensure(wal_store_dictionary(db, &dictionary, &page_num));
+  // <5>
+  ensure(wal_use_compression_dictionary(
+      db->state, page_num, &dictionary));
+  return success();
+}
+// end::wal_compression[]
+
 // tag::wal_setup_transaction_data[]
 static void *wal_setup_transaction_data(
     txn_state_t *tx, wal_txn_t *wt, void *output) {
@@ -127,6 +475,8 @@ static void *wal_setup_transaction_data(
     } else {
       end = wal_diff_page(entry->previous, entry->address,
           size / sizeof(uint64_t), output);
+      wal_collect_dictionary_sample(
+          tx->db, output, (size_t)(end - output));
     }
     wt->pages[index].flags = (size == (size_t)(end - output))
                                  ? wal_txn_page_flags_none
@@ -140,117 +490,665 @@ static void *wal_setup_transaction_data(
 // end::wal_setup_transaction_data[]
 
 // tag::wal_compress_transaction[]
-static void *wal_compress_transaction(
-    wal_txn_t *wt, void *start, void *end) {
+static void *wal_compress_locked(db_state_t *db, wal_txn_t *wt,
+    void *start, void *end) {
+  wal_compression_t *c = &db->wal_state.compression;
   size_t input_size    = (size_t)(end - start);
   size_t required_size = ZSTD_compressBound(input_size);
-  void *buffer;
-  if (flopped(mem_alloc(&buffer, required_size))) {
+  // <1>
+  if (flopped(wal_compression_init(c)) ||
+      flopped(wal_reserve(&c->output, required_size))) {
     // no memory, we'll skip compression
     errors_clear();  // recoverable, so can clear it
     return end;
   }
-  defer(free, buffer);
-
+  // <2>
+  // sealed records are opened without the dictionary
+  bool sealed       = db->options.flags & db_flags_encrypted;
+  ZSTD_CDict *cdict = sealed ? 0 : c->cdict;
   size_t res =
-      ZSTD_compress(buffer, required_size, start, input_size, 0);
+      cdict ? ZSTD_compress_usingCDict(c->cctx, c->output.address,
+                  required_size, start, input_size, cdict)
+            : ZSTD_compressCCtx(c->cctx, c->output.address,
+                  required_size, start, input_size,
+                  db->options.wal_compression_level);
   if (ZSTD_isError(res) || res >= input_size) {
     // * we got an error, let's just return uncompressed
     // * compressed bigger than input? skip it
+    if (sealed) sodium_memzero(c->output.address, required_size);
     return end;
   }
   wt->flags = wal_txn_flags_compressed;
-  memcpy(start, buffer, res);
+  if (cdict) c->cdict_last_tx_id = wt->tx_id;
+  memcpy(start, c->output.address, res);
+  // the output buffer is reused, it must not keep plain text
+  if (sealed) sodium_memzero(c->output.address, res);
   return start + res;
 }
+
+static void *wal_compress_transaction(
+    db_state_t *db, wal_txn_t *wt, void *start, void *end) {
+  wal_compression_t *c = &db->wal_state.compression;
+  pthread_mutex_lock(&c->lock);
+  void *result = wal_compress_locked(db, wt, start, end);
+  pthread_mutex_unlock(&c->lock);
+  return result;
+}
 // end::wal_compress_transaction[]
 
+// tag::wal_seal_transaction[]
+static const char WalKeyCtx[8] = "WalRecrd";
+// must match the page encryption in txn.c
+static const char WalPageKeyCtx[8] = "TxnPages";
+
+static result_t wal_derive_key(db_options_t *options, uint64_t id,
+    const char ctx[8],
+    uint8_t key[crypto_aead_xchacha20poly1305_ietf_KEYBYTES]) {
+  if (crypto_kdf_derive_from_key(key,
+          crypto_aead_xchacha20poly1305_ietf_KEYBYTES, id, ctx,
+          options->encryption_key)) {
+    failed(EINVAL, msg("Unable to derive WAL key"), with(id, "%lu"));
+  }
+  return success();
+}
+
+// <1>
+static result_t wal_seal_transaction(
+    db_options_t *options, wal_txn_t *wt, void **end) {
+  void *body           = (void *)wt + sizeof(wal_txn_t);
+  size_t size          = (size_t)(*end - body);
+  wal_txn_seal_t *seal = body;
+  memmove(body + sizeof(wal_txn_seal_t), body, size);
+  randombytes_buf(seal->nonce, sizeof(seal->nonce));
+  uint8_t key[crypto_aead_xchacha20poly1305_ietf_KEYBYTES];
+  ensure(wal_derive_key(options, 0, WalKeyCtx, key));
+  // the tx id is authenticated, records can't be swapped around
+  int rc = crypto_aead_xchacha20poly1305_ietf_encrypt_detached(
+      body + sizeof(wal_txn_seal_t), seal->mac, 0,
+      body + sizeof(wal_txn_seal_t), size, (void *)&wt->tx_id,
+      sizeof(wt->tx_id), 0, seal->nonce, key);
+  sodium_memzero(key, sizeof(key));
+  ensure(!rc, msg("Unable to seal WAL transaction"),
+      with(wt->tx_id, "%lu"));
+  wt->flags = (enum wal_txn_flags)(wt->flags | wal_txn_flags_sealed);
+  *end += sizeof(wal_txn_seal_t);
+  return success();
+}
+
+// <2>
+static result_t wal_encrypt_sealed_pages(
+    db_options_t *options, wal_txn_t *tx) {
+  if (!(tx->flags & wal_txn_flags_sealed)) return success();
+  page_t *pages;
+  size_t count = tx->number_of_modified_pages;
+  ensure(mem_calloc((void *)&pages, count * sizeof(page_t)));
+  defer(free, pages);
+  for (size_t i = 0; i < count; i++) {
+    pages[i].page_num        = tx->pages[i].page_num;
+    pages[i].number_of_pages = tx->pages[i].number_of_pages;
+    pages[i].address         = (void *)tx + tx->pages[i].offset;
+    ensure(tx->pages[i].flags == wal_txn_page_flags_none,
+        msg("Sealed WAL transaction holds a page diff"),
+        with(tx->pages[i].page_num, "%lu"));
+  }
+  // data pages first, their macs go into the metadata entries
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < count; i++) {
+      uint64_t page_num = pages[i].page_num;
+      bool is_metadata =
+          (page_num & PAGES_IN_METADATA_MASK) == page_num;
+      if (is_metadata != (pass == 1)) continue;
+      page_metadata_t *entry = 0;
+      void *start            = pages[i].address;
+      size_t size            = pages[i].number_of_pages * PAGE_SIZE;
+      if (is_metadata) {
+        entry = pages[i].address;
+        start += PAGE_METADATA_CRYPTO_HEADER_SIZE;
+        size -= PAGE_METADATA_CRYPTO_HEADER_SIZE;
+      } else {
+        uint64_t metadata_page = page_num & PAGES_IN_METADATA_MASK;
+        for (size_t j = 0; j < count && !entry; j++) {
+          if (pages[j].page_num != metadata_page) continue;
+          page_metadata_t *entries = pages[j].address;
+          entry = &entries[page_num & ~PAGES_IN_METADATA_MASK];
+        }
+        ensure(entry, msg("Sealed WAL transaction has no metadata "
+                          "for a page"),
+            with(page_num, "%lu"));
+      }
+      // same nonce & key as the commit, so the same cipher text
+      uint8_t nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES] = {
+          0};
+      memcpy(nonce, entry->cyrpto.aead.nonce,
+          PAGE_METADATA_CRYPTO_NONCE_SIZE);
+      uint8_t key[crypto_aead_xchacha20poly1305_ietf_KEYBYTES];
+      ensure(wal_derive_key(options, page_num, WalPageKeyCtx, key));
+      int rc = crypto_aead_xchacha20poly1305_ietf_encrypt_detached(
+          start, entry->cyrpto.aead.mac, 0, start, size, 0, 0, 0,
+          nonce, key);
+      sodium_memzero(key, sizeof(key));
+      ensure(!rc, msg("Unable to encrypt recovered page"),
+          with(page_num, "%lu"));
+    }
+  }
+  unsigned sealed = wal_txn_flags_sealed;
+  tx->flags       = (enum wal_txn_flags)(tx->flags & ~sealed);
+  return success();
+}
+// end::wal_seal_transaction[]
+
+// tag::wal_buffer_pool[]
+// very large buffers aren't worth keeping around
+#define WAL_BUFFER_POOL_MAX_RETAINED (32 * 1024 * 1024)
+
+static result_t wal_buffer_acquire(
+    db_state_t *db, uint64_t size, span_t *buffer) {
+  wal_buffer_pool_t *pool = &db->wal_state.buffer_pool;
+  bool found              = false;
+  pthread_mutex_lock(&pool->lock);
+  // <1>
+  size_t best = 0;
+  for (size_t i = 0; i < pool->count; i++) {
+    if (pool->buffers[i].size < size) continue;
+    if (!found || pool->buffers[i].size < pool->buffers[best].size)
+      best = i;
+    found = true;
+  }
+  if (found) {
+    *buffer             = pool->buffers[best];
+    pool->buffers[best] = pool->buffers[--pool->count];
+    pool->reuses++;
+  } else {
+    pool->allocations++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  if (found) return success();
+  // <2>
+  buffer->size = next_power_of_two(size);
+  ensure(mem_alloc_page_aligned(&buffer->address, buffer->size));
+  return success();
+}
+
+static void wal_buffer_release(db_state_t *db, span_t *buffer) {
+  if (!buffer->address) return;
+  wal_buffer_pool_t *pool = &db->wal_state.buffer_pool;
+  span_t discard          = *buffer;
+  pthread_mutex_lock(&pool->lock);
+  if (buffer->size <= WAL_BUFFER_POOL_MAX_RETAINED) {
+    // <3>
+    size_t smallest = 0;
+    for (size_t i = 1; i < pool->count; i++) {
+      if (pool->buffers[i].size < pool->buffers[smallest].size)
+        smallest = i;
+    }
+    if (pool->count < WAL_BUFFER_POOL_SIZE) {
+      pool->buffers[pool->count++] = *buffer;
+      discard.address              = 0;
+    } else if (pool->buffers[smallest].size < buffer->size) {
+      discard                 = pool->buffers[smallest];
+      pool->buffers[smallest] = *buffer;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  free(discard.address);
+  buffer->address = 0;
+}
+
+static void wal_buffer_pool_free(wal_buffer_pool_t *pool) {
+  for (size_t i = 0; i < pool->count; i++)
+    free(pool->buffers[i].address);
+  pool->count = 0;
+  pthread_mutex_destroy(&pool->lock);
+}
+
+typedef struct wal_pooled_buffer {
+  db_state_t *db;
+  span_t span;
+} wal_pooled_buffer_t;
+
+static void defer_wal_pooled_buffer_release(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  wal_pooled_buffer_t *buffer = cd->target;
+  wal_buffer_release(buffer->db, &buffer->span);
+}
+// end::wal_buffer_pool[]
+
 // tag::wal_prepare_txn_buffer[]
-static result_t wal_prepare_txn_buffer(
-    txn_state_t *tx, wal_txn_t **txn_buffer) {
-  uint64_t pages = tx->modified_pages->count;
+static result_t wal_prepare_txn_buffer(txn_state_t *tx,
+    wal_pooled_buffer_t *buffer, bool plain_text) {
+  uint64_t pages      = tx->modified_pages->count;
+  uint64_t data_pages = 0;
+  size_t iter_state   = 0;
+  page_t *entry;
+  while (pagesmap_get_next(tx->modified_pages, &iter_state, &entry))
+    data_pages += entry->number_of_pages;
   // <1>
   size_t tx_header_size =
       sizeof(wal_txn_t) + pages * sizeof(wal_txn_page_t);
   uint64_t total_size =
-      (TO_PAGES(tx_header_size) + pages) * PAGE_SIZE;
+      (TO_PAGES(tx_header_size + sizeof(wal_txn_seal_t)) +
+          data_pages) *
+      PAGE_SIZE;
   size_t cancel_defer = 0;
-  wal_txn_t *wt;
-  ensure(mem_alloc_page_aligned((void *)&wt, total_size));
-  try_defer(free, wt, cancel_defer);
-  memset(wt, 0, total_size);
+  buffer->db          = tx->db;
+  ensure(wal_buffer_acquire(tx->db, total_size, &buffer->span));
+  try_defer(wal_pooled_buffer_release, *buffer, cancel_defer);
+  wal_txn_t *wt = buffer->span.address;
+  // <2>
+  memset(wt, 0, sizeof(wal_txn_t));
   wt->total_number_of_pages_in_database = tx->number_of_pages;
   wt->number_of_modified_pages          = pages;
   wt->tx_id                             = tx->tx_id;
   void *end                             = wal_setup_transaction_data(
       tx, wt, ((char *)wt) + tx_header_size);
-  if (!(tx->db->options.flags & db_flags_encrypted)) {
+  bool encrypted  = tx->db->options.flags & db_flags_encrypted;
+  void *plain_end = end;
+  // <3>
+  if (!encrypted || plain_text) {
     end = wal_compress_transaction(
-        wt, (char *)wt + sizeof(wal_txn_t), end);
+        tx->db, wt, (char *)wt + sizeof(wal_txn_t), end);
+  }
+  if (encrypted && plain_text) {
+    // pooled buffers outlive the record, so only cipher text may
+    // remain in them
+    if (flopped(wal_seal_transaction(&tx->db->options, wt, &end))) {
+      sodium_memzero(wt, (size_t)((char *)plain_end - (char *)wt));
+      return failure_code();
+    }
+    if (plain_end > end)
+      sodium_memzero(end, (size_t)((char *)plain_end - (char *)end));
   }
   wt->tx_size              = (uint64_t)((char *)end - (char *)wt);
   wt->page_aligned_tx_size = TO_PAGES(wt->tx_size) * PAGE_SIZE;
   memset(((void *)wt) + wt->tx_size, 0,
       wt->page_aligned_tx_size - wt->tx_size);
 
-  *txn_buffer  = wt;
   cancel_defer = 1;
   return success();
 }
+
+result_t wal_prepare_sealed(txn_state_t *tx) {
+  wal_pooled_buffer_t buffer = {.db = tx->db};
+  ensure(wal_prepare_txn_buffer(tx, &buffer, true));
+  tx->sealed_wal_record = buffer.span;
+  return success();
+}
+
+void wal_discard_sealed(txn_state_t *tx) {
+  wal_buffer_release(tx->db, &tx->sealed_wal_record);
+}
 // end::wal_prepare_txn_buffer[]
 
-static result_t wal_increase_file_size_if_needed(
+static result_t wal_increase_file_size_if_needed(db_state_t *db,
     wal_file_state_t *cur_file, uint64_t size_to_write) {
   if (cur_file->last_write_pos + size_to_write >
       cur_file->span.size) {
     // we need to increase the WAL size
-    uint64_t wal_size =
+    uint64_t wal_size = db_align_to_file_extent(&db->options,
         cur_file->span.size +
-        MAX(next_power_of_two(cur_file->span.size / 10),
-            size_to_write * 2);
+            MAX(next_power_of_two(cur_file->span.size / 10),
+                size_to_write * 2));
     ensure(pal_set_file_size(cur_file->handle, wal_size, UINT64_MAX));
     cur_file->span.size = wal_size;
   }
   return success();
 }
 
+// tag::wal_select_append_file[]
+// moving to a recycled segment is cheaper than growing the current
+// one, the classic pair of files only switches on checkpoints
+static wal_file_state_t *wal_select_append_file(
+    wal_state_t *wal, uint64_t size_to_write) {
+  wal_file_state_t *cur = &wal->files[wal->current_append_file_index];
+  if (wal->number_of_files <= 2 || !cur->last_write_pos ||
+      cur->last_write_pos + size_to_write <= cur->span.size)
+    return cur;
+  size_t next =
+      (wal->current_append_file_index + 1) % wal->number_of_files;
+  if (wal->files[next].last_write_pos)
+    return cur;  // not checkpointed yet, will have to grow
+  wal->current_append_file_index = next;
+  return &wal->files[next];
+}
+// end::wal_select_append_file[]
+
+// tag::wal_write_records[]
+static result_t wal_write_records(
+    db_state_t *db, span_t *records, size_t count) {
+  uint64_t size = 0;
+  for (size_t i = 0; i < count; i++) size += records[i].size;
+
+  wal_file_state_t *cur_file =
+      wal_select_append_file(&db->wal_state, size);
+  ensure(wal_increase_file_size_if_needed(db, cur_file, size));
+  if (count == 1) {
+    ensure(pal_write_file(cur_file->handle, cur_file->last_write_pos,
+        records[0].address, records[0].size));
+  } else {
+    ensure(pal_write_file_vectored(cur_file->handle,
+        cur_file->last_write_pos, records, count, 0));
+  }
+  if (!cur_file->last_write_pos)
+    cur_file->first_tx_id = ((wal_txn_t *)records[0].address)->tx_id;
+  cur_file->last_write_pos += size;
+  cur_file->last_tx_id =
+      ((wal_txn_t *)records[count - 1].address)->tx_id;
+  // <1>
+  if (db->options.wal_write_callback) {
+    for (size_t i = 0; i < count; i++) {
+      db->options.wal_write_callback(
+          db->options.wal_write_callback_state,
+          ((wal_txn_t *)records[i].address)->tx_id, &records[i]);
+    }
+  }
+  return success();
+}
+// end::wal_write_records[]
+
+// tag::wal_group_commit[]
+struct wal_pending_write {
+  wal_pending_write_t *next;
+  wal_txn_t *txn_buffer;
+  uint64_t buffer_size;  // 0 if the caller owns the buffer
+};
+
+static result_t wal_group_commit_enqueue(
+    db_state_t *db, wal_txn_t *txn_buffer, uint64_t buffer_size) {
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  wal_pending_write_t *pending;
+  ensure(mem_calloc((void *)&pending, sizeof(wal_pending_write_t)));
+  pending->txn_buffer  = txn_buffer;
+  pending->buffer_size = buffer_size;
+
+  pthread_mutex_lock(&group->lock);
+  if (group->failed) {
+    pthread_mutex_unlock(&group->lock);
+    free(pending);
+    failed(EIO, msg("A previous WAL write failed, cannot commit"),
+        with(txn_buffer->tx_id, "%lu"));
+  }
+  // <1>
+  if (group->tail)
+    group->tail->next = pending;
+  else
+    group->head = pending;
+  group->tail              = pending;
+  group->last_queued_tx_id = txn_buffer->tx_id;
+  group->pending_bytes += txn_buffer->page_aligned_tx_size;
+  bool over_threshold =
+      group->pending_bytes >= db->options.wal_async_flush_bytes;
+  bool over_limit =
+      group->pending_bytes >= db->options.wal_async_flush_bytes * 4;
+  if (over_threshold) pthread_cond_signal(&group->flush_needed);
+  pthread_mutex_unlock(&group->lock);
+  // the flusher is falling behind, apply backpressure
+  if (over_limit && (db->options.flags & db_flags_async_commit)) {
+    ensure(wal_wait_until_durable(db, txn_buffer->tx_id));
+  }
+  return success();
+}
+
+static void wal_group_commit_free_batch(
+    db_state_t *db, wal_pending_write_t *batch) {
+  while (batch) {
+    wal_pending_write_t *next = batch->next;
+    if (batch->buffer_size) {
+      span_t buffer = {.address = batch->txn_buffer,
+          .size                 = batch->buffer_size};
+      wal_buffer_release(db, &buffer);
+    }
+    free(batch);
+    batch = next;
+  }
+}
+
+static result_t wal_group_commit_write_batch(
+    db_state_t *db, wal_pending_write_t *batch, size_t *count) {
+  *count = 0;
+  for (wal_pending_write_t *cur = batch; cur; cur = cur->next)
+    (*count)++;
+  span_t *records;
+  ensure(mem_alloc((void *)&records, *count * sizeof(span_t)));
+  defer(free, records);
+  size_t index = 0;
+  for (wal_pending_write_t *cur = batch; cur; cur = cur->next) {
+    records[index].address = cur->txn_buffer;
+    records[index].size    = cur->txn_buffer->page_aligned_tx_size;
+    index++;
+  }
+  // <2>
+  ensure(wal_write_records(db, records, *count));
+  return success();
+}
+
+// must be called with the group commit lock held
+static result_t wal_group_commit_lead(db_state_t *db) {
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  // <3>
+  wal_pending_write_t *batch = group->head;
+  uint64_t last_tx_id        = group->last_queued_tx_id;
+  group->head = group->tail = 0;
+  group->pending_bytes      = 0;
+  group->leader_active      = true;
+  pthread_mutex_unlock(&group->lock);
+
+  size_t count = 0;
+  bool written =
+      !flopped(wal_group_commit_write_batch(db, batch, &count));
+  wal_group_commit_free_batch(db, batch);
+
+  // <4>
+  pthread_mutex_lock(&group->lock);
+  group->leader_active = false;
+  if (written) {
+    group->durable_tx_id = last_tx_id;
+    group->number_of_writes++;
+    group->number_of_records += count;
+  } else {
+    group->failed = true;  // the WAL state is unknown, stop writes
+  }
+  pthread_cond_broadcast(&group->written);
+  if (!written) return failure_code();
+  return success();
+}
+
+// direct appends and checkpoints move the WAL positions as well,
+// they take the same role as a leader, without a batch
+static void wal_acquire_writer(wal_group_commit_t *group) {
+  pthread_mutex_lock(&group->lock);
+  while (group->leader_active)
+    pthread_cond_wait(&group->written, &group->lock);
+  group->leader_active = true;
+  pthread_mutex_unlock(&group->lock);
+}
+
+static void wal_release_writer(wal_group_commit_t *group) {
+  pthread_mutex_lock(&group->lock);
+  group->leader_active = false;
+  pthread_cond_broadcast(&group->written);
+  pthread_mutex_unlock(&group->lock);
+}
+
+result_t wal_wait_until_durable(db_state_t *db, uint64_t tx_id) {
+  if (!(db->options.flags & db_flags_wal_queued_writes))
+    return success();  // wal_append already wrote it
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  pthread_mutex_lock(&group->lock);
+  while (group->durable_tx_id < tx_id && !group->failed) {
+    if (group->leader_active) {
+      // <5>
+      pthread_cond_wait(&group->written, &group->lock);
+      continue;
+    }
+    if (!group->head) break;  // nothing queued for this tx_id
+    if (flopped(wal_group_commit_lead(db))) break;
+  }
+  bool durable = group->durable_tx_id >= tx_id;
+  pthread_mutex_unlock(&group->lock);
+  if (!durable) {
+    failed(EIO, msg("Transaction was not written to the WAL"),
+        with(tx_id, "%lu"));
+  }
+  return success();
+}
+
+bool wal_is_durable(db_state_t *db, uint64_t tx_id) {
+  if (!(db->options.flags & db_flags_wal_queued_writes)) return true;
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  pthread_mutex_lock(&group->lock);
+  bool durable = group->durable_tx_id >= tx_id;
+  pthread_mutex_unlock(&group->lock);
+  return durable;
+}
+
+// a failed write leaves commits that never reached the WAL behind
+bool wal_has_failed(db_state_t *db) {
+  if (!(db->options.flags & db_flags_wal_queued_writes)) return false;
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  pthread_mutex_lock(&group->lock);
+  bool broken = group->failed;
+  pthread_mutex_unlock(&group->lock);
+  return broken;
+}
+
+static result_t wal_group_commit_drain(db_state_t *db) {
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  pthread_mutex_lock(&group->lock);
+  uint64_t last_tx_id = group->last_queued_tx_id;
+  pthread_mutex_unlock(&group->lock);
+  return wal_wait_until_durable(db, last_tx_id);
+}
+// end::wal_group_commit[]
+
+// tag::wal_async_flusher[]
+static void *wal_async_flusher(void *arg) {
+  db_state_t *db            = arg;
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  pthread_mutex_lock(&group->lock);
+  while (!group->stop_flusher && !group->failed) {
+    // <1>
+    if (group->head && !group->leader_active) {
+      if (flopped(wal_group_commit_lead(db))) {
+        errors_clear();  // committers will see group->failed
+        continue;
+      }
+    }
+    // <2>
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    uint64_t nsec = (uint64_t)deadline.tv_nsec +
+                    db->options.wal_async_flush_ms * 1000000UL;
+    deadline.tv_sec += (time_t)(nsec / 1000000000UL);
+    deadline.tv_nsec = (long)(nsec % 1000000000UL);
+    pthread_cond_timedwait(
+        &group->flush_needed, &group->lock, &deadline);
+  }
+  pthread_mutex_unlock(&group->lock);
+  return 0;
+}
+
+static result_t wal_start_async_flusher(db_state_t *db) {
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  if (!(db->options.flags & db_flags_async_commit)) return success();
+  int rc = pthread_create(&group->flusher, 0, wal_async_flusher, db);
+  if (rc) {
+    failed(rc, msg("Unable to start the WAL flusher thread"));
+  }
+  group->flusher_running = true;
+  return success();
+}
+
+static void wal_stop_async_flusher(db_state_t *db) {
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  if (!group->flusher_running) return;
+  pthread_mutex_lock(&group->lock);
+  group->stop_flusher = true;
+  pthread_cond_signal(&group->flush_needed);
+  pthread_mutex_unlock(&group->lock);
+  pthread_join(group->flusher, 0);
+  group->flusher_running = false;
+}
+
+// tag::db_flush_wal[]
+result_t db_flush_wal(db_t *db) {
+  ensure(wal_group_commit_drain(db->state));
+  return success();
+}
+// end::db_flush_wal[]
+// end::wal_async_flusher[]
+
 // tag::wal_append[]
+// shipped records belong to the caller, written as a single batch
+static result_t wal_append_shipped(txn_state_t *tx) {
+  span_t single   = {.address = tx->shipped_wal_record};
+  span_t *records = tx->shipped_wal_records;
+  size_t count    = tx->number_of_shipped_wal_records;
+  if (!count) {
+    single.size = ((wal_txn_t *)single.address)->page_aligned_tx_size;
+    records     = &single;
+    count       = 1;
+  }
+  if (tx->db->options.flags & db_flags_wal_queued_writes) {
+    for (size_t i = 0; i < count; i++) {
+      ensure(wal_group_commit_enqueue(tx->db, records[i].address, 0));
+    }
+    // can't outlive the call, so we wait for the flusher
+    ensure(wal_wait_until_durable(tx->db, tx->tx_id));
+    return success();
+  }
+  wal_group_commit_t *group = &tx->db->wal_state.group_commit;
+  wal_acquire_writer(group);
+  bool written = !flopped(wal_write_records(tx->db, records, count));
+  wal_release_writer(group);
+  ensure(written, msg("Unable to append shipped records to the WAL"),
+      with(tx->tx_id, "%lu"));
+  return success();
+}
+
 result_t wal_append(txn_state_t *tx) {
-  wal_txn_t *txn_buffer   = 0;
-  size_t skip_free_buffer = 0;
-  try_defer(free, txn_buffer, skip_free_buffer);
+  wal_txn_t *txn_buffer      = 0;
+  wal_pooled_buffer_t buffer = {.db = tx->db};
+  size_t skip_free_buffer    = 0;
+  try_defer(wal_pooled_buffer_release, buffer, skip_free_buffer);
 
   // <1>
   if (tx->flags & txn_flags_apply_log) {
     skip_free_buffer = 1;
-    txn_buffer       = tx->shipped_wal_record;
+    ensure(wal_append_shipped(tx));
+    return success();
+  }
+  if (tx->sealed_wal_record.address) {
+    buffer.span           = tx->sealed_wal_record;
+    tx->sealed_wal_record = (span_t){0};
   } else {
-    ensure(wal_prepare_txn_buffer(tx, &txn_buffer));
-    const size_t size = crypto_generichash_BYTES;
-    ensure(!crypto_generichash(txn_buffer->hash_blake2b, size,
-               (uint8_t *)txn_buffer + size,
-               txn_buffer->page_aligned_tx_size - size, 0, 0),
-        msg("Unable to compute hash for transaction"),
-        with(txn_buffer->tx_id, "%lu"));
+    ensure(wal_prepare_txn_buffer(tx, &buffer, false));
   }
+  txn_buffer        = buffer.span.address;
+  const size_t size = CHECKSUM_SIZE;
+  txn_buffer->checksum_algorithm = tx->db->options.checksum_algorithm;
+  ensure(checksum_compute(txn_buffer->checksum_algorithm,
+             (uint8_t *)txn_buffer + size,
+             txn_buffer->page_aligned_tx_size - size,
+             txn_buffer->hash_blake2b),
+      msg("Unable to compute hash for transaction"),
+      with(txn_buffer->tx_id, "%lu"));
 
-  wal_state_t *wal = &tx->db->wal_state;
-  wal_file_state_t *cur_file =
-      &wal->files[wal->current_append_file_index];
-  ensure(wal_increase_file_size_if_needed(
-      cur_file, txn_buffer->page_aligned_tx_size));
-  ensure(pal_write_file(cur_file->handle, cur_file->last_write_pos,
-      (char *)txn_buffer, txn_buffer->page_aligned_tx_size));
-  cur_file->last_write_pos += txn_buffer->page_aligned_tx_size;
-  cur_file->last_tx_id = tx->tx_id;
   // <2>
-  if (tx->db->options.wal_write_callback) {
-    span_t wal_record = {.address = txn_buffer,
-        .size                     = txn_buffer->page_aligned_tx_size};
-    tx->db->options.wal_write_callback(
-        tx->db->options.wal_write_callback_state, txn_buffer->tx_id,
-        &wal_record);
+  if (tx->db->options.flags & db_flags_wal_queued_writes) {
+    ensure(wal_group_commit_enqueue(
+        tx->db, txn_buffer, buffer.span.size));
+    skip_free_buffer = 1;  // the queue owns the buffer now
+    return success();
   }
+  span_t wal_record = {.address = txn_buffer,
+      .size                     = txn_buffer->page_aligned_tx_size};
+  // <3>
+  wal_group_commit_t *group = &tx->db->wal_state.group_commit;
+  wal_acquire_writer(group);
+  bool written = !flopped(wal_write_records(tx->db, &wal_record, 1));
+  wal_release_writer(group);
+  ensure(written, msg("Unable to append to the WAL"),
+      with(tx->tx_id, "%lu"));
   return success();
 }
 // end::wal_append[]
@@ -259,17 +1157,23 @@ result_t wal_append(txn_state_t *tx) {
 typedef struct wal_recovery_operation {
   db_t *db;
   wal_state_t *wal;
-  wal_file_state_t *files[2];
+  wal_file_state_t *files[WAL_MAX_SEGMENTS];
+  size_t number_of_files;
   size_t current_recovery_file_index;
   void *start;
   void *end;
   uint64_t last_recovered_tx_id;
-  reusable_buffer_t tmp_buffer;
+  pages_map_t *pages;  // latest image of each recovered page
+  struct wal_recovery_pool *pool;
+  uint64_t *recovered;  // page numbers to validate at the end
+  size_t number_of_recovered;
+  size_t recovered_capacity;
 } wal_recovery_operation_t;
 // end::wal_recovery_operation[]
 
-static result_t wal_validate_transaction(reusable_buffer_t *file,
-    void *start, void *end, wal_txn_t **txn_p);
+static result_t wal_validate_transaction(db_t *db,
+    reusable_buffer_t *buffer, void *start, void *end,
+    wal_txn_t **txn_p);
 
 // tag::wal_init_recover_state[]
 static void wal_init_recover_state(
@@ -279,65 +1183,36 @@ static void wal_init_recover_state(
   state->wal                  = wal;
   state->last_recovered_tx_id = 0;
 
-  // find the appropriate order to scan through the WAL records
-  uint64_t tx_ids[2] = {0, 0};
-  for (size_t i = 0; i < 2; i++) {
+  // order the segments with valid records by their first tx id
+  uint64_t tx_ids[WAL_MAX_SEGMENTS] = {0};
+  for (size_t i = 0; i < wal->number_of_files; i++) {
     void *start = wal->files[i].span.address;
     void *end   = start + wal->files[i].span.size;
     wal_txn_t *tx;
-    if (flopped(wal_validate_transaction(
-            &state->tmp_buffer, start, end, &tx)))
+    if (flopped(wal_validate_transaction(db, 0, start, end, &tx)) ||
+        !tx)
       continue;
-    if (tx) {
-      tx_ids[i] = tx->tx_id;
+    size_t pos = state->number_of_files++;
+    while (pos && tx_ids[pos - 1] > tx->tx_id) {
+      tx_ids[pos]      = tx_ids[pos - 1];
+      state->files[pos] = state->files[pos - 1];
+      pos--;
     }
+    tx_ids[pos]       = tx->tx_id;
+    state->files[pos] = &wal->files[i];
   }
   errors_clear();  // errors expected, txs did not pass validation?
-  if (!tx_ids[0] && !tx_ids[1]) {
-    state->current_recovery_file_index = 1;
+  if (!state->number_of_files) {
     return;  // nothing to do here, no need to recover
   }
-  if (tx_ids[0] > tx_ids[1]) {
-    if (tx_ids[1]) {
-      state->files[1] = &wal->files[1];
-    } else {
-      state->current_recovery_file_index = 1;
-    }
-    state->files[state->current_recovery_file_index] = &wal->files[0];
-  } else {
-    if (tx_ids[0]) {
-      state->files[1] = &wal->files[0];
-    } else {
-      state->current_recovery_file_index = 1;
-    }
-    state->files[state->current_recovery_file_index] = &wal->files[1];
-  }
-  wal_file_state_t *cur =
-      state->files[state->current_recovery_file_index];
+  // new records go after the most recent ones
   wal->current_append_file_index =
-      !state->current_recovery_file_index;
-  state->start = cur->span.address;
-  state->end   = state->start + cur->span.size;
+      (size_t)(state->files[state->number_of_files - 1] - wal->files);
+  state->start = state->files[0]->span.address;
+  state->end   = state->start + state->files[0]->span.size;
 }
 // end::wal_init_recover_state[]
 
-// tag::wal_validate_recovered_pages[]
-static result_t wal_validate_recovered_pages(
-    db_t *db, pages_map_t *modified_pages) {
-  size_t iter_state = 0;
-  page_t *page_to_validate;
-  while (pagesmap_get_next(
-      modified_pages, &iter_state, &page_to_validate)) {
-    txn_t rtx;
-    ensure(txn_create(db, TX_READ, &rtx));
-    defer(txn_close, rtx);
-    page_t p = {.page_num = page_to_validate->page_num};
-    ensure(txn_get_page(&rtx, &p));
-  }
-  return success();
-}
-// end::wal_validate_recovered_pages[]
-
 // tag::wal_range[]
 static result_t wal_get_next_range(
     wal_recovery_operation_t *state, void **current, void **end) {
@@ -377,8 +1252,7 @@ static result_t wal_validate_after_end_of_transactions(
     ensure(wal_get_next_range(s, &cur, &end));
     if (!cur) break;
     wal_txn_t *tx;
-    if (flopped(wal_validate_transaction(
-            &s->tmp_buffer, cur, end, &tx)) ||
+    if (flopped(wal_validate_transaction(s->db, 0, cur, end, &tx)) ||
         !tx) {
       errors_clear();  // errors are expected here
       wal_increment_next_range_start(s, PAGE_SIZE);
@@ -387,7 +1261,9 @@ static result_t wal_validate_after_end_of_transactions(
     if (s->last_recovered_tx_id > tx->tx_id) {
       break;  // valid old tx, we had a WAL reset and can stop
     }
-    ssize_t corrupted_pos   = cur - s->files[0]->span.address;
+    wal_file_state_t *file =
+        s->files[s->current_recovery_file_index];
+    ssize_t corrupted_pos   = cur - file->span.address;
     wal_txn_t *corrupted_tx = cur;
     failed(ENODATA, msg("Valid TX after invalid TX"),
         with(corrupted_pos, "%zd"), with(tx->tx_id, "%lu"),
@@ -399,27 +1275,41 @@ static result_t wal_validate_after_end_of_transactions(
 // end::wal_validate_after_end_of_transactions[]
 
 // tag::wal_decompress_transaction[]
-static result_t wal_decompress_transaction(
-    reusable_buffer_t *buffer, wal_txn_t *in, wal_txn_t **txp) {
+static result_t wal_select_decompression_dictionary(
+    db_t *db, wal_compression_t *c, uint32_t dict_id) {
+  if (!dict_id || c->ddict_page == dict_id) return success();
   // <1>
-  if (in->flags == wal_txn_flags_none) {
-    *txp = in;
-    return success();
-  }
+  span_t dictionary;
+  ensure(wal_read_dictionary(db, dict_id, &dictionary));
+  defer(free, dictionary.address);
+  ZSTD_DDict *ddict =
+      ZSTD_createDDict(dictionary.address, dictionary.size);
+  ensure(ddict, msg("Unable to create zstd decompression dictionary"),
+      with(dict_id, "%u"));
+  ZSTD_freeDDict(c->ddict);
+  c->ddict      = ddict;
+  c->ddict_page = dict_id;
+  return success();
+}
+
+static result_t wal_decompress_with(struct ZSTD_DCtx_s *dctx,
+    struct ZSTD_DDict_s *ddict, reusable_buffer_t *buffer,
+    wal_txn_t *in, wal_txn_t **txp) {
+  void *src       = (void *)in + sizeof(wal_txn_t);
+  size_t src_size = in->tx_size - sizeof(wal_txn_t);
   // <2>
   size_t required_size =
-      ZSTD_getDecompressedSize((void *)in + sizeof(wal_txn_t),
-          in->tx_size - sizeof(wal_txn_t)) +
-      sizeof(wal_txn_t);
-  if (required_size > buffer->size) {
-    ensure(mem_realloc(&buffer->address, required_size));
-    buffer->size = required_size;
-  }
+      ZSTD_getDecompressedSize(src, src_size) + sizeof(wal_txn_t);
+  ensure(wal_reserve(buffer, required_size));
   // <3>
-  size_t res = ZSTD_decompress(buffer->address + sizeof(wal_txn_t),
-      required_size - sizeof(wal_txn_t),
-      (void *)in + sizeof(wal_txn_t),
-      in->tx_size - sizeof(wal_txn_t));
+  size_t res =
+      ddict ? ZSTD_decompress_usingDDict(dctx,
+                  buffer->address + sizeof(wal_txn_t),
+                  required_size - sizeof(wal_txn_t), src, src_size,
+                  ddict)
+            : ZSTD_decompressDCtx(dctx,
+                  buffer->address + sizeof(wal_txn_t),
+                  required_size - sizeof(wal_txn_t), src, src_size);
   if (ZSTD_isError(res)) {
     const char *zstd_error = ZSTD_getErrorName(res);
     failed(ENODATA, msg("Failed to decompress transaction"),
@@ -431,64 +1321,395 @@ static result_t wal_decompress_transaction(
   (*txp)->tx_size = buffer->used = res + sizeof(wal_txn_t);
   return success();
 }
+
+// <6>
+static result_t wal_unseal_with(db_options_t *options,
+    struct ZSTD_DCtx_s *dctx, reusable_buffer_t *buffer,
+    wal_txn_t *in, wal_txn_t **txp) {
+  const size_t header = sizeof(wal_txn_t) + sizeof(wal_txn_seal_t);
+  ensure(in->tx_size >= header,
+      msg("Sealed WAL transaction is too small"),
+      with(in->tx_id, "%lu"));
+  wal_txn_seal_t *seal = (void *)in + sizeof(wal_txn_t);
+  size_t size          = in->tx_size - header;
+  // compressed records are opened into a scratch buffer first
+  bool compressed           = in->flags & wal_txn_flags_compressed;
+  reusable_buffer_t scratch = {0};
+  reusable_buffer_t *target = compressed ? &scratch : buffer;
+  ensure(wal_reserve(target, sizeof(wal_txn_t) + size));
+  defer(free, scratch.address);
+  uint8_t key[crypto_aead_xchacha20poly1305_ietf_KEYBYTES];
+  ensure(wal_derive_key(options, 0, WalKeyCtx, key));
+  int rc = crypto_aead_xchacha20poly1305_ietf_decrypt_detached(
+      target->address + sizeof(wal_txn_t), 0, (void *)in + header,
+      size, seal->mac, (void *)&in->tx_id, sizeof(in->tx_id),
+      seal->nonce, key);
+  sodium_memzero(key, sizeof(key));
+  ensure(!rc, msg("Unable to open sealed WAL transaction"),
+      with(in->tx_id, "%lu"));
+  memcpy(target->address, in, sizeof(wal_txn_t));
+  wal_txn_t *opened = target->address;
+  opened->tx_size = target->used = sizeof(wal_txn_t) + size;
+  if (!compressed) {
+    *txp = opened;
+    return success();
+  }
+  bool decompressed =
+      !flopped(wal_decompress_with(dctx, 0, buffer, opened, txp));
+  sodium_memzero(scratch.address, scratch.size);
+  ensure(decompressed);
+  return success();
+}
+
+static result_t wal_decompress_locked(db_t *db,
+    reusable_buffer_t *buffer, wal_txn_t *in, wal_txn_t **txp) {
+  wal_compression_t *c = &db->state->wal_state.compression;
+  void *src            = (void *)in + sizeof(wal_txn_t);
+  size_t src_size      = in->tx_size - sizeof(wal_txn_t);
+  ensure(wal_compression_init(c));
+  if (in->flags & wal_txn_flags_sealed) {
+    ensure(wal_unseal_with(&db->state->options, c->dctx, buffer, in,
+        txp));
+    return success();
+  }
+  unsigned dict_id = ZSTD_getDictID_fromFrame(src, src_size);
+  ensure(wal_select_decompression_dictionary(db, c, dict_id));
+  ensure(wal_decompress_with(
+      c->dctx, dict_id ? c->ddict : 0, buffer, in, txp));
+  return success();
+}
+
+static result_t wal_decompress_transaction(db_t *db,
+    reusable_buffer_t *buffer, wal_txn_t *in, wal_txn_t **txp) {
+  // <5>
+  if (in->flags == wal_txn_flags_none || !buffer) {
+    *txp = in;
+    return success();
+  }
+  wal_compression_t *c = &db->state->wal_state.compression;
+  pthread_mutex_lock(&c->lock);
+  bool decompressed =
+      !flopped(wal_decompress_locked(db, buffer, in, txp));
+  pthread_mutex_unlock(&c->lock);
+  ensure(decompressed, msg("Unable to decompress transaction"),
+      with(in->tx_id, "%lu"));
+  return success();
+}
 // end::wal_decompress_transaction[]
 
 // tag::wal_validate_transaction[]
-static result_t wal_validate_transaction(reusable_buffer_t *buffer,
-    void *start, void *end, wal_txn_t **txn_p) {
-  *txn_p        = 0;
-  wal_txn_t *tx = start;
-  if (!tx->tx_id || tx->page_aligned_tx_size + start > end) {
-    *txn_p = 0;
+static result_t wal_hash_matches(
+    wal_txn_t *tx, void *end, bool *matches) {
+  *matches = false;
+  if (!tx->tx_id || tx->page_aligned_tx_size + (void *)tx > end)
     return success();
-  }
-  uint8_t hash[crypto_generichash_BYTES];
-  const size_t size = crypto_generichash_BYTES;
-  ensure(!crypto_generichash(hash, size, (uint8_t *)tx + size,
-             tx->page_aligned_tx_size - size, 0, 0),
+  // a torn header may hold any algorithm id, not a valid record
+  if (!checksum_is_known(tx->checksum_algorithm)) return success();
+  uint8_t hash[CHECKSUM_SIZE];
+  const size_t size = CHECKSUM_SIZE;
+  ensure(checksum_compute(tx->checksum_algorithm,
+             (uint8_t *)tx + size, tx->page_aligned_tx_size - size,
+             hash),
       msg("Unable to compute hash for transaction on recover"),
       with(tx->tx_id, "%lu"));
+  *matches = memcmp(hash, tx->hash_blake2b, size) == 0;
+  return success();
+}
 
-  if (memcmp(hash, tx->hash_blake2b, size) != 0) {
-    *txn_p = 0;  // not a match on the hash, failed
-    return success();
+// a null buffer only checks the record, without decompressing it
+static result_t wal_validate_transaction(db_t *db,
+    reusable_buffer_t *buffer, void *start, void *end,
+    wal_txn_t **txn_p) {
+  *txn_p = 0;
+  bool matches;
+  ensure(wal_hash_matches(start, end, &matches));
+  if (!matches) {
+    return success();  // not a match on the hash, failed
   }
   // we got a valid hash, can go forward with this
-  ensure(wal_decompress_transaction(buffer, tx, txn_p));
+  ensure(wal_decompress_transaction(db, buffer, start, txn_p));
   return success();
 }
 // end::wal_validate_transaction[]
 
+// tag::wal_recovery_pool[]
+#define WAL_RECOVERY_BATCH 64
+#define WAL_RECOVERY_MAX_WORKERS 8
+
+typedef struct wal_recovery_record {
+  wal_txn_t *raw;
+  wal_txn_t *tx;  // validated and decompressed, null if invalid
+  reusable_buffer_t buffer;
+  bool done;
+  bool needs_dictionary;
+  uint8_t _padding[6];
+} wal_recovery_record_t;
+
+typedef struct wal_recovery_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  void *end;  // of the segment the batch came from
+  db_options_t *options;
+  struct ZSTD_DDict_s *ddict;  // read only while the batch runs
+  uint64_t ddict_page;
+  size_t count;
+  size_t next_to_validate;
+  size_t next_to_apply;
+  size_t in_flight;
+  size_t number_of_workers;
+  pthread_t workers[WAL_RECOVERY_MAX_WORKERS];
+  wal_recovery_record_t records[WAL_RECOVERY_BATCH];
+  bool stop;
+  uint8_t _padding[7];
+} wal_recovery_pool_t;
+
+// <1>
+static result_t wal_validate_record_with(db_options_t *options,
+    struct ZSTD_DCtx_s *dctx, struct ZSTD_DDict_s *ddict,
+    uint64_t ddict_page, void *end, wal_recovery_record_t *r) {
+  bool matches;
+  ensure(wal_hash_matches(r->raw, end, &matches));
+  if (!matches) return success();
+  if (r->raw->flags == wal_txn_flags_none) {
+    r->tx = r->raw;
+    return success();
+  }
+  if (r->raw->flags & wal_txn_flags_sealed) {
+    ensure(
+        wal_unseal_with(options, dctx, &r->buffer, r->raw, &r->tx));
+    return success();
+  }
+  void *src        = (void *)r->raw + sizeof(wal_txn_t);
+  size_t src_size  = r->raw->tx_size - sizeof(wal_txn_t);
+  unsigned dict_id = ZSTD_getDictID_fromFrame(src, src_size);
+  if (dict_id && dict_id != ddict_page) {
+    // the dictionary may be in pages we didn't apply yet
+    r->needs_dictionary = true;
+    return success();
+  }
+  ensure(wal_decompress_with(
+      dctx, dict_id ? ddict : 0, &r->buffer, r->raw, &r->tx));
+  return success();
+}
+
+static result_t wal_recovery_validate_record(
+    wal_recovery_pool_t *pool, struct ZSTD_DCtx_s *dctx,
+    wal_recovery_record_t *r) {
+  ensure(wal_validate_record_with(pool->options, dctx, pool->ddict,
+      pool->ddict_page, pool->end, r));
+  return success();
+}
+
+static void *wal_recovery_worker(void *arg) {
+  wal_recovery_pool_t *pool = arg;
+  ZSTD_DCtx *dctx           = ZSTD_createDCtx();
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stop) {
+    if (pool->next_to_validate == pool->count) {
+      pthread_cond_wait(&pool->work, &pool->lock);
+      continue;
+    }
+    wal_recovery_record_t *r =
+        &pool->records[pool->next_to_validate++];
+    pool->in_flight++;
+    pthread_mutex_unlock(&pool->lock);
+    if (!dctx ||
+        flopped(wal_recovery_validate_record(pool, dctx, r))) {
+      errors_clear();  // treated as the end of the valid records
+      r->tx               = 0;
+      r->needs_dictionary = false;
+    }
+    pthread_mutex_lock(&pool->lock);
+    r->done = true;
+    pool->in_flight--;
+    pthread_cond_broadcast(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  ZSTD_freeDCtx(dctx);
+  return 0;
+}
+
+static void wal_recovery_pool_stop(wal_recovery_pool_t *pool) {
+  if (!pool) return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->number_of_workers; i++)
+    pthread_join(pool->workers[i], 0);
+  for (size_t i = 0; i < WAL_RECOVERY_BATCH; i++)
+    free(pool->records[i].buffer.address);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+  free(pool);
+}
+
+static void defer_wal_recovery_pool_stop(cancel_defer_t *cd) {
+  wal_recovery_pool_stop(*(wal_recovery_pool_t **)cd->target);
+}
+
+static result_t wal_recovery_pool_start(
+    db_state_t *db, wal_recovery_pool_t **pool_p) {
+  wal_recovery_pool_t *pool;
+  ensure(mem_calloc((void *)&pool, sizeof(wal_recovery_pool_t)));
+  pthread_mutex_init(&pool->lock, 0);
+  pthread_cond_init(&pool->work, 0);
+  pthread_cond_init(&pool->done, 0);
+  *pool_p       = pool;  // the caller stops the pool, even on failure
+  pool->options = &db->options;
+
+  size_t workers = db->options.wal_recovery_workers;
+  if (!workers) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers   = cpus > 0 ? (size_t)cpus : 1;
+  }
+  workers = MIN(workers, WAL_RECOVERY_MAX_WORKERS);
+  for (size_t i = 0; i < workers; i++) {
+    int rc = pthread_create(
+        &pool->workers[i], 0, wal_recovery_worker, pool);
+    if (rc) {
+      failed(rc, msg("Unable to start WAL recovery worker"),
+          with(i, "%zu"));
+    }
+    pool->number_of_workers++;
+  }
+  db->wal_state.recovery.number_of_workers = workers;
+  return success();
+}
+
+// <2>
+static void wal_recovery_pool_quiesce(wal_recovery_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->count = pool->next_to_validate;  // hand out no more records
+  while (pool->in_flight) pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static result_t wal_recovery_fill_batch(
+    wal_recovery_operation_t *state) {
+  if (!state->pool) {
+    ensure(wal_recovery_pool_start(state->db->state, &state->pool));
+  }
+  wal_recovery_pool_t *pool = state->pool;
+  wal_recovery_pool_quiesce(pool);
+  // candidates only need plausible headers, the hash decides
+  size_t count  = 0;
+  uint64_t prev = state->last_recovered_tx_id;
+  void *cur     = state->start;
+  while (count < WAL_RECOVERY_BATCH &&
+         cur + sizeof(wal_txn_t) <= state->end) {
+    wal_txn_t *tx = cur;
+    if (!tx->tx_id || tx->tx_id <= prev ||
+        !tx->page_aligned_tx_size ||
+        tx->page_aligned_tx_size > (uint64_t)(state->end - cur))
+      break;
+    wal_recovery_record_t *r = &pool->records[count++];
+    r->raw                   = tx;
+    r->tx                    = 0;
+    r->done                  = false;
+    r->needs_dictionary      = false;
+    prev                     = tx->tx_id;
+    cur += tx->page_aligned_tx_size;
+  }
+  wal_compression_t *c = &state->db->state->wal_state.compression;
+  pthread_mutex_lock(&pool->lock);
+  pool->end              = state->end;
+  pool->ddict            = c->ddict;
+  pool->ddict_page       = c->ddict_page;
+  pool->count            = count;
+  pool->next_to_validate = 0;
+  pool->next_to_apply    = 0;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  return success();
+}
+
+// <3>
+static result_t wal_recovery_flush_pages(
+    wal_recovery_operation_t *state) {
+  pages_map_t *pages = state->pages;
+  if (!pages->count) return success();
+  page_t *sorted;
+  ensure(mem_alloc((void *)&sorted, pages->count * sizeof(page_t)));
+  defer(free, sorted);
+  size_t count      = 0;
+  size_t iter_state = 0;
+  page_t *current;
+  while (pagesmap_get_next(pages, &iter_state, &current)) {
+    memcpy(&sorted[count++], current, sizeof(page_t));
+  }
+  ensure(pages_write_batch(state->db->state, sorted, count));
+  state->db->state->wal_state.recovery.number_of_pages_written +=
+      count;
+  for (size_t i = 0; i < count; i++) free(sorted[i].address);
+  size_t buckets = pages->number_of_buckets;
+  pagesmap_free(pages);
+  state->pages = 0;
+  ensure(pagesmap_new(buckets, &state->pages));
+  return success();
+}
+
+static result_t wal_recovery_next_record(
+    wal_recovery_operation_t *state, wal_txn_t **txp) {
+  *txp                      = 0;
+  wal_recovery_pool_t *pool = state->pool;
+  if (!pool || pool->next_to_apply == pool->count ||
+      pool->records[pool->next_to_apply].raw != state->start) {
+    ensure(wal_recovery_fill_batch(state));
+    pool = state->pool;
+  }
+  if (!pool->count) return success();
+  wal_recovery_record_t *r = &pool->records[pool->next_to_apply++];
+  pthread_mutex_lock(&pool->lock);
+  while (!r->done) pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+  if (r->needs_dictionary) {
+    // the workers may still use the old dictionary
+    wal_recovery_pool_quiesce(pool);
+    ensure(wal_recovery_flush_pages(state));
+    ensure(wal_decompress_transaction(
+        state->db, &r->buffer, r->raw, &r->tx));
+  }
+  *txp = r->tx;
+  return success();
+}
+// end::wal_recovery_pool[]
+
 // tag::wal_next_valid_transaction[]
 static result_t wal_next_valid_transaction(
     struct wal_recovery_operation *state, wal_txn_t **txp) {
   if (state->start >= state->end ||
-      !wal_validate_transaction(
-          &state->tmp_buffer, state->start, state->end, txp) ||
-      !*txp || state->last_recovered_tx_id >= (*txp)->tx_id) {
+      !wal_recovery_next_record(state, txp) || !*txp ||
+      state->last_recovered_tx_id >= (*txp)->tx_id) {
     *txp = 0;
     // <1>
     void *end_of_valid_tx = state->start;
     ensure(wal_validate_after_end_of_transactions(state));
     // <2>
-    if (state->current_recovery_file_index) {
-      *txp = 0;
-      if (state->files[1]) {
-        state->files[1]->last_write_pos = (uint64_t)(
-            end_of_valid_tx - state->files[1]->span.address);
-      }
+    if (state->current_recovery_file_index >= state->number_of_files)
       return success();
-    }
+    wal_file_state_t *file =
+        state->files[state->current_recovery_file_index];
+    file->last_write_pos =
+        (uint64_t)(end_of_valid_tx - file->span.address);
     // <3>
-    state->files[0]->last_write_pos =
-        (uint64_t)(end_of_valid_tx - state->files[0]->span.address);
-    state->current_recovery_file_index++;
-    state->start = state->files[1]->span.address;
-    state->end   = state->start + state->files[1]->span.size;
+    if (++state->current_recovery_file_index ==
+        state->number_of_files)
+      return success();
+    file         = state->files[state->current_recovery_file_index];
+    state->start = file->span.address;
+    state->end   = state->start + file->span.size;
     // <4>
     return wal_next_valid_transaction(state, txp);
   } else {
     state->last_recovered_tx_id = (*txp)->tx_id;
+    wal_file_state_t *file =
+        state->files[state->current_recovery_file_index];
+    if (state->start == file->span.address)
+      file->first_tx_id = (*txp)->tx_id;
+    file->last_tx_id = (*txp)->tx_id;
     state->start = state->start + (*txp)->page_aligned_tx_size;
   }
   return success();
@@ -496,35 +1717,207 @@ static result_t wal_next_valid_transaction(
 // end::wal_next_valid_transaction[]
 
 // tag::wal_recover_page[]
+static result_t wal_recovered_page(db_t *db, pages_map_t **pages,
+    uint64_t page_num, bool load, void **address) {
+  page_t p = {.page_num = page_num};
+  if (pagesmap_lookup(*pages, &p)) {
+    *address = p.address;
+    return success();
+  }
+  p.number_of_pages = 1;
+  ensure(mem_alloc_page_aligned(&p.address, PAGE_SIZE));
+  size_t done = 0;
+  try_defer(free, p.address, done);
+  // only diffs need the current content of the page, the base
+  // image comes from the map, without going through a transaction
+  span_t *map = &db->state->map;
+  if (load && map->address &&
+      (page_num + 1) * PAGE_SIZE <= map->size) {
+    memcpy(p.address, map->address + page_num * PAGE_SIZE, PAGE_SIZE);
+  } else if (load) {
+    ensure(pal_read_file(db->state->handle, page_num * PAGE_SIZE,
+        p.address, PAGE_SIZE));
+  }
+  ensure(pagesmap_put_new(pages, &p));
+  done     = 1;
+  *address = p.address;
+  return success();
+}
+
 static result_t wal_recover_page(db_t *db, pages_map_t **pages,
     wal_txn_page_t *page, void *end, const void *src, void **input) {
-  size_t size  = page->number_of_pages * PAGE_SIZE;
+  size_t size = page->number_of_pages * PAGE_SIZE;
+  bool diff   = page->flags == wal_txn_page_flags_diff;
+  void *image;
+  if (page->number_of_pages == 1) {  // common case, in place
+    ensure(
+        wal_recovered_page(db, pages, page->page_num, diff, &image));
+    if (diff) {
+      page_t final = {.address = image, .number_of_pages = 1};
+      *input       = wal_apply_diff(*input, end, &final);
+    } else {
+      memcpy(image, src + page->offset, size);
+      *input += size;
+    }
+    return success();
+  }
+  // the store keeps single pages, values are assembled for the diff
   page_t final = {.page_num = page->page_num,
       .number_of_pages      = page->number_of_pages};
-  ensure(mem_alloc_page_aligned((void *)&final.address, size));
-  size_t done = 0;
-  try_defer(free, final.address, done);
-  if (page->flags == wal_txn_page_flags_diff) {
-    txn_t tx;
-    ensure(txn_create(db, TX_READ, &tx));
-    defer(txn_close, tx);
-    page_t before = {.page_num = page->page_num,
-        .number_of_pages       = page->number_of_pages};
-    ensure(pages_get(&tx, &before));
-    memcpy(final.address, before.address,
-        page->number_of_pages * PAGE_SIZE);
+  defer(free, final.address);
+  const void *data = src + page->offset;
+  if (diff) {
+    ensure(mem_alloc_page_aligned((void *)&final.address, size));
+    for (size_t i = 0; i < page->number_of_pages; i++) {
+      ensure(wal_recovered_page(
+          db, pages, page->page_num + i, true, &image));
+      memcpy(final.address + i * PAGE_SIZE, image, PAGE_SIZE);
+    }
     *input = wal_apply_diff(*input, end, &final);
+    data   = final.address;
   } else {
-    memcpy(final.address, src + page->offset, size);
     *input += size;
   }
+  for (size_t i = 0; i < page->number_of_pages; i++) {
+    ensure(wal_recovered_page(
+        db, pages, page->page_num + i, false, &image));
+    memcpy(image, data + i * PAGE_SIZE, PAGE_SIZE);
+  }
+  return success();
+}
+// end::wal_recover_page[]
 
-  ensure(pagesmap_put_new(pages, &final));
-  done = 1;
+// tag::wal_validate_recovered_pages[]
+// bounds the working set of a single thread
+#define WAL_VALIDATION_CHUNK 1024
+// no point in starting threads for a handful of pages
+#define WAL_VALIDATION_MIN_PARALLEL 256
+
+typedef struct wal_validation_range {
+  txn_t *rtx;  // shared, only opened and closed by the caller
+  uint64_t *page_nums;
+  size_t count;
+  pthread_t thread;
+  uint64_t failed_page;
+  bool failed;
+  uint8_t _padding[7];
+} wal_validation_range_t;
+
+static int wal_compare_page_num(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
 
+static size_t wal_sort_unique(uint64_t *page_nums, size_t count) {
+  if (!count) return 0;
+  qsort(page_nums, count, sizeof(uint64_t), wal_compare_page_num);
+  size_t unique = 1;
+  for (size_t i = 1; i < count; i++) {
+    if (page_nums[i] != page_nums[unique - 1])
+      page_nums[unique++] = page_nums[i];
+  }
+  return unique;
+}
+
+// <1>
+static result_t wal_track_recovered(
+    wal_recovery_operation_t *state, uint64_t page_num) {
+  if (state->number_of_recovered == state->recovered_capacity) {
+    state->number_of_recovered = wal_sort_unique(
+        state->recovered, state->number_of_recovered);
+  }
+  if (state->number_of_recovered * 2 >= state->recovered_capacity) {
+    size_t capacity = MAX(1024, state->recovered_capacity * 2);
+    ensure(mem_realloc(
+        (void *)&state->recovered, capacity * sizeof(uint64_t)));
+    state->recovered_capacity = capacity;
+  }
+  state->recovered[state->number_of_recovered++] = page_num;
   return success();
 }
-// end::wal_recover_page[]
+
+static void defer_wal_clear_working_set(cancel_defer_t *cd) {
+  txn_clear_working_set(cd->target);
+}
+
+// the threads share the transaction state, which they only read,
+// each has its own working set, if the database needs one
+static result_t wal_validate_pages_chunk(txn_t *shared,
+    uint64_t *page_nums, size_t count, uint64_t *failed) {
+  txn_t rtx = {.state = shared->state};
+  if (shared->working_set)
+    ensure(pagesmap_new(8, &rtx.working_set));
+  defer(wal_clear_working_set, rtx);
+  for (size_t i = 0; i < count; i++) {
+    *failed  = page_nums[i];
+    page_t p = {.page_num = page_nums[i]};
+    ensure(txn_get_page(&rtx, &p));
+  }
+  return success();
+}
+
+static void *wal_validate_pages_range(void *arg) {
+  wal_validation_range_t *r = arg;
+  for (size_t i = 0; i < r->count && !r->failed;
+       i += WAL_VALIDATION_CHUNK) {
+    if (flopped(wal_validate_pages_chunk(r->rtx, r->page_nums + i,
+            MIN(WAL_VALIDATION_CHUNK, r->count - i),
+            &r->failed_page))) {
+      errors_clear();  // reported by the caller
+      r->failed = true;
+    }
+  }
+  return 0;
+}
+
+// <2>
+static result_t wal_validate_recovered_pages(
+    wal_recovery_operation_t *state) {
+  db_t *db        = state->db;
+  uint64_t *pages = state->recovered;
+  size_t count = wal_sort_unique(pages, state->number_of_recovered);
+  size_t threads = db->state->wal_state.recovery.number_of_workers;
+  if (count < WAL_VALIDATION_MIN_PARALLEL) threads = 1;
+  threads = MAX(1, MIN(threads, WAL_RECOVERY_MAX_WORKERS));
+  // no thread may create or close transactions, they all share this
+  txn_t rtx;
+  ensure(txn_create(db, TX_READ, &rtx));
+  defer(txn_close, rtx);
+
+  wal_validation_range_t ranges[WAL_RECOVERY_MAX_WORKERS];
+  memset(ranges, 0, sizeof(ranges));
+  size_t start = 0;
+  for (size_t i = 0; i < threads && start < count; i++) {
+    size_t end = i + 1 == threads ? count : start + count / threads;
+    // <3>
+    // a thread owns whole metadata groups, so no two threads touch
+    // the same metadata page or word of the first read bitmap
+    while (end < count && pages[end] / PAGES_IN_METADATA ==
+                              pages[end - 1] / PAGES_IN_METADATA)
+      end++;
+    ranges[i] = (wal_validation_range_t){.rtx = &rtx,
+        .page_nums = pages + start, .count = end - start};
+    start = end;
+    if (i && pthread_create(&ranges[i].thread, 0,
+                 wal_validate_pages_range, &ranges[i])) {
+      ranges[i].thread = 0;
+      wal_validate_pages_range(&ranges[i]);  // run inline
+    }
+  }
+  wal_validate_pages_range(&ranges[0]);  // on this thread
+  for (size_t i = 0; i < threads; i++) {
+    if (ranges[i].thread) pthread_join(ranges[i].thread, 0);
+  }
+  for (size_t i = 0; i < threads; i++) {
+    if (ranges[i].failed) {
+      failed(ENODATA, msg("Unable to validate recovered page"),
+          with(ranges[i].failed_page, "%lu"));
+    }
+  }
+  return success();
+}
+// end::wal_validate_recovered_pages[]
 
 // tag::wal_recover_tx[]
 static result_t free_hash_table_and_contents(pages_map_t **pages) {
@@ -533,7 +1926,7 @@ static result_t free_hash_table_and_contents(pages_map_t **pages) {
   while (pagesmap_get_next(*pages, &iter_state, &p)) {
     free(p->address);
   }
-  free(*pages);
+  pagesmap_free(*pages);
   return success();
 }
 enable_defer(free_hash_table_and_contents);
@@ -546,6 +1939,13 @@ static result_t wal_ensure_data_file_size(
   }
   ensure(pal_set_file_size(
       db->state->handle, min_pages * PAGE_SIZE, UINT64_MAX));
+  if (db_can_extend_map_in_place(
+          db->state, &db->state->map, db->state->handle->size)) {
+    ensure(db_extend_map_in_place(
+        db->state, &db->state->map, db->state->handle->size));
+    db->state->default_read_tx->map = db->state->map;
+    return success();
+  }
   ensure(pal_unmap(&db->state->map));
   db->state->map.size = db->state->handle->size;
   if (!(db->state->options.flags & db_flags_avoid_mmap_io)) {
@@ -557,15 +1957,11 @@ static result_t wal_ensure_data_file_size(
 // end::wal_ensure_data_file_size[]
 
 static result_t wal_recover_tx(
-    db_t *db, wal_txn_t *tx, pages_map_t **recovered_pages) {
+    wal_recovery_operation_t *state, wal_txn_t *tx) {
+  db_t *db    = state->db;
   void *input = (void *)tx + sizeof(wal_txn_t) +
                 sizeof(wal_txn_page_t) * tx->number_of_modified_pages;
-  pages_map_t *pages;
-  ensure(pagesmap_new(
-      next_power_of_two(tx->number_of_modified_pages +
-                        tx->number_of_modified_pages / 2),
-      &pages));
-  defer(free_hash_table_and_contents, pages);
+  ensure(wal_encrypt_sealed_pages(&db->state->options, tx));
   for (size_t i = 0; i < tx->number_of_modified_pages; i++) {
     ensure(wal_ensure_data_file_size(
         db, tx->pages[i].page_num + tx->pages[i].number_of_pages));
@@ -573,18 +1969,17 @@ static result_t wal_recover_tx(
     size_t end_offset = i + 1 < tx->number_of_modified_pages
                             ? tx->pages[i + 1].offset
                             : tx->tx_size;
-    ensure(wal_recover_page(db, &pages, tx->pages + i,
+    ensure(wal_recover_page(db, &state->pages, tx->pages + i,
         ((void *)tx) + end_offset, tx, &input));
+    ensure(wal_track_recovered(state, tx->pages[i].page_num));
   }
-  size_t iter_state = 0;
-  page_t *p;
-  while (pagesmap_get_next(pages, &iter_state, &p)) {
-    page_t existing = {.page_num = p->page_num};
-    if (!pagesmap_lookup(*recovered_pages, &existing)) {
-      ensure(pagesmap_put_new(recovered_pages, p));
-    }
-    ensure(pal_write_file(db->state->handle, p->page_num * PAGE_SIZE,
-        p->address, p->number_of_pages * PAGE_SIZE));
+  wal_recovery_stats_t *stats = &db->state->wal_state.recovery;
+  stats->number_of_records++;
+  stats->bytes_replayed += tx->page_aligned_tx_size;
+  // <1>
+  if (state->pages->count * PAGE_SIZE >=
+      db->state->options.checkpoint_dirty_limit) {
+    ensure(wal_recovery_flush_pages(state));
   }
   return success();
 }
@@ -630,7 +2025,7 @@ result_t wal_apply_wal_record(db_t *db, reusable_buffer_t *tmp_buffer,
 
   // <2>
   wal_txn_t *wal_tx;
-  ensure(wal_validate_transaction(tmp_buffer, wal_record->address,
+  ensure(wal_validate_transaction(db, tmp_buffer, wal_record->address,
       wal_record->address + wal_record->size, &wal_tx));
   // <3>
   ensure(wal_tx, msg("Unable to validate WAL transaction"));
@@ -647,16 +2042,179 @@ result_t wal_apply_wal_record(db_t *db, reusable_buffer_t *tmp_buffer,
         wal_tx->total_number_of_pages_in_database * PAGE_SIZE));
   }
   // <5>
+  ensure(wal_encrypt_sealed_pages(&db->state->options, wal_tx));
   void *input =
       (void *)wal_tx + sizeof(wal_txn_t) +
       sizeof(wal_txn_page_t) * wal_tx->number_of_modified_pages;
-  ensure(wal_apply_log_write_pages(
-      wal_tx, &write_tx, input, wal_record->address));
+  ensure(wal_apply_log_write_pages(wal_tx, &write_tx, input, wal_tx));
   ensure(txn_commit(&write_tx));
   return success();
 }
 // end::wal_apply_wal_record[]
 
+// tag::wal_apply_wal_records[]
+typedef struct wal_shipped_batch {
+  uint64_t first_tx_id;
+  size_t count;
+  span_t *records;  // aligned to the record size, for the local WAL
+  wal_recovery_record_t *validated;
+  db_options_t *options;
+  struct ZSTD_DDict_s *ddict;  // read only while validating
+  uint64_t ddict_page;
+  size_t number_of_workers;
+} wal_shipped_batch_t;
+
+typedef struct wal_shipped_worker {
+  wal_shipped_batch_t *batch;
+  size_t first;
+  pthread_t thread;
+} wal_shipped_worker_t;
+
+static result_t wal_shipped_batch_free(wal_shipped_batch_t *batch) {
+  for (size_t i = 0; batch->validated && i < batch->count; i++)
+    free(batch->validated[i].buffer.address);
+  free(batch->validated);
+  free(batch->records);
+  return success();
+}
+enable_defer(wal_shipped_batch_free);
+
+static void *wal_shipped_worker(void *arg) {
+  wal_shipped_worker_t *w = arg;
+  wal_shipped_batch_t *b  = w->batch;
+  ZSTD_DCtx *dctx         = ZSTD_createDCtx();
+  for (size_t i = w->first; i < b->count; i += b->number_of_workers) {
+    wal_recovery_record_t *r = &b->validated[i];
+    void *end = b->records[i].address + b->records[i].size;
+    if (!dctx || flopped(wal_validate_record_with(b->options, dctx,
+                     b->ddict, b->ddict_page, end, r))) {
+      errors_clear();  // reported when the record is applied
+      r->tx               = 0;
+      r->needs_dictionary = false;
+    }
+  }
+  ZSTD_freeDCtx(dctx);
+  return 0;
+}
+
+// <1>
+static result_t wal_shipped_validate(
+    db_t *db, wal_shipped_batch_t *batch) {
+  size_t workers = db->state->options.wal_recovery_workers;
+  if (!workers) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers   = cpus > 0 ? (size_t)cpus : 1;
+  }
+  workers = MAX(1, MIN(MIN(workers, WAL_RECOVERY_MAX_WORKERS),
+                       batch->count));
+  wal_shipped_worker_t threads[WAL_RECOVERY_MAX_WORKERS];
+  memset(threads, 0, sizeof(threads));
+
+  // the dictionary can't be swapped while the workers use it
+  wal_compression_t *c = &db->state->wal_state.compression;
+  pthread_mutex_lock(&c->lock);
+  batch->options           = &db->state->options;
+  batch->ddict             = c->ddict;
+  batch->ddict_page        = c->ddict_page;
+  batch->number_of_workers = workers;
+  for (size_t i = 0; i < workers; i++) {
+    threads[i] = (wal_shipped_worker_t){.batch = batch, .first = i};
+    if (!i || pthread_create(&threads[i].thread, 0,
+                  wal_shipped_worker, &threads[i])) {
+      threads[i].thread = 0;
+      wal_shipped_worker(&threads[i]);  // run inline
+    }
+  }
+  for (size_t i = 0; i < workers; i++) {
+    if (threads[i].thread) pthread_join(threads[i].thread, 0);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return success();
+}
+
+// <2>
+static result_t wal_shipped_apply(
+    db_t *db, wal_shipped_batch_t *batch, size_t *index) {
+  txn_t write_tx;
+  ensure(txn_create(db, TX_WRITE | TX_APPLY_LOG, &write_tx));
+  defer(txn_close, write_tx);
+  txn_state_t *state           = write_tx.state;
+  reusable_buffer_t tmp_buffer = {0};
+  defer(free, tmp_buffer.address);
+
+  size_t first = *index;
+  for (; *index < batch->count; (*index)++) {
+    wal_recovery_record_t *r = &batch->validated[*index];
+    span_t *record           = &batch->records[*index];
+    if (r->needs_dictionary) {
+      // <3>
+      if (*index > first) break;
+      void *end = record->address + record->size;
+      ensure(wal_validate_transaction(
+          db, &tmp_buffer, record->address, end, &r->tx));
+    }
+    uint64_t tx_id = batch->first_tx_id + *index;
+    ensure(r->tx, msg("Unable to validate WAL transaction"),
+        with(tx_id, "%lu"));
+    uint64_t expected = state->tx_id + (*index - first);
+    ensure(r->tx->tx_id == expected && tx_id == r->tx->tx_id,
+        msg("Cannot apply a transaction out of order"),
+        with(tx_id, "%lu"), with(r->tx->tx_id, "%lu"),
+        with(expected, "%lu"));
+
+    if (r->tx->total_number_of_pages_in_database >
+        state->number_of_pages) {
+      ensure(db_increase_file_size(&write_tx,
+          r->tx->total_number_of_pages_in_database * PAGE_SIZE));
+    }
+    ensure(wal_encrypt_sealed_pages(&db->state->options, r->tx));
+    void *input =
+        (void *)r->tx + sizeof(wal_txn_t) +
+        sizeof(wal_txn_page_t) * r->tx->number_of_modified_pages;
+    ensure(wal_apply_log_write_pages(r->tx, &write_tx, input, r->tx));
+  }
+  // <4>
+  // the write tx takes the id of the last record it applied
+  state->tx_id               = batch->first_tx_id + *index - 1;
+  db->state->active_write_tx = state->tx_id;
+  state->shipped_wal_records = batch->records + first;
+  state->number_of_shipped_wal_records = *index - first;
+  ensure(txn_commit(&write_tx));
+  return success();
+}
+
+result_t wal_apply_wal_records(db_t *db, uint64_t first_tx_id,
+    span_t *wal_records, size_t count) {
+  ensure(db->state->options.flags & db_flags_log_shipping_target,
+      msg("db wasn't set with db_flags_apply_log flag"));
+  wal_shipped_batch_t batch = {
+      .first_tx_id = first_tx_id, .count = count};
+  defer(wal_shipped_batch_free, batch);
+  ensure(mem_calloc((void *)&batch.records, count * sizeof(span_t)));
+  ensure(mem_calloc((void *)&batch.validated,
+      count * sizeof(wal_recovery_record_t)));
+  for (size_t i = 0; i < count; i++) {
+    wal_txn_t *raw = wal_records[i].address;
+    ensure(((intptr_t)raw & 4095) == 0,
+        msg("wal_record must be aligned on 4KB boundary, but wasn't"),
+        with(raw, "%p"));
+    ensure(wal_records[i].size >= sizeof(wal_txn_t) &&
+               raw->page_aligned_tx_size <= wal_records[i].size,
+        msg("wal_record is smaller than the transaction it holds"),
+        with(first_tx_id + i, "%lu"));
+    batch.records[i].address = raw;
+    batch.records[i].size    = raw->page_aligned_tx_size;
+    batch.validated[i].raw   = raw;
+  }
+  ensure(wal_shipped_validate(db, &batch));
+  size_t index = 0;
+  while (index < count) {
+    ensure(wal_shipped_apply(db, &batch, &index));
+  }
+  return success();
+}
+// end::wal_apply_wal_records[]
+
 // tag::wal_complete_recovery[]
 static result_t wal_complete_recovery(
     wal_recovery_operation_t *state) {
@@ -696,22 +2254,34 @@ static result_t wal_complete_recovery(
 // end::wal_complete_recovery[]
 
 // tag::wal_recover[]
+
 static result_t wal_recover(db_t *db, wal_state_t *wal) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
   wal_recovery_operation_t recovery_state;
   wal_init_recover_state(db, wal, &recovery_state);
-  pages_map_t *recovered_pages;
-  ensure(pagesmap_new(16, &recovered_pages));
-  defer(free, recovered_pages);
-  defer(free, recovery_state.tmp_buffer.address);
+  ensure(db_load_checksum_algorithm(db));
+  ensure(pagesmap_new(1024, &recovery_state.pages));
+  defer(free_hash_table_and_contents, recovery_state.pages);
+  defer(wal_recovery_pool_stop, recovery_state.pool);
+  defer(free, recovery_state.recovered);
 
   while (true) {
     wal_txn_t *tx;
     ensure(wal_next_valid_transaction(&recovery_state, &tx));
     if (!tx) break;
-    ensure(wal_recover_tx(db, tx, &recovered_pages));
+    ensure(wal_recover_tx(&recovery_state, tx));
   }
+  // <1>
+  ensure(wal_recovery_flush_pages(&recovery_state));
+  // the file header may have just been recovered
+  ensure(db_load_checksum_algorithm(db));
   ensure(wal_complete_recovery(&recovery_state));
-  ensure(wal_validate_recovered_pages(db, recovered_pages));
+  ensure(wal_validate_recovered_pages(&recovery_state));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  wal->recovery.elapsed_ns =
+      (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000UL +
+      (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
   return success();
 }
 // end::wal_recover[]
@@ -733,6 +2303,7 @@ static result_t wal_open_file(struct wal_file_state *file_state,
   ensure(wal_get_wal_filename(
       db->state->handle->filename, wal_code, &wal_file_name));
   defer(free, wal_file_name);
+  flags |= db_file_creation_flags(&db->state->options);
   ensure(pal_create_file(wal_file_name, &file_state->handle, flags));
   return success();
 }
@@ -746,25 +2317,47 @@ static result_t wal_open_single_file(
   ensure(pal_mmap(file_state->handle, 0, &file_state->span));
   return success();
 }
+static result_t wal_close_recovery_files(wal_state_t *wal) {
+  bool failure = false;
+  for (size_t i = 0; i < wal->number_of_files; i++) {
+    failure |= flopped(pal_unmap(&wal->files[i].span));
+    failure |= flopped(pal_close_file(wal->files[i].handle));
+    wal->files[i].handle = 0;
+  }
+  ensure(!failure, msg("Unable to close the WAL after recovery"));
+  return success();
+}
+enable_defer(wal_close_recovery_files);
 // end::wal_open_single_file[]
 
 // tag::wal_open_and_recover[]
 result_t wal_open_and_recover(db_t *db) {
   memset(&db->state->wal_state, 0, sizeof(wal_state_t));
   wal_state_t *wal = &db->state->wal_state;
+  pthread_mutex_init(&wal->group_commit.lock, 0);
+  pthread_cond_init(&wal->group_commit.written, 0);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wal->group_commit.flush_needed, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&wal->compression.lock, 0);
+  pthread_mutex_init(&wal->buffer_pool.lock, 0);
+  wal->number_of_files = db->state->options.wal_segments;
   {
-    ensure(wal_open_single_file(&wal->files[0], db, 'a'));
-    defer(pal_unmap, wal->files[0].span);
-    defer(pal_close_file, wal->files[0].handle);
-    ensure(wal_open_single_file(&wal->files[1], db, 'b'));
-    defer(pal_unmap, wal->files[1].span);
-    defer(pal_close_file, wal->files[1].handle);
+    defer(wal_close_recovery_files, db->state->wal_state);
+    for (size_t i = 0; i < wal->number_of_files; i++) {
+      ensure(
+          wal_open_single_file(&wal->files[i], db, (char)('a' + i)));
+    }
     ensure(wal_recover(db, wal));
   }
-  ensure(wal_open_file(
-      &wal->files[0], db, 'a', pal_file_creation_flags_durable));
-  ensure(wal_open_file(
-      &wal->files[1], db, 'b', pal_file_creation_flags_durable));
+  ensure(wal_load_current_dictionary(db));
+  for (size_t i = 0; i < wal->number_of_files; i++) {
+    ensure(wal_open_file(&wal->files[i], db, (char)('a' + i),
+        pal_file_creation_flags_durable));
+  }
+  ensure(wal_start_async_flusher(db->state));
   return success();
 }
 // end::wal_open_and_recover[]
@@ -772,9 +2365,16 @@ result_t wal_open_and_recover(db_t *db) {
 result_t wal_close(db_state_t *db) {
   if (!db) return success();
   // need to proceed even if there are failures
-  bool failure = false;
-  for (size_t i = 0; i < 2; i++) {
-    failure = !pal_unmap(&db->wal_state.files[i].span);
+  wal_stop_async_flusher(db);
+  bool failure = flopped(wal_group_commit_drain(db));
+  wal_group_commit_free_batch(db, db->wal_state.group_commit.head);
+  pthread_mutex_destroy(&db->wal_state.group_commit.lock);
+  pthread_cond_destroy(&db->wal_state.group_commit.written);
+  pthread_cond_destroy(&db->wal_state.group_commit.flush_needed);
+  wal_compression_free(&db->wal_state.compression);
+  wal_buffer_pool_free(&db->wal_state.buffer_pool);
+  for (size_t i = 0; i < db->wal_state.number_of_files; i++) {
+    failure |= !pal_unmap(&db->wal_state.files[i].span);
     failure |= !pal_close_file(db->wal_state.files[i].handle);
   }
 
@@ -792,18 +2392,67 @@ result_t wal_close(db_state_t *db) {
 // tag::wal_will_checkpoint[]
 bool wal_will_checkpoint(db_state_t *db, uint64_t tx_id) {
   if (!db) return false;
-
-  size_t cur_file_index   = db->wal_state.current_append_file_index;
-  size_t other_file_index = (cur_file_index + 1) & 1;
-  bool cur_full = db->wal_state.files[cur_file_index].last_write_pos >
+  // a leader or a direct append may be moving last_write_pos
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  wal_acquire_writer(group);
+  wal_state_t *wal      = &db->wal_state;
+  size_t cur_file_index = wal->current_append_file_index;
+  bool cur_full         = wal->files[cur_file_index].last_write_pos >
                   db->options.wal_size / 2;
-  bool other_ready =
-      tx_id > db->wal_state.files[other_file_index].last_tx_id;
+  // ready if there is nothing else to recycle, or we can recycle
+  // at least one of the closed segments
+  bool has_closed = false;
+  bool ready      = false;
+  for (size_t i = 0; i < wal->number_of_files; i++) {
+    if (i == cur_file_index || !wal->files[i].last_write_pos)
+      continue;
+    has_closed = true;
+    ready |= tx_id > wal->files[i].last_tx_id;
+  }
+  wal_release_writer(group);
 
-  return cur_full && other_ready;
+  return cur_full && (ready || !has_closed);
 }
 // end::wal_will_checkpoint[]
 
+// tag::wal_archive_segment[]
+static result_t wal_archive_segment(
+    db_state_t *db, wal_file_state_t *file) {
+  if (!db->options.wal_archive_callback || !file->last_write_pos)
+    return success();
+  span_t segment = {.size = file->last_write_pos};
+  ensure(pal_mmap(file->handle, 0, &segment));
+  defer(pal_unmap, segment);
+  wal_txn_t *first = segment.address;
+  ensure(db->options.wal_archive_callback(
+             db->options.wal_archive_callback_state, first->tx_id,
+             file->last_tx_id, &segment),
+      msg("Unable to archive WAL segment"),
+      with(file->handle->filename, "%s"),
+      with(first->tx_id, "%lu"), with(file->last_tx_id, "%lu"));
+  return success();
+}
+
+result_t wal_archive_to_directory(void *directory,
+    uint64_t first_tx_id, uint64_t last_tx_id, span_t *segment) {
+  size_t len = strlen(directory) + 64;  // /{first}-{last}.wal
+  char *path;
+  ensure(mem_alloc((void *)&path, len));
+  defer(free, path);
+  // zero padded, so the names sort in the order of the records
+  snprintf(path, len, "%s/%020lu-%020lu.wal", (char *)directory,
+      first_tx_id, last_tx_id);
+  file_handle_t *handle;
+  ensure(
+      pal_create_file(path, &handle, pal_file_creation_flags_none));
+  defer(pal_close_file, handle);
+  ensure(pal_set_file_size(handle, segment->size, segment->size));
+  ensure(pal_write_file(handle, 0, segment->address, segment->size));
+  ensure(pal_fsync(handle));
+  return success();
+}
+// end::wal_archive_segment[]
+
 // tag::wal_reset_file[]
 static result_t wal_reset_file(
     db_state_t *db, wal_file_state_t *file) {
@@ -823,26 +2472,141 @@ static result_t wal_reset_file(
   file->last_write_pos = 0;
   return success();
 }
+
+static result_t wal_recycle_file(
+    db_state_t *db, wal_file_state_t *file) {
+  ensure(wal_archive_segment(db, file));
+  ensure(wal_reset_file(db, file));
+  return success();
+}
 // end::wal_reset_file[]
 
 // tag::wal_checkpoint[]
-result_t wal_checkpoint(db_state_t *db, uint64_t tx_id) {
-  size_t other_index =
-      (db->wal_state.current_append_file_index + 1) & 1;
-  wal_file_state_t *cur =
-      &db->wal_state.files[db->wal_state.current_append_file_index];
-
-  // avoid resetting if nothing is written here
-  if (db->wal_state.files[other_index].last_write_pos)
-    ensure(wal_reset_file(db, &db->wal_state.files[other_index]));
+static result_t wal_checkpoint_files(db_state_t *db, uint64_t tx_id) {
+  wal_state_t *wal      = &db->wal_state;
+  size_t cur_file_index = wal->current_append_file_index;
+  for (size_t i = 0; i < wal->number_of_files; i++) {
+    wal_file_state_t *file = &wal->files[i];
+    // avoid resetting if nothing is written here or still in use
+    if (i == cur_file_index || !file->last_write_pos ||
+        file->last_tx_id > tx_id)
+      continue;
+    ensure(wal_recycle_file(db, file));
+  }
 
+  wal_file_state_t *cur = &wal->files[cur_file_index];
   if (tx_id >= cur->last_tx_id) {
     // can reset the current WAL as well
-    ensure(wal_reset_file(db, cur));
+    ensure(wal_recycle_file(db, cur));
   } else {
-    // the current log is still in use, switch to the other one
-    db->wal_state.current_append_file_index = other_index;
+    // the current log is still in use, switch to the next one
+    size_t next = (cur_file_index + 1) % wal->number_of_files;
+    if (!wal->files[next].last_write_pos)
+      wal->current_append_file_index = next;
   }
   return success();
 }
+
+result_t wal_checkpoint(db_state_t *db, uint64_t tx_id) {
+  // queued records are newer than tx_id, they will go to
+  // whatever file is current once we are done here
+  wal_group_commit_t *group = &db->wal_state.group_commit;
+  wal_acquire_writer(group);
+  bool done = !flopped(wal_checkpoint_files(db, tx_id));
+  wal_release_writer(group);
+  ensure(done, msg("Unable to checkpoint the WAL"),
+      with(tx_id, "%lu"));
+  return success();
+}
 // end::wal_checkpoint[]
+
+// tag::wal_restore_archive[]
+typedef struct wal_archive_listing {
+  struct dirent **entries;
+  int count;
+  uint8_t _padding[4];
+} wal_archive_listing_t;
+
+static void defer_wal_archive_listing_free(cancel_defer_t *cd) {
+  wal_archive_listing_t *listing = cd->target;
+  for (int i = 0; i < listing->count; i++) free(listing->entries[i]);
+  free(listing->entries);
+}
+
+static int wal_is_archived_segment(const struct dirent *entry) {
+  size_t len = strlen(entry->d_name);
+  return len > 4 && !strcmp(entry->d_name + len - 4, ".wal");
+}
+
+static result_t wal_restore_segment(db_t *db, const char *path,
+    reusable_buffer_t *buffer, uint64_t target_tx_id) {
+  file_handle_t *handle;
+  ensure(
+      pal_create_file(path, &handle, pal_file_creation_flags_none));
+  defer(pal_close_file, handle);
+  if (!handle->size) return success();
+  span_t segment = {.size = handle->size};
+  ensure(pal_mmap(handle, 0, &segment));
+  defer(pal_unmap, segment);
+  void *end = segment.address + segment.size;
+  for (void *cur = segment.address; cur < end;) {
+    wal_txn_t *tx = cur;
+    if (!tx->page_aligned_tx_size ||
+        tx->page_aligned_tx_size > (uint64_t)(end - cur)) {
+      failed(ENODATA, msg("Corrupted record in archived segment"),
+          with(path, "%s"), with(cur - segment.address, "%ld"));
+    }
+    if (tx->tx_id > target_tx_id) break;
+    // the base copy may already contain older records
+    if (tx->tx_id > db->state->last_tx_id) {
+      span_t record = {
+          .address = cur, .size = tx->page_aligned_tx_size};
+      ensure(wal_apply_wal_record(db, buffer, tx->tx_id, &record),
+          msg("Unable to restore archived record"), with(path, "%s"));
+    }
+    cur += tx->page_aligned_tx_size;
+  }
+  return success();
+}
+
+result_t wal_restore_archive(const char *archive_directory,
+    const char *path, db_options_t *options, uint64_t target_tx_id) {
+  db_options_t restore_options = {0};
+  if (options) restore_options = *options;
+  restore_options.flags |= db_flags_log_shipping_target;
+  restore_options.wal_archive_callback = 0;
+  db_t db;
+  ensure(db_create(path, &restore_options, &db));
+  defer(db_close, db);
+
+  wal_archive_listing_t listing = {0};
+  listing.count = scandir(archive_directory, &listing.entries,
+      wal_is_archived_segment, alphasort);
+  if (listing.count == -1) {
+    failed(errno, msg("Unable to list the WAL archive"),
+        with(archive_directory, "%s"));
+  }
+  defer(wal_archive_listing_free, listing);
+
+  size_t len = strlen(archive_directory) + 256;  // + d_name
+  char *segment_path;
+  ensure(mem_alloc((void *)&segment_path, len));
+  defer(free, segment_path);
+  reusable_buffer_t buffer = {0};
+  defer(free, buffer.address);
+  for (int i = 0; i < listing.count; i++) {
+    if (db.state->last_tx_id >= target_tx_id) break;
+    snprintf(segment_path, len, "%s/%s", archive_directory,
+        listing.entries[i]->d_name);
+    ensure(wal_restore_segment(
+        &db, segment_path, &buffer, target_tx_id));
+  }
+  if (target_tx_id != UINT64_MAX &&
+      db.state->last_tx_id != target_tx_id) {
+    failed(ENODATA, msg("The archive does not reach the target tx"),
+        with(archive_directory, "%s"), with(target_tx_id, "%lu"),
+        with(db.state->last_tx_id, "%lu"));
+  }
+  return success();
+}
+// end::wal_restore_archive[]
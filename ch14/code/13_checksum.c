@@ -0,0 +1 @@
+../../ch13/code/checksum.c
\ No newline at end of file
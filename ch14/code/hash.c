@@ -689,7 +689,7 @@ result_t hash_drop(txn_t* tx, uint64_t hash_id) {
   }
   pages_map_t* pages;
   ensure(pagesmap_new(8, &pages));
-  defer(free, pages);
+  defer(pagesmap_free, pages);
   uint64_t* buckets = hash_root.address;
   for (size_t i = 0;
        i < hash_root.metadata->hash_dir.number_of_buckets; i++) {
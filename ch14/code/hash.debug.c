@@ -59,7 +59,7 @@ implementation_detail result_t print_hash_table(
   {
     pages_map_t* pages;
     ensure(pagesmap_new(8, &pages));
-    defer(free, pages);
+    defer(pagesmap_free, pages);
     for (size_t i = 0; i < p.metadata->hash_dir.number_of_buckets;
          i++) {
       page_t tp = {.page_num = buckets[i]};
@@ -219,7 +219,7 @@ describe(hash) {
       // check iteration
       pages_map_t* map;
       assert(pagesmap_new(8, &map));
-      defer(free, map);
+      defer(pagesmap_free, map);
       hash_val_t it = {.hash_id = hash_id};
       size_t count  = 0;
       while (true) {
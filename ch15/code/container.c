@@ -197,8 +197,8 @@ static result_t container_find_small_space_to_allocate(txn_t *tx,
   ensure(txn_get_metadata(tx, container_id, &header_metadata));
   pages_map_t *pages, *to_remove = 0;
   ensure(pagesmap_new(8, &pages));
-  defer(free, pages);
-  defer(free, to_remove);
+  defer(pagesmap_free, pages);
+  defer(pagesmap_free, to_remove);
   hash_val_t it = {.hash_id = header_metadata->container.free_list};
   *page_num     = 0;
   while (true) {
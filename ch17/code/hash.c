@@ -705,7 +705,7 @@ implementation_detail result_t hash_drop_one(
   }
   pages_map_t* pages;
   ensure(pagesmap_new(8, &pages));
-  defer(free, pages);
+  defer(pagesmap_free, pages);
   uint64_t* buckets = hash_root.address;
   for (size_t i = 0;
        i < hash_root.metadata->hash_dir.number_of_buckets; i++) {
@@ -2,6 +2,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -101,7 +102,7 @@ result_t multiple_vals_hash(uint64_t amount) {
       hash_val_t it  = {.hash_id = set.hash_id, .key = 127001};
       pages_map_t* pages;
       ensure(pagesmap_new(8, &pages));
-      defer(free, pages);
+      defer(pagesmap_free, pages);
       while (true) {
         ensure(hash_multi_get_next(&tx, &pages, &it, container_id));
         if (it.has_val == false) break;
@@ -121,7 +122,7 @@ result_t multiple_vals_hash(uint64_t amount) {
       hash_val_t it  = {.hash_id = set.hash_id, .key = 127001};
       pages_map_t* pages;
       ensure(pagesmap_new(8, &pages));
-      defer(free, pages);
+      defer(pagesmap_free, pages);
       while (true) {
         ensure(hash_multi_get_next(&tx, &pages, &it, container_id));
         if (it.has_val == false) break;
@@ -153,3 +154,1515 @@ describe(multiple_vals) {
   }
 }
 // end::tests17[]
+
+
+// tag::tests_group_commit[]
+typedef struct committer_state {
+  db_t* db;
+  uint64_t commits;
+  bool has_errors;
+  uint8_t padding[7];
+} committer_state_t;
+
+static result_t commit_pages(db_t* db, uint64_t commits) {
+  for (uint64_t i = 0; i < commits; i++) {
+    txn_t w;
+    ensure(txn_create(db, TX_WRITE, &w));
+    defer(txn_close, w);
+    page_t p = {.number_of_pages = 1};
+    ensure(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+    ensure(txn_commit(&w));
+  }
+  return success();
+}
+
+static void* committer_thread(void* arg) {
+  committer_state_t* state = arg;
+  if (flopped(commit_pages(state->db, state->commits))) {
+    errors_print_all();
+    state->has_errors = true;
+  }
+  return 0;
+}
+
+static result_t concurrent_commits(
+    size_t threads, uint64_t commits_per_thread) {
+  db_t db;
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .flags                            = db_flags_group_commit};
+  ensure(db_create("/tmp/db/try", &options, &db));
+  {
+    defer(db_close, db);
+    pthread_t ids[16];
+    committer_state_t states[16];
+    for (size_t i = 0; i < threads; i++) {
+      states[i] = (committer_state_t){
+          .db = &db, .commits = commits_per_thread};
+      ensure(!pthread_create(
+          &ids[i], 0, committer_thread, &states[i]));
+    }
+    for (size_t i = 0; i < threads; i++) {
+      ensure(!pthread_join(ids[i], 0));
+      ensure(!states[i].has_errors);
+    }
+    wal_group_commit_t* group = &db.state->wal_state.group_commit;
+    // one tx for the db creation
+    ensure(group->number_of_records ==
+           threads * commits_per_thread + 1);
+    ensure(group->number_of_writes <= group->number_of_records);
+  }
+  // reopen without group commit, everything must be durable
+  ensure(db_create("/tmp/db/try", 0, &db));
+  defer(db_close, db);
+  ensure(db.state->last_tx_id == threads * commits_per_thread + 1);
+  return success();
+}
+
+typedef struct visibility_check {
+  db_t* db;
+  bool seen_early;
+  uint8_t padding[7];
+} visibility_check_t;
+
+// called by the leader after the write, before it is durable
+static void check_not_visible(
+    void* state, uint64_t tx_id, span_t* wal_record) {
+  (void)wal_record;
+  visibility_check_t* check = state;
+  txn_state_t* visible      = __atomic_load_n(
+      &check->db->state->last_visible_tx, __ATOMIC_ACQUIRE);
+  if (visible->tx_id >= tx_id) check->seen_early = true;
+}
+
+static result_t commits_visible_once_durable(void) {
+  db_t db;
+  visibility_check_t check = {.db = &db};
+  db_options_t options     = {.minimum_size = 4 * 1024 * 1024,
+      .flags                                = db_flags_group_commit,
+      .wal_write_callback                   = check_not_visible,
+      .wal_write_callback_state             = &check};
+  ensure(db_create("/tmp/db/try", &options, &db));
+  defer(db_close, db);
+  ensure(commit_pages(&db, 10));
+  ensure(!check.seen_early);
+  ensure(db.state->last_visible_tx == db.state->last_write_tx);
+  return success();
+}
+
+// the WAL writes fail while its descriptors point to a read only file
+static result_t break_wal_files(db_t* db, int* originals) {
+  int read_only = open("/dev/null", O_RDONLY);
+  ensure(read_only >= 0);
+  wal_state_t* wal = &db->state->wal_state;
+  for (size_t i = 0; i < wal->number_of_files; i++) {
+    int fd       = wal->files[i].handle->fd;
+    originals[i] = dup(fd);
+    if (originals[i] >= 0) dup2(read_only, fd);
+  }
+  close(read_only);
+  return success();
+}
+
+static void restore_wal_files(db_t* db, int* originals) {
+  wal_state_t* wal = &db->state->wal_state;
+  for (size_t i = 0; i < wal->number_of_files; i++) {
+    if (originals[i] < 0) continue;
+    dup2(originals[i], wal->files[i].handle->fd);
+    close(originals[i]);
+  }
+}
+
+static result_t commit_with_broken_wal(db_t* db) {
+  ensure(commit_pages(db, 1));
+  uint64_t visible_tx_id = db->state->last_tx_id;
+  int originals[WAL_MAX_SEGMENTS];
+  ensure(break_wal_files(db, originals));
+  bool commited = !flopped(commit_pages(db, 1));
+  errors_clear();
+  restore_wal_files(db, originals);
+  ensure(!commited);
+  ensure(db->state->last_visible_tx != db->state->last_write_tx);
+  {
+    txn_t r;
+    ensure(txn_create(db, TX_READ, &r));
+    defer(txn_close, r);
+    ensure(r.state->tx_id <= visible_tx_id);
+  }
+  txn_t w;
+  bool refused = flopped(txn_create(db, TX_WRITE, &w));
+  errors_clear();
+  ensure(refused);
+  return success();
+}
+
+static result_t failed_batch_is_never_visible(void) {
+  db_t db;
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .flags                            = db_flags_group_commit};
+  ensure(db_create("/tmp/db/try", &options, &db));
+  bool failed_safely = !flopped(commit_with_broken_wal(&db));
+  // the failed commit was never written, closing reports it
+  bool closed = !flopped(db_close(&db));
+  errors_clear();
+  ensure(failed_safely && !closed);
+  return success();
+}
+
+describe(group_commit) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("single committer with group commit") {
+    assert(concurrent_commits(1, 10));
+  }
+
+  it("concurrent committers share WAL writes") {
+    assert(concurrent_commits(8, 25));
+  }
+
+  it("readers only see durable commits") {
+    assert(commits_visible_once_durable());
+  }
+
+  it("a failed batch is never visible and stops writers") {
+    assert(failed_batch_is_never_visible());
+  }
+}
+// end::tests_group_commit[]
+
+// tag::tests_async_commit[]
+static result_t async_commits(uint32_t flush_ms, bool flush) {
+  db_t db;
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .flags                            = db_flags_async_commit,
+      .wal_async_flush_ms               = flush_ms};
+  ensure(db_create("/tmp/db/try", &options, &db));
+  {
+    defer(db_close, db);
+    ensure(commit_pages(&db, 10));
+    ensure(db.state->last_tx_id == 11);
+    if (flush) {
+      ensure(db_flush_wal(&db));
+    } else {
+      struct timespec wait = {.tv_nsec = flush_ms * 10 * 1000000L};
+      nanosleep(&wait, 0);
+    }
+    ensure(wal_is_durable(db.state, db.state->last_tx_id));
+  }
+  ensure(db_create("/tmp/db/try", 0, &db));
+  defer(db_close, db);
+  ensure(db.state->last_tx_id == 11);
+  return success();
+}
+
+describe(async_commit) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("commit returns before the WAL is written") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags                            = db_flags_async_commit,
+        .wal_async_flush_ms               = 60 * 1000};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(commit_pages(&db, 3));
+    assert(!wal_is_durable(db.state, db.state->last_tx_id));
+    assert(db_flush_wal(&db));
+    assert(wal_is_durable(db.state, db.state->last_tx_id));
+  }
+
+  it("background flusher writes the WAL") {
+    assert(async_commits(5, false));
+  }
+
+  it("can force durability") { assert(async_commits(60000, true)); }
+}
+// end::tests_async_commit[]
+
+// tag::tests_background_checkpoint[]
+static result_t wait_for_checkpointer(db_t* db) {
+  txn_checkpointer_t* c = &db->state->checkpointer;
+  pthread_mutex_lock(&c->lock);
+  while ((c->target || c->busy) && !c->failed)
+    pthread_cond_wait(&c->done, &c->lock);
+  bool done = !c->failed &&
+              c->checkpointed_tx_id == db->state->last_tx_id;
+  pthread_mutex_unlock(&c->lock);
+  ensure(done, msg("Checkpointer didn't catch up"));
+  return success();
+}
+
+static result_t background_checkpoints(
+    db_flags_t flags, uint64_t dirty_limit, size_t threads) {
+  db_t db;
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .flags                            = flags,
+      .checkpoint_dirty_limit           = dirty_limit};
+  options.flags |= db_flags_background_checkpoint;
+  ensure(db_create("/tmp/db/try", &options, &db));
+  {
+    defer(db_close, db);
+    pthread_t ids[16];
+    committer_state_t states[16];
+    for (size_t i = 0; i < threads; i++) {
+      states[i] = (committer_state_t){.db = &db, .commits = 64};
+      ensure(!pthread_create(
+          &ids[i], 0, committer_thread, &states[i]));
+    }
+    for (size_t i = 0; i < threads; i++) {
+      ensure(!pthread_join(ids[i], 0));
+      ensure(!states[i].has_errors);
+    }
+    ensure(db.state->checkpointer.running);
+    ensure(wait_for_checkpointer(&db));
+    // freed on the next close, after the checkpointer is done
+    ensure(commit_pages(&db, 1));
+    ensure(wait_for_checkpointer(&db));
+  }
+  ensure(db_create("/tmp/db/try", 0, &db));
+  defer(db_close, db);
+  ensure(db.state->last_tx_id == threads * 64 + 2);
+  return success();
+}
+
+static result_t read_once(db_t* db) {
+  txn_t r;
+  ensure(txn_create(db, TX_READ, &r));
+  defer(txn_close, r);
+  return success();
+}
+
+static result_t checkpoint_failure_reported_once(db_t* db) {
+  ensure(commit_pages(db, 1));
+  bool caught_up = !flopped(wait_for_checkpointer(db));
+  errors_clear();
+  ensure(!caught_up);
+  // the next close reports the original error and retries
+  bool closed = !flopped(read_once(db));
+  size_t count;
+  int* codes      = errors_get_codes(&count);
+  bool root_cause = count && codes[0] == EBADF;
+  errors_clear();
+  ensure(!closed && root_cause);
+  ensure(read_once(db));
+  // the retries keep failing, so the dirty memory can't grow
+  txn_t w;
+  bool refused = flopped(txn_create(db, TX_WRITE, &w));
+  errors_clear();
+  ensure(refused);
+  return success();
+}
+
+static result_t background_checkpoint_failure(void) {
+  db_t db;
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .checkpoint_dirty_limit           = PAGE_SIZE};
+  options.flags = db_flags_background_checkpoint;
+  ensure(db_create("/tmp/db/try", &options, &db));
+  defer(db_close, db);
+  ensure(commit_pages(&db, 1));
+  ensure(wait_for_checkpointer(&db));
+  // the data file writes fail while it points to a read only file
+  int fd        = db.state->handle->fd;
+  int original  = dup(fd);
+  int read_only = open("/dev/null", O_RDONLY);
+  bool reported = original >= 0 && read_only >= 0 &&
+                  dup2(read_only, fd) == fd &&
+                  !flopped(checkpoint_failure_reported_once(&db));
+  if (original >= 0) dup2(original, fd);
+  close(original);
+  close(read_only);
+  ensure(reported);
+  // the next writer retries it and goes through
+  ensure(commit_pages(&db, 1));
+  ensure(wait_for_checkpointer(&db));
+  return success();
+}
+
+describe(background_checkpoint) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("checkpoints on a separate thread") {
+    assert(background_checkpoints(0, 0, 1));
+  }
+
+  it("applies backpressure when dirty memory is high") {
+    assert(background_checkpoints(0, PAGE_SIZE, 1));
+  }
+
+  it("works with group commit") {
+    assert(background_checkpoints(db_flags_group_commit, 0, 4));
+  }
+
+  it("reports a failed checkpoint once and retries it") {
+    assert(background_checkpoint_failure());
+  }
+}
+// end::tests_background_checkpoint[]
+
+// tag::tests_pages_write_batch[]
+describe(pages_write_batch) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("coalesces adjacent pages into a few writes") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    pages_write_stats_t before = db.state->write_stats;
+    {
+      txn_t w;
+      assert(txn_create(&db, TX_WRITE, &w));
+      defer(txn_close, w);
+      for (size_t i = 0; i < 96; i++) {
+        page_t p = {.number_of_pages = 1};
+        assert(txn_allocate_page(&w, &p, 0));
+        p.metadata->overflow.page_flags      = page_flags_overflow;
+        p.metadata->overflow.number_of_pages = 1;
+      }
+      assert(txn_commit(&w));
+    }
+    pages_write_stats_t* after = &db.state->write_stats;
+    uint64_t syscalls =
+        after->number_of_syscalls - before.number_of_syscalls;
+    uint64_t pages = after->number_of_pages - before.number_of_pages;
+    assert(pages >= 96);
+    // header, metadata, the allocated range (in iov batches)
+    assert(syscalls <= 6);
+    assert(after->bytes_written - before.bytes_written ==
+           pages * PAGE_SIZE);
+  }
+
+  it("can flush pages through io_uring") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags                            = db_flags_io_uring};
+    assert(db_create("/tmp/db/try", &options, &db));
+    {
+      defer(db_close, db);
+      assert(db.state->io_ring);
+      assert(commit_pages(&db, 16));
+      assert(db.state->write_stats.number_of_pages > 16);
+    }
+    assert(db_create("/tmp/db/try", 0, &db));
+    defer(db_close, db);
+    assert(db.state->last_tx_id == 17);
+  }
+}
+// end::tests_pages_write_batch[]
+
+// tag::tests_page_cache[]
+static result_t cached_db(db_t* db, uint64_t cache_size) {
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .flags                            = db_flags_avoid_mmap_io,
+      .page_cache_size                  = cache_size};
+  ensure(db_create("/tmp/db/try", &options, db));
+  return success();
+}
+
+static result_t write_pages(
+    db_t* db, uint64_t* page_nums, size_t count, const char* prefix) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.page_num = page_nums[i], .number_of_pages = 1};
+    if (p.page_num) {
+      ensure(txn_modify_page(&w, &p));
+    } else {
+      ensure(txn_allocate_page(&w, &p, 0));
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 1;
+    }
+    page_nums[i] = p.page_num;
+    sprintf(p.address, "%s %zu", prefix, i);
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t read_page(db_t* db, uint64_t page_num, char* buf) {
+  txn_t r;
+  ensure(txn_create(db, TX_READ, &r));
+  defer(txn_close, r);
+  page_t p = {.page_num = page_num};
+  ensure(txn_get_page(&r, &p));
+  strcpy(buf, p.address);
+  return success();
+}
+
+describe(page_cache) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("serves repeated reads from memory") {
+    db_t db;
+    assert(cached_db(&db, 1024 * 1024));
+    defer(db_close, db);
+    uint64_t page_num = 0;
+    assert(write_pages(&db, &page_num, 1, "cached"));
+    char buf[32];
+    assert(read_page(&db, page_num, buf));
+    page_cache_t* cache = &db.state->page_cache;
+    uint64_t misses     = cache->misses;
+    uint64_t hits       = cache->hits;
+    for (size_t i = 0; i < 3; i++) {
+      assert(read_page(&db, page_num, buf));
+      assert(strcmp(buf, "cached 0") == 0);
+    }
+    assert(cache->misses == misses);
+    assert(cache->hits >= hits + 3);
+  }
+
+  it("reads new data after the page is written") {
+    db_t db;
+    assert(cached_db(&db, 1024 * 1024));
+    defer(db_close, db);
+    uint64_t page_num = 0;
+    char buf[32];
+    assert(write_pages(&db, &page_num, 1, "old"));
+    assert(read_page(&db, page_num, buf));
+    assert(write_pages(&db, &page_num, 1, "new"));
+    assert(read_page(&db, page_num, buf));
+    assert(strcmp(buf, "new 0") == 0);
+  }
+
+  it("evicts to stay within the budget") {
+    db_t db;
+    assert(cached_db(&db, 4 * PAGE_SIZE));
+    defer(db_close, db);
+    uint64_t page_nums[32] = {0};
+    assert(write_pages(&db, page_nums, 32, "page"));
+    for (size_t i = 0; i < 32; i++) {
+      char buf[32], expected[32];
+      assert(read_page(&db, page_nums[i], buf));
+      sprintf(expected, "page %zu", i);
+      assert(strcmp(buf, expected) == 0);
+    }
+    page_cache_t* cache = &db.state->page_cache;
+    assert(cache->evictions > 0);
+    assert(cache->used_bytes <= 4 * PAGE_SIZE);
+  }
+
+  it("keeps pinned pages alive") {
+    db_t db;
+    assert(cached_db(&db, 2 * PAGE_SIZE));
+    defer(db_close, db);
+    uint64_t page_nums[16] = {0};
+    assert(write_pages(&db, page_nums, 16, "pinned"));
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = page_nums[0]};
+    assert(txn_get_page(&r, &p));
+    for (size_t i = 1; i < 16; i++) {
+      char buf[32];
+      assert(read_page(&db, page_nums[i], buf));
+    }
+    assert(strcmp(p.address, "pinned 0") == 0);
+  }
+}
+// end::tests_page_cache[]
+
+// tag::tests_map_reservation[]
+static result_t grow_file(db_t* db, uint32_t pages) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (uint32_t i = 0; i < pages; i++) {
+    page_t p = {.number_of_pages = 1};
+    ensure(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = 1;
+    sprintf(p.address, "grown %u", i);
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+describe(map_reservation) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("grows the file without moving the map") {
+    db_t db;
+    db_options_t options = {.map_reserve_size = 64 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    {
+      defer(db_close, db);
+      void* address = db.state->map.address;
+      assert(address == db.state->map_reservation.address);
+      txn_t r;
+      assert(txn_create(&db, TX_READ, &r));
+      defer(txn_close, r);
+      page_t header = {.page_num = 0};
+      assert(txn_get_page(&r, &header));
+      uint64_t size = db.state->map.size;
+      for (uint32_t pages = 64; pages <= 1024; pages *= 2) {
+        assert(grow_file(&db, pages));
+      }
+      assert(db.state->map.size > size);
+      assert(db.state->map.address == address);
+      // pages seen by older transactions remain valid
+      page_t again = {.page_num = 0};
+      assert(txn_get_page(&r, &again));
+      assert(again.address == header.address);
+    }
+    assert(db_create("/tmp/db/try", 0, &db));
+    defer(db_close, db);
+    assert(db.state->map_reservation.address == 0);
+    assert(db.state->last_tx_id == 6);
+  }
+
+  it("remaps once the reservation is exhausted") {
+    db_t db;
+    db_options_t options = {.map_reserve_size = 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    void* address = db.state->map.address;
+    assert(grow_file(&db, 64));
+    assert(db.state->map.address == address);
+    assert(grow_file(&db, 512));
+    assert(db.state->map.size > options.map_reserve_size);
+    assert(db.state->map.address != address);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t p = {.page_num = 0};
+    assert(txn_get_page(&r, &p));
+  }
+}
+// end::tests_map_reservation[]
+
+// tag::tests_preallocate[]
+describe(preallocate) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("grows the data file in whole extents") {
+    db_t db;
+    db_options_t options = {.flags = db_flags_preallocate,
+        .file_extent_size          = 2 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    {
+      defer(db_close, db);
+      assert(db.state->handle->flags &
+             pal_file_creation_flags_preallocate);
+      for (uint32_t i = 0; i < 4; i++) {
+        assert(grow_file(&db, 256));
+        assert(db.state->handle->size % options.file_extent_size ==
+               0);
+      }
+      struct wal_file_state* wal = &db.state->wal_state.files[0];
+      assert(wal->handle->flags &
+             pal_file_creation_flags_preallocate);
+    }
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(db.state->last_tx_id == 5);
+  }
+
+  it("rejects extents that are not page aligned") {
+    db_t db;
+    db_options_t options = {.flags = db_flags_preallocate,
+        .file_extent_size          = PAGE_SIZE + 1};
+    assert(!db_create("/tmp/db/try", &options, &db));
+    size_t count;
+    int* codes = errors_get_codes(&count);
+    assert(count > 0 && codes[0] == EINVAL);
+    errors_clear();
+  }
+}
+// end::tests_preallocate[]
+
+// tag::tests_parallel_finalize[]
+static result_t write_finalize_pages(
+    const char* path, db_options_t* options, uint64_t* pages) {
+  db_t db;
+  ensure(db_create(path, options, &db));
+  defer(db_close, db);
+  txn_t w;
+  ensure(txn_create(&db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < 300; i++) {
+    page_t p = {.number_of_pages = 1 + (i % 3 == 0)};
+    ensure(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = p.number_of_pages;
+    memset(p.address, (int)i, p.number_of_pages * PAGE_SIZE);
+    pages[i] = p.page_num;
+  }
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t read_finalize_pages(db_t* db, uint64_t* pages) {
+  txn_t r;
+  ensure(txn_create(db, TX_READ, &r));
+  defer(txn_close, r);
+  for (size_t i = 0; i < 300; i++) {
+    page_t p = {.page_num = pages[i]};
+    ensure(txn_get_page(&r, &p));
+    uint8_t* data = p.address;
+    size_t size   = p.number_of_pages * PAGE_SIZE;
+    ensure(data[0] == (uint8_t)i && data[size - 1] == (uint8_t)i,
+        msg("Page content mismatch"), with(pages[i], "%lu"));
+  }
+  return success();
+}
+
+describe(parallel_finalize) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("produces the same pages as the serial path") {
+    uint64_t pages[300];
+    db_options_t serial = {.minimum_size = 4 * 1024 * 1024};
+    assert(write_finalize_pages("/tmp/db/serial", &serial, pages));
+    db_options_t parallel = {.minimum_size = 4 * 1024 * 1024,
+        .finalize_workers                  = 4};
+    assert(
+        write_finalize_pages("/tmp/db/parallel", &parallel, pages));
+
+    db_t a, b;
+    assert(db_create("/tmp/db/serial", 0, &a));
+    defer(db_close, a);
+    assert(db_create("/tmp/db/parallel", 0, &b));
+    defer(db_close, b);
+    txn_t ra, rb;
+    assert(txn_create(&a, TX_READ, &ra));
+    defer(txn_close, ra);
+    assert(txn_create(&b, TX_READ, &rb));
+    defer(txn_close, rb);
+    assert(ra.state->number_of_pages == rb.state->number_of_pages);
+    for (uint64_t i = 0; i < ra.state->number_of_pages; i++) {
+      page_t pa = {.page_num = i}, pb = {.page_num = i};
+      assert(txn_raw_get_page(&ra, &pa));
+      assert(txn_raw_get_page(&rb, &pb));
+      assert(memcmp(pa.address, pb.address, PAGE_SIZE) == 0);
+    }
+  }
+
+  it("can commit encrypted pages in parallel") {
+    uint64_t pages[300];
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .finalize_workers                 = 4};
+    randombytes_buf(options.encryption_key, 32);
+    assert(write_finalize_pages("/tmp/db/try", &options, pages));
+    options.finalize_workers = 0;
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(read_finalize_pages(&db, pages));
+  }
+
+  it("rejects too many workers") {
+    db_t db;
+    db_options_t options = {
+        .finalize_workers = TXN_FINALIZER_MAX_WORKERS + 1};
+    assert(!db_create("/tmp/db/try", &options, &db));
+    size_t count;
+    int* codes = errors_get_codes(&count);
+    assert(count > 0 && codes[0] == EINVAL);
+    errors_clear();
+  }
+}
+// end::tests_parallel_finalize[]
+
+// tag::tests_subkey_cache[]
+static result_t benchmark_decrypt(
+    uint32_t subkey_cache_size, size_t rounds) {
+  system("rm -f /tmp/db/*");
+  uint64_t pages[300];
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .subkey_cache_size                = subkey_cache_size};
+  randombytes_buf(options.encryption_key, 32);
+  ensure(write_finalize_pages("/tmp/db/try", &options, pages));
+  db_t db;
+  ensure(db_create("/tmp/db/try", &options, &db));
+  defer(db_close, db);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < rounds; i++)
+    ensure(read_finalize_pages(&db, pages));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ns = (double)(end.tv_sec - start.tv_sec) * 1e9 +
+              (double)(end.tv_nsec - start.tv_nsec);
+  printf("subkey cache %u: %.1f ns per page\n", subkey_cache_size,
+      ns / (double)(rounds * 300));
+  return success();
+}
+
+describe(subkey_cache) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("reuses derived keys for encrypted pages") {
+    uint64_t pages[300];
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .subkey_cache_size                = 1024};
+    randombytes_buf(options.encryption_key, 32);
+    assert(write_finalize_pages("/tmp/db/try", &options, pages));
+    {
+      db_t db;
+      assert(db_create("/tmp/db/try", &options, &db));
+      defer(db_close, db);
+      assert(read_finalize_pages(&db, pages));
+      uint64_t misses = db.state->subkey_cache.misses;
+      assert(read_finalize_pages(&db, pages));
+      assert(db.state->subkey_cache.misses == misses);
+      assert(db.state->subkey_cache.hits >= 300);
+    }
+    // the keys are the same ones, with or without the cache
+    options.subkey_cache_size = 0;
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(read_finalize_pages(&db, pages));
+    assert(!db.state->subkey_cache.entries);
+  }
+
+  it("works when pages collide in the cache") {
+    uint64_t pages[300];
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .subkey_cache_size                = 3};
+    randombytes_buf(options.encryption_key, 32);
+    assert(write_finalize_pages("/tmp/db/try", &options, pages));
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(db.state->subkey_cache.capacity == 4);
+    assert(read_finalize_pages(&db, pages));
+  }
+
+  // GAVRAN_BENCHMARK=1 to compare the decryption cost per page
+  it("benchmark decrypting pages") {
+    const size_t rounds = getenv("GAVRAN_BENCHMARK") ? 200 : 0;
+    if (rounds) {
+      assert(benchmark_decrypt(0, rounds));
+      assert(benchmark_decrypt(1024, rounds));
+    }
+  }
+}
+// end::tests_subkey_cache[]
+
+// tag::tests_decrypted_cache[]
+static result_t overwrite_page(db_t* db, uint64_t page_num, int val) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t p = {.page_num = page_num};
+  ensure(txn_modify_page(&w, &p));
+  memset(p.address, val, p.number_of_pages * PAGE_SIZE);
+  ensure(txn_commit(&w));
+  return success();
+}
+
+describe(decrypted_cache) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("shares decrypted pages across read transactions") {
+    uint64_t pages[300];
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .decrypted_cache_size             = 8 * 1024 * 1024};
+    randombytes_buf(options.encryption_key, 32);
+    assert(write_finalize_pages("/tmp/db/try", &options, pages));
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(read_finalize_pages(&db, pages));
+    page_cache_t* cache = &db.state->decrypted_cache;
+    uint64_t misses              = cache->misses;
+    assert(cache->used_bytes > 0);
+    assert(read_finalize_pages(&db, pages));
+    assert(cache->misses == misses);
+    assert(cache->hits >= 300);
+  }
+
+  it("keeps each version of a page apart") {
+    uint64_t pages[300];
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .decrypted_cache_size             = 8 * 1024 * 1024};
+    randombytes_buf(options.encryption_key, 32);
+    assert(write_finalize_pages("/tmp/db/try", &options, pages));
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(read_finalize_pages(&db, pages));
+    txn_t old;
+    assert(txn_create(&db, TX_READ, &old));
+    defer(txn_close, old);
+    assert(overwrite_page(&db, pages[1], 0xAB));
+    page_t before = {.page_num = pages[1]};
+    assert(txn_get_page(&old, &before));
+    assert(((uint8_t*)before.address)[0] == 1);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t after = {.page_num = pages[1]};
+    assert(txn_get_page(&r, &after));
+    assert(((uint8_t*)after.address)[0] == 0xAB);
+  }
+
+  it("stays within its memory budget") {
+    uint64_t pages[300];
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .decrypted_cache_size             = 8 * PAGE_SIZE};
+    randombytes_buf(options.encryption_key, 32);
+    assert(write_finalize_pages("/tmp/db/try", &options, pages));
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    // a transaction pins what it read, so use one per page
+    for (size_t i = 0; i < 300; i++) {
+      txn_t r;
+      assert(txn_create(&db, TX_READ, &r));
+      defer(txn_close, r);
+      page_t p = {.page_num = pages[i]};
+      assert(txn_get_page(&r, &p));
+      assert(((uint8_t*)p.address)[0] == (uint8_t)i);
+    }
+    page_cache_t* cache = &db.state->decrypted_cache;
+    assert(cache->used_bytes <= options.decrypted_cache_size);
+    assert(cache->evictions > 0);
+  }
+
+  it("copies from the cache when reading pages into buffers") {
+    uint64_t pages[300];
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags                            = db_flags_avoid_mmap_io,
+        .decrypted_cache_size             = 8 * 1024 * 1024};
+    randombytes_buf(options.encryption_key, 32);
+    assert(write_finalize_pages("/tmp/db/try", &options, pages));
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(read_finalize_pages(&db, pages));
+    assert(read_finalize_pages(&db, pages));
+    assert(db.state->decrypted_cache.hits >= 300);
+  }
+}
+// end::tests_decrypted_cache[]
+
+// tag::tests_sealed_wal[]
+static void sum_wal_sizes(
+    void* state, uint64_t tx_id, span_t* wal_record) {
+  (void)tx_id;
+  *(uint64_t*)state += wal_record->size;
+}
+
+static void ship_sealed_record(
+    void* state, uint64_t tx_id, span_t* wal_record) {
+  reusable_buffer_t buffer = {0};
+  defer(free, buffer.address);
+  db_t* dst = state;
+  if (flopped(wal_apply_wal_record(dst, &buffer, tx_id, wal_record)))
+    errors_clear();  // the destination reads will fail
+}
+
+static result_t sealed_wal_size(db_flags_t flags, uint64_t* size) {
+  uint64_t pages[300];
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .flags                            = flags,
+      .wal_write_callback               = sum_wal_sizes,
+      .wal_write_callback_state         = size};
+  randombytes_buf(options.encryption_key, 32);
+  ensure(write_finalize_pages("/tmp/db/try", &options, pages));
+  return success();
+}
+
+// the marker repeats, so the record compresses well and leaves the
+// rest of the buffers free to hold on to it
+static bool holds_plain_text(void* address, size_t size) {
+  return address && memmem(address, size, "GavranPlainText!", 16);
+}
+
+static result_t sealed_buffers_hold_plain_text(bool* found) {
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .flags                            = db_flags_sealed_wal};
+  randombytes_buf(options.encryption_key, 32);
+  db_t db;
+  ensure(db_create("/tmp/db/try", &options, &db));
+  defer(db_close, db);
+  {
+    txn_t w;
+    ensure(txn_create(&db, TX_WRITE, &w));
+    defer(txn_close, w);
+    for (size_t i = 0; i < 16; i++) {
+      page_t p = {.number_of_pages = 1};
+      ensure(txn_allocate_page(&w, &p, 0));
+      p.metadata->overflow.page_flags      = page_flags_overflow;
+      p.metadata->overflow.number_of_pages = 1;
+      for (size_t j = 0; j < PAGE_SIZE; j += 16)
+        memcpy(p.address + j, "GavranPlainText!", 16);
+    }
+    ensure(txn_commit(&w));
+  }
+  wal_state_t* wal = &db.state->wal_state;
+  *found           = holds_plain_text(
+      wal->compression.output.address, wal->compression.output.size);
+  for (size_t i = 0; i < wal->buffer_pool.count; i++) {
+    span_t* buffer = &wal->buffer_pool.buffers[i];
+    *found |= holds_plain_text(buffer->address, buffer->size);
+  }
+  return success();
+}
+
+describe(sealed_wal) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("compresses the WAL records of encrypted databases") {
+    uint64_t copied = 0, sealed = 0;
+    assert(sealed_wal_size(db_flags_none, &copied));
+    system("rm -f /tmp/db/*");
+    assert(sealed_wal_size(db_flags_sealed_wal, &sealed));
+    assert(sealed > 0);
+    assert(sealed * 10 < copied);
+  }
+
+  it("wipes the plain text it sealed from reused buffers") {
+    bool found = true;
+    assert(sealed_buffers_hold_plain_text(&found));
+    assert(!found);
+  }
+
+  it("recovers from sealed WAL records") {
+    uint64_t pages[300];
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags                            = db_flags_sealed_wal};
+    randombytes_buf(options.encryption_key, 32);
+    assert(write_finalize_pages("/tmp/db/try", &options, pages));
+    // reading the records doesn't depend on the flag
+    options.flags = db_flags_none;
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(db.state->wal_state.recovery.number_of_records > 0);
+    assert(read_finalize_pages(&db, pages));
+  }
+
+  it("ships sealed records to a destination with the key") {
+    uint64_t pages[300];
+    char key[32];
+    randombytes_buf(key, 32);
+    db_options_t dst_options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_log_shipping_target};
+    memcpy(dst_options.encryption_key, key, 32);
+    db_t dst;
+    assert(db_create("/tmp/db/try-dst", &dst_options, &dst));
+    defer(db_close, dst);
+    db_options_t src_options = {.minimum_size = 4 * 1024 * 1024,
+        .flags                                = db_flags_sealed_wal,
+        .wal_write_callback       = ship_sealed_record,
+        .wal_write_callback_state = &dst};
+    memcpy(src_options.encryption_key, key, 32);
+    assert(write_finalize_pages("/tmp/db/try", &src_options, pages));
+    assert(read_finalize_pages(&dst, pages));
+
+    // same nonces and key, so the same bytes on both sides
+    src_options.wal_write_callback = 0;
+    db_t src;
+    assert(db_create("/tmp/db/try", &src_options, &src));
+    defer(db_close, src);
+    for (size_t i = 0; i < 300; i++) {
+      size_t offset = pages[i] * PAGE_SIZE;
+      assert(memcmp(src.state->map.address + offset,
+                 dst.state->map.address + offset, PAGE_SIZE) == 0);
+    }
+  }
+}
+// end::tests_sealed_wal[]
+
+// tag::tests_concurrent_readers[]
+typedef struct reader_state {
+  db_t* db;
+  bool* stop;
+  uint64_t page_num;
+  bool has_errors;
+  uint8_t padding[7];
+} reader_state_t;
+
+// the writer fills the whole page with a growing value, so a mixed
+// snapshot or one older than the previous read shows up
+static result_t read_stable_page(
+    reader_state_t* state, uint8_t* last) {
+  txn_t r;
+  ensure(txn_create(state->db, TX_READ, &r));
+  defer(txn_close, r);
+  page_t p = {.page_num = state->page_num};
+  ensure(txn_get_page(&r, &p));
+  uint8_t* data = p.address;
+  for (size_t i = 1; i < PAGE_SIZE; i++) {
+    ensure(data[i] == data[0], msg("Mixed snapshot"), with(i, "%zu"));
+  }
+  ensure(data[0] >= *last, msg("Snapshot went back in time"),
+      with(data[0], "%d"), with(*last, "%d"));
+  *last = data[0];
+  return success();
+}
+
+static void* reader_thread(void* arg) {
+  reader_state_t* state = arg;
+  uint8_t last          = 0;
+  while (!__atomic_load_n(state->stop, __ATOMIC_ACQUIRE)) {
+    if (flopped(read_stable_page(state, &last))) {
+      errors_print_all();
+      state->has_errors = true;
+      break;
+    }
+  }
+  return 0;
+}
+
+static result_t allocate_zeroed_page(db_t* db, uint64_t* page_num) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  page_t p = {.number_of_pages = 1};
+  ensure(txn_allocate_page(&w, &p, 0));
+  p.metadata->overflow.page_flags      = page_flags_overflow;
+  p.metadata->overflow.number_of_pages = 1;
+  *page_num                            = p.page_num;
+  ensure(txn_commit(&w));
+  return success();
+}
+
+static void wait_for_idle_checkpointer(db_t* db) {
+  txn_checkpointer_t* c = &db->state->checkpointer;
+  pthread_mutex_lock(&c->lock);
+  while ((c->target || c->busy) && !c->failed)
+    pthread_cond_wait(&c->done, &c->lock);
+  pthread_mutex_unlock(&c->lock);
+}
+
+static size_t count_live_states(db_t* db) {
+  size_t count = 0;
+  for (txn_state_t* cur = db->state->default_read_tx->next_tx; cur;
+       cur              = cur->next_tx)
+    count++;
+  return count;
+}
+
+// <1>
+static result_t concurrent_reads(
+    db_flags_t flags, size_t threads, uint32_t commits) {
+  db_t db;
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .flags = flags | db_flags_concurrent_readers};
+  ensure(db_create("/tmp/db/try", &options, &db));
+  defer(db_close, db);
+  uint64_t page_num;
+  ensure(allocate_zeroed_page(&db, &page_num));
+
+  bool stop = false;
+  pthread_t ids[16];
+  reader_state_t states[16];
+  size_t started = 0;
+  for (; started < threads; started++) {
+    states[started] = (reader_state_t){
+        .db = &db, .stop = &stop, .page_num = page_num};
+    if (pthread_create(
+            &ids[started], 0, reader_thread, &states[started]))
+      break;
+  }
+  bool written = true;
+  for (uint32_t i = 1; i <= commits && written; i++)
+    written = !flopped(overwrite_page(&db, page_num, (int)i));
+  __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+  bool has_errors = false;
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(ids[i], 0);
+    has_errors |= states[i].has_errors;
+  }
+  ensure(written);
+  ensure(started == threads, msg("Unable to start reader threads"));
+  ensure(!has_errors, msg("A reader saw an inconsistent snapshot"));
+  // <2>
+  // once the readers are gone, old versions don't pile up
+  for (uint32_t i = 0; i < 4; i++) {
+    ensure(overwrite_page(&db, page_num, 255));
+    wait_for_idle_checkpointer(&db);
+  }
+  ensure(count_live_states(&db) <= 8, msg("Old states were kept"),
+      with(count_live_states(&db), "%zu"));
+  return success();
+}
+
+describe(concurrent_readers) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("reads consistent snapshots while the writer commits") {
+    assert(concurrent_reads(db_flags_none, 4, 200));
+  }
+
+  it("works with background checkpoints and group commit") {
+    assert(concurrent_reads(
+        db_flags_background_checkpoint | db_flags_group_commit, 4,
+        200));
+  }
+
+  it("keeps a snapshot stable across commits") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_concurrent_readers};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t page_num;
+    assert(allocate_zeroed_page(&db, &page_num));
+    txn_t old;
+    assert(txn_create(&db, TX_READ, &old));
+    defer(txn_close, old);
+    for (int i = 1; i <= 5; i++)
+      assert(overwrite_page(&db, page_num, i));
+    page_t before = {.page_num = page_num};
+    assert(txn_get_page(&old, &before));
+    assert(((uint8_t*)before.address)[0] == 0);
+    txn_t r;
+    assert(txn_create(&db, TX_READ, &r));
+    defer(txn_close, r);
+    page_t after = {.page_num = page_num};
+    assert(txn_get_page(&r, &after));
+    assert(((uint8_t*)after.address)[0] == 5);
+  }
+}
+// end::tests_concurrent_readers[]
+
+// tag::tests_epoch_reclamation[]
+// readers may free states concurrently, so count under the lock
+static size_t count_live_states_locked(db_t* db) {
+  pthread_mutex_lock(&db->state->txn_lock);
+  size_t count = count_live_states(db);
+  pthread_mutex_unlock(&db->state->txn_lock);
+  return count;
+}
+
+static result_t reclaim_with_short_readers(
+    size_t threads, uint32_t commits, size_t bound) {
+  db_t db;
+  db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+      .flags = db_flags_concurrent_readers};
+  ensure(db_create("/tmp/db/try", &options, &db));
+  defer(db_close, db);
+  uint64_t page_num;
+  ensure(allocate_zeroed_page(&db, &page_num));
+
+  bool stop = false;
+  pthread_t ids[16];
+  reader_state_t states[16];
+  size_t started = 0;
+  for (; started < threads; started++) {
+    states[started] = (reader_state_t){
+        .db = &db, .stop = &stop, .page_num = page_num};
+    if (pthread_create(
+            &ids[started], 0, reader_thread, &states[started]))
+      break;
+  }
+  bool written    = true;
+  size_t max_live = 0;
+  for (uint32_t i = 1; i <= commits && written; i++) {
+    written  = !flopped(overwrite_page(&db, page_num, (int)i));
+    max_live = MAX(max_live, count_live_states_locked(&db));
+  }
+  __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+  bool has_errors = false;
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(ids[i], 0);
+    has_errors |= states[i].has_errors;
+  }
+  ensure(written);
+  ensure(started == threads, msg("Unable to start reader threads"));
+  ensure(!has_errors, msg("A reader saw an inconsistent snapshot"));
+  ensure(max_live < bound, msg("Old states piled up"),
+      with(max_live, "%zu"));
+  ensure(db.state->epochs.freed > commits / 2,
+      msg("Retired states were not freed"),
+      with(db.state->epochs.freed, "%lu"));
+  return success();
+}
+
+describe(epoch_reclamation) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("bounds old versions while short readers keep coming") {
+    assert(reclaim_with_short_readers(8, 250, 64));
+  }
+
+  it("keeps every version a long reader may need") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_concurrent_readers};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t page_num;
+    assert(allocate_zeroed_page(&db, &page_num));
+    txn_t old;
+    assert(txn_create(&db, TX_READ, &old));
+    for (int i = 1; i <= 10; i++)
+      assert(overwrite_page(&db, page_num, i));
+    assert(count_live_states(&db) >= 10);
+    page_t p = {.page_num = page_num};
+    assert(txn_get_page(&old, &p));
+    assert(((uint8_t*)p.address)[0] == 0);
+    assert(txn_close(&old));
+  }
+
+  it("lets readers free retired versions once writes stop") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .flags = db_flags_concurrent_readers};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    uint64_t page_num;
+    assert(allocate_zeroed_page(&db, &page_num));
+    for (int i = 1; i <= 10; i++)
+      assert(overwrite_page(&db, page_num, i));
+    assert(db.state->epochs.retired > 0);
+    for (int i = 0; i < 4; i++) {
+      txn_t r;
+      assert(txn_create(&db, TX_READ, &r));
+      assert(txn_close(&r));
+    }
+    assert(db.state->epochs.retired == 0);
+    assert(count_live_states(&db) <= 3);
+  }
+}
+// end::tests_epoch_reclamation[]
+
+// tag::tests_page_versions[]
+static result_t expect_page_value(
+    txn_t* tx, uint64_t page_num, uint8_t expected) {
+  page_t p = {.page_num = page_num};
+  ensure(txn_get_page(tx, &p));
+  uint8_t actual = ((uint8_t*)p.address)[0];
+  ensure(actual == expected, msg("Wrong version of the page"),
+      with(page_num, "%lu"), with(actual, "%d"),
+      with(expected, "%d"));
+  return success();
+}
+
+// <1>
+// old snapshots keep every commit in memory, each must still see
+// its own version of the page
+static result_t versions_per_snapshot(db_flags_t flags) {
+  db_t db;
+  db_options_t options = {
+      .minimum_size = 4 * 1024 * 1024, .flags = flags};
+  ensure(db_create("/tmp/db/try", &options, &db));
+  defer(db_close, db);
+  uint64_t changed, unchanged;
+  ensure(allocate_zeroed_page(&db, &unchanged));
+  ensure(allocate_zeroed_page(&db, &changed));
+  txn_t readers[4];
+  size_t opened = 0;
+  bool valid    = true;
+  for (int i = 1; i <= 200 && valid; i++) {
+    valid = !flopped(overwrite_page(&db, changed, i));
+    if (valid && i % 50 == 0)
+      valid = !flopped(txn_create(&db, TX_READ, &readers[opened++]));
+  }
+  for (size_t i = 0; i < opened && valid; i++) {
+    valid = !flopped(expect_page_value(
+                &readers[i], changed, (uint8_t)(50 * (i + 1)))) &&
+            !flopped(expect_page_value(&readers[i], unchanged, 0));
+  }
+  for (size_t i = 0; i < opened; i++)
+    valid &= !flopped(txn_close(&readers[i]));
+  ensure(valid);
+  // <2>
+  // once flushed, the versions are pruned from the index
+  ensure(overwrite_page(&db, changed, 255));
+  ensure(overwrite_page(&db, changed, 255));
+  ensure(db.state->page_versions->live <= 4,
+      msg("Pruned versions were kept"),
+      with(db.state->page_versions->live, "%zu"));
+  txn_t r;
+  ensure(txn_create(&db, TX_READ, &r));
+  defer(txn_close, r);
+  ensure(expect_page_value(&r, changed, 255));
+  ensure(expect_page_value(&r, unchanged, 0));
+  return success();
+}
+
+describe(page_versions) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("finds the version of each snapshot") {
+    assert(versions_per_snapshot(db_flags_none));
+  }
+
+  it("finds the version of each concurrent snapshot") {
+    assert(versions_per_snapshot(db_flags_concurrent_readers));
+  }
+
+  it("finds the version with background checkpoints") {
+    assert(versions_per_snapshot(db_flags_background_checkpoint));
+  }
+}
+// end::tests_page_versions[]
+
+// tag::tests_page_slab[]
+static result_t allocate_filled_pages(db_t* db, uint64_t* page_nums,
+    size_t count, uint32_t number_of_pages, bool commit) {
+  txn_t w;
+  ensure(txn_create(db, TX_WRITE, &w));
+  defer(txn_close, w);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.number_of_pages = number_of_pages};
+    ensure(txn_allocate_page(&w, &p, 0));
+    p.metadata->overflow.page_flags      = page_flags_overflow;
+    p.metadata->overflow.number_of_pages = number_of_pages;
+    memset(p.address, (int)(i % 251),
+        (size_t)number_of_pages * PAGE_SIZE);
+    page_nums[i] = p.page_num;
+  }
+  if (commit) ensure(txn_commit(&w));
+  return success();
+}
+
+static result_t expect_filled_pages(
+    db_t* db, uint64_t* page_nums, size_t count) {
+  txn_t r;
+  ensure(txn_create(db, TX_READ, &r));
+  defer(txn_close, r);
+  for (size_t i = 0; i < count; i++) {
+    page_t p = {.page_num = page_nums[i]};
+    ensure(txn_get_page(&r, &p));
+    uint8_t expected = (uint8_t)(i % 251);
+    ensure(((uint8_t*)p.address)[PAGE_SIZE - 1] == expected,
+        msg("Wrong page content"), with(page_nums[i], "%lu"));
+  }
+  return success();
+}
+
+// <1>
+// a rolled back transaction gives its runs back, the next one
+// takes the same runs without committing more memory
+static result_t page_slab_recycles(db_t* db) {
+  txn_page_slab_t* slab = &db->state->page_slab;
+  uint64_t page_nums[16];
+  ensure(allocate_filled_pages(db, page_nums, 10, 1, false));
+  ensure(allocate_filled_pages(db, page_nums + 10, 2, 3, false));
+  ensure(slab->used_bytes == 0, msg("Runs were not returned"),
+      with(slab->used_bytes, "%lu"));
+  ensure(slab->reserved_bytes == TXN_PAGE_SLAB_CHUNK);
+  uint64_t allocations = slab->allocations;
+  ensure(allocations >= 12 && slab->reuses > 0);
+  ensure(allocate_filled_pages(db, page_nums, 10, 1, true));
+  ensure(allocate_filled_pages(db, page_nums + 10, 2, 3, true));
+  ensure(slab->reuses >= allocations);
+  ensure(slab->reserved_bytes == TXN_PAGE_SLAB_CHUNK);
+  ensure(slab->fallbacks == 0);
+  ensure(expect_filled_pages(db, page_nums, 10));
+  ensure(expect_filled_pages(db, page_nums + 10, 2));
+  return success();
+}
+
+// <2>
+// more than a chunk worth of pages, with a chunk to hold them
+static result_t page_slab_falls_back(db_t* db) {
+  txn_page_slab_t* slab = &db->state->page_slab;
+  uint64_t page_nums[300];
+  ensure(allocate_filled_pages(db, page_nums, 300, 1, true));
+  ensure(expect_filled_pages(db, page_nums, 300));
+  ensure(slab->reserved_bytes == TXN_PAGE_SLAB_CHUNK);
+  ensure(slab->fallbacks > 0);
+  uint64_t fallbacks = slab->fallbacks;
+  // larger than the largest run
+  ensure(allocate_filled_pages(db, page_nums, 1, 300, true));
+  ensure(expect_filled_pages(db, page_nums, 1));
+  ensure(slab->fallbacks > fallbacks);
+  return success();
+}
+
+describe(page_slab) {
+  before_each() {
+    errors_clear();
+    system("mkdir -p /tmp/db");
+    system("rm -f /tmp/db/*");
+  }
+
+  it("recycles modified pages across transactions") {
+    db_t db;
+    db_options_t options = {.minimum_size = 4 * 1024 * 1024,
+        .page_slab_size                   = 8 * 1024 * 1024};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(page_slab_recycles(&db));
+  }
+
+  it("falls back to the heap when out of room") {
+    db_t db;
+    db_options_t options = {.minimum_size = 8 * 1024 * 1024,
+        .page_slab_size                   = 1};
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(page_slab_falls_back(&db));
+  }
+
+  it("populates its chunks up front, on huge pages if possible") {
+    uint64_t page_nums[1000];
+    db_options_t options = {.minimum_size = 16 * 1024 * 1024,
+        .page_slab_size                   = 64 * 1024 * 1024,
+        .flags = db_flags_page_slab_populate |
+                 db_flags_page_slab_huge_pages};
+    db_t db;
+    assert(db_create("/tmp/db/try", &options, &db));
+    defer(db_close, db);
+    assert(allocate_filled_pages(&db, page_nums, 1000, 1, true));
+    assert(expect_filled_pages(&db, page_nums, 1000));
+    assert(db.state->page_slab.reserved_bytes >= 1000 * PAGE_SIZE);
+  }
+}
+// end::tests_page_slab[]
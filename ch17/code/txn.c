@@ -1,7 +1,100 @@
 #include <gavran/db.h>
 #include <gavran/internal.h>
+#include <errno.h>
+#include <stdio.h>
 #include <string.h>
 
+// tag::txn_lock[]
+#define TXN_LOCKED_FLAGS \
+  (db_flags_group_commit | db_flags_concurrent_readers)
+
+static void txn_lock(db_state_t *db) {
+  if (db->options.flags & TXN_LOCKED_FLAGS)
+    pthread_mutex_lock(&db->txn_lock);
+}
+static void txn_unlock(db_state_t *db) {
+  if (db->options.flags & TXN_LOCKED_FLAGS)
+    pthread_mutex_unlock(&db->txn_lock);
+}
+static inline void defer_txn_unlock(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  txn_unlock(*(db_state_t **)cd->target);
+}
+// end::txn_lock[]
+
+static result_t txn_checkpointer_backpressure(db_state_t *db);
+
+// tag::txn_concurrent_readers[]
+static _Thread_local size_t txn_reader_slot_index = SIZE_MAX;
+static size_t txn_reader_next_slot;
+
+// <1>
+// a reader pins the current epoch in its thread's slot for as long
+// as it is open, threads sharing a slot just add to the count
+static void txn_epoch_pin(db_state_t *db, txn_state_t *reader) {
+  if (txn_reader_slot_index == SIZE_MAX) {
+    txn_reader_slot_index = __atomic_fetch_add(&txn_reader_next_slot,
+                                1, __ATOMIC_RELAXED) %
+                            TXN_READER_SLOTS;
+  }
+  txn_reader_slot_t *slot = &db->epochs.slots[txn_reader_slot_index];
+  while (true) {
+    uint64_t epoch =
+        __atomic_load_n(&db->epochs.current, __ATOMIC_SEQ_CST);
+    uint64_t *readers = &slot->readers[epoch & 1];
+    __atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+    // the epoch may have moved on before we were counted
+    if (__atomic_load_n(&db->epochs.current, __ATOMIC_SEQ_CST) ==
+        epoch) {
+      reader->epoch       = epoch;
+      reader->reader_slot = slot;
+      return;
+    }
+    __atomic_sub_fetch(readers, 1, __ATOMIC_RELEASE);
+  }
+}
+
+static void txn_epoch_unpin(txn_state_t *reader) {
+  __atomic_sub_fetch(&reader->reader_slot->readers[reader->epoch & 1],
+      1, __ATOMIC_RELEASE);
+}
+
+// <2>
+// must be called with the transactions lock held, the epoch moves
+// once no reader pinned the one before the current one, after that
+// whatever was published or retired two epochs ago is invisible
+static uint64_t txn_epoch_advance(db_state_t *db) {
+  uint64_t epoch = db->epochs.current;
+  for (size_t i = 0; i < TXN_READER_SLOTS; i++) {
+    if (__atomic_load_n(&db->epochs.slots[i].readers[(epoch + 1) & 1],
+            __ATOMIC_SEQ_CST))
+      return epoch;
+  }
+  __atomic_store_n(&db->epochs.current, epoch + 1, __ATOMIC_SEQ_CST);
+  return epoch + 1;
+}
+
+// <3>
+static result_t txn_create_concurrent_reader(
+    db_state_t *db, txn_t *tx) {
+  txn_state_t *state;
+  ensure(mem_calloc((void *)&state, sizeof(txn_state_t)));
+  txn_epoch_pin(db, state);
+  txn_state_t *snapshot =
+      __atomic_load_n(&db->last_visible_tx, __ATOMIC_SEQ_CST);
+  // a private state, so the temporary buffers aren't shared
+  state->snapshot        = snapshot;
+  state->prev_tx         = snapshot;
+  state->tx_id           = snapshot->tx_id;
+  state->db              = db;
+  state->map             = snapshot->map;
+  state->number_of_pages = snapshot->number_of_pages;
+  state->flags = TX_READ | TX_COMMITED | db->options.flags;
+  tx->state    = state;
+  return success();
+}
+// end::txn_concurrent_readers[]
+
 // tag::txn_create[]
 // tag::txn_create_working_set[]
 result_t txn_create(db_t *db, db_flags_t flags, txn_t *tx) {
@@ -14,8 +107,15 @@ result_t txn_create(db_t *db, db_flags_t flags, txn_t *tx) {
   // end::txn_create_working_set[]
   // <1>
   if (flags == TX_READ) {
-    tx->state = db->state->last_write_tx;
+    if (db->state->options.flags & db_flags_concurrent_readers) {
+      ensure(txn_create_concurrent_reader(db->state, tx));
+      return success();
+    }
+    txn_lock(db->state);
+    tx->state = __atomic_load_n(
+        &db->state->last_visible_tx, __ATOMIC_ACQUIRE);
     tx->state->usages++;
+    txn_unlock(db->state);
     return success();
   }
   if ((db->state->options.flags & db_flags_log_shipping_target)) {
@@ -29,10 +129,17 @@ result_t txn_create(db_t *db, db_flags_t flags, txn_t *tx) {
       msg("txn_create(flags) must be flagged with either TX_WRITE "
           "or TX_READ"),
       with(flags, "%d"));
+  // <2>
+  ensure(txn_checkpointer_backpressure(db->state));
+  size_t cancel_defer = 0;
+  txn_lock(db->state);
+  try_defer(txn_unlock, db->state, cancel_defer);
   ensure(!db->state->active_write_tx,
       msg("Opening a second write transaction is forbidden"));
+  // the last commits may never reach the WAL, can't build on them
+  ensure(!wal_has_failed(db->state),
+      msg("A WAL write failed, the database must be reopened"));
 
-  size_t cancel_defer = 0;
   txn_state_t *state;
   ensure(mem_calloc((void *)&state, sizeof(txn_state_t)));
   try_defer(free, state, cancel_defer);
@@ -54,20 +161,19 @@ result_t txn_create(db_t *db, db_flags_t flags, txn_t *tx) {
 }
 // end::txn_create[]
 
-static result_t txn_hash_page(
-    page_t *page, uint8_t hash[crypto_generichash_BYTES]);
+static result_t txn_hash_page(checksum_algorithm_t algorithm,
+    page_t *page, uint8_t hash[CHECKSUM_SIZE]);
 
 // tag::txn_validate_page[]
-static result_t txn_validate_page_hash(
-    page_t *page, uint8_t expected_hash[crypto_generichash_BYTES]) {
+static result_t txn_validate_page_hash(checksum_algorithm_t algorithm,
+    page_t *page, uint8_t expected_hash[CHECKSUM_SIZE]) {
   // <1>
-  uint8_t hash[crypto_generichash_BYTES];
-  ensure(txn_hash_page(page, hash));
+  uint8_t hash[CHECKSUM_SIZE];
+  ensure(txn_hash_page(algorithm, page, hash));
   // <2>
-  if (!memcmp(hash, expected_hash, crypto_generichash_BYTES))
-    return success();
+  if (!memcmp(hash, expected_hash, CHECKSUM_SIZE)) return success();
   // <3>
-  if (sodium_is_zero(expected_hash, crypto_generichash_BYTES) &&
+  if (sodium_is_zero(expected_hash, CHECKSUM_SIZE) &&
       sodium_is_zero(
           page->address, page->number_of_pages * PAGE_SIZE))
     return success();
@@ -83,7 +189,9 @@ static result_t txn_validate_page(txn_t *tx, page_t *page) {
   } else {
     metadata = page->address;
   }
-  ensure(txn_validate_page_hash(page, metadata->cyrpto.hash_blake2b));
+  ensure(txn_validate_page_hash(
+      tx->state->db->options.checksum_algorithm, page,
+      metadata->cyrpto.hash_blake2b));
   return success();
 }
 // end::txn_validate_page[]
@@ -103,13 +211,17 @@ static result_t txn_ensure_page_is_valid(txn_t *tx, page_t *page) {
   db_state_t *db   = tx->state->db;
   uint64_t *bitmap = db->first_read_bitmap;
   // before the db init is completed or extended during this run
+  uint64_t bit     = 1UL << page->page_num % 64;
   if (!bitmap || page->page_num >= db->original_number_of_pages ||
       // already checked
-      (bitmap[page->page_num / 64] & (1UL << page->page_num % 64)))
+      (__atomic_load_n(&bitmap[page->page_num / 64],
+           __ATOMIC_RELAXED) &
+          bit))
     return success();
   ensure(txn_validate_page(tx, page));
-  // we only do it one, can skip it next time
-  bitmap[page->page_num / 64] |= (1UL << page->page_num % 64);
+  // we only do it one, can skip it next time, readers may race
+  __atomic_fetch_or(
+      &bitmap[page->page_num / 64], bit, __ATOMIC_RELAXED);
   return success();
 }
 // end::txn_ensure_page_is_valid[]
@@ -135,21 +247,95 @@ static void txn_set_nonce(page_metadata_t *metadata,
 }
 // end::txn_generate_nonce[]
 
-// tag::txn_encrypt_page[]
+// tag::txn_subkey_cache[]
 static const char TxnKeyCtx[8] = "TxnPages";
-static result_t txn_encrypt_page(txn_t *tx, uint64_t page_num,
-    void *start, size_t size, page_metadata_t *metadata) {
-  // <1>
-  uint8_t subkey[crypto_aead_xchacha20poly1305_IETF_KEYBYTES];
+
+struct txn_subkey {
+  uint64_t page_num;
+  uint8_t key[crypto_aead_xchacha20poly1305_IETF_KEYBYTES];
+  bool used;
+  uint8_t _padding[7];
+};
+
+static void txn_subkey_cache_destroy(void *state) {
+  txn_subkey_cache_t *cache = &(*(db_state_t **)state)->subkey_cache;
+  sodium_free(cache->entries);  // zeroes the keys
+  cache->entries  = 0;
+  cache->capacity = 0;
+}
+
+// must be called with the cache lock held
+static result_t txn_subkey_cache_init(db_state_t *db) {
+  txn_subkey_cache_t *cache = &db->subkey_cache;
+  size_t capacity =
+      next_power_of_two(MAX(1, db->options.subkey_cache_size));
+  // guarded allocations need the real page size
+  ensure(sodium_init() >= 0, msg("Unable to initialize libsodium"));
+  size_t size           = capacity * sizeof(txn_subkey_t);
+  txn_subkey_t *entries = sodium_malloc(size);
+  ensure(entries, msg("Unable to allocate the subkey cache"),
+      with(capacity, "%zu"));
+  memset(entries, 0, size);
+  if (flopped(txn_register_cleanup_action(&db->on_close,
+          txn_subkey_cache_destroy, &db, sizeof(db_state_t *)))) {
+    sodium_free(entries);
+    return failure_code();
+  }
+  cache->entries  = entries;
+  cache->capacity = capacity;
+  return success();
+}
+
+// <1>
+static result_t txn_derive_subkey(db_state_t *db, uint64_t page_num,
+    uint8_t subkey[crypto_aead_xchacha20poly1305_IETF_KEYBYTES]) {
+  txn_subkey_cache_t *cache = &db->subkey_cache;
+  txn_subkey_t *entry       = 0;
+  if (db->options.subkey_cache_size) {
+    pthread_mutex_lock(&cache->lock);
+    bool ready =
+        cache->entries || !flopped(txn_subkey_cache_init(db));
+    if (ready) {
+      // direct mapped, a collision simply replaces the old key
+      entry = &cache->entries[page_num & (cache->capacity - 1)];
+      if (entry->used && entry->page_num == page_num) {
+        memcpy(subkey, entry->key, sizeof(entry->key));
+        cache->hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return success();
+      }
+      cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (!ready) return failure_code();
+  }
   if (crypto_kdf_derive_from_key(subkey,
           crypto_aead_xchacha20poly1305_IETF_KEYBYTES, page_num,
-          TxnKeyCtx, tx->state->db->options.encryption_key)) {
-    failed(EINVAL, msg("Unable to derive key for page decryption"),
+          TxnKeyCtx, db->options.encryption_key)) {
+    failed(EINVAL, msg("Unable to derive key for page"),
         with(page_num, "%ld"));
   }
+  if (entry) {
+    pthread_mutex_lock(&cache->lock);
+    sodium_memzero(entry->key, sizeof(entry->key));
+    memcpy(entry->key, subkey, sizeof(entry->key));
+    entry->page_num = page_num;
+    entry->used     = true;
+    pthread_mutex_unlock(&cache->lock);
+  }
+  return success();
+}
+// end::txn_subkey_cache[]
+
+// tag::txn_encrypt_page[]
+static result_t txn_encrypt_page(txn_t *tx, uint64_t page_num,
+    void *start, size_t size, page_metadata_t *metadata) {
+  // <1>
+  uint8_t subkey[crypto_aead_xchacha20poly1305_IETF_KEYBYTES];
+  ensure(txn_derive_subkey(tx->state->db, page_num, subkey));
   uint8_t nonce[crypto_aead_xchacha20poly1305_IETF_NPUBBYTES];
   // <2>
-  txn_generate_nonce(metadata);
+  // the nonce was generated before the WAL record was sealed
   txn_set_nonce(metadata, nonce);
   // <3>
   int result = crypto_aead_xchacha20poly1305_ietf_encrypt_detached(
@@ -165,17 +351,11 @@ static result_t txn_encrypt_page(txn_t *tx, uint64_t page_num,
 // end::txn_encrypt_page[]
 
 // tag::txn_decrypt[]
-static result_t txn_decrypt(db_options_t *options, void *start,
+static result_t txn_decrypt(db_state_t *db, void *start,
     size_t size, void *dest, page_metadata_t *metadata,
     uint64_t page_num) {
   uint8_t subkey[crypto_aead_xchacha20poly1305_ietf_KEYBYTES];
-
-  if (crypto_kdf_derive_from_key(subkey,
-          crypto_aead_xchacha20poly1305_ietf_KEYBYTES, page_num,
-          TxnKeyCtx, options->encryption_key)) {
-    failed(EINVAL, msg("Unable to derive key for page decryption"),
-        with(page_num, "%ld"));
-  }
+  ensure(txn_derive_subkey(db, page_num, subkey));
   uint8_t nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
   txn_set_nonce(metadata, nonce);
   int result = crypto_aead_xchacha20poly1305_ietf_decrypt_detached(
@@ -195,46 +375,228 @@ static result_t txn_decrypt(db_options_t *options, void *start,
 }
 // end::txn_decrypt[]
 
+// tag::txn_decrypted_cache[]
+static result_t txn_decrypted_insert_locked(db_state_t *db,
+    page_t *page, page_crypto_metadata_t *version, void *buffer,
+    page_cache_entry_t **entry) {
+  page_cache_t *cache = &db->decrypted_cache;
+  if (!cache->ring)
+    ensure(page_cache_init(
+        db, cache, db->options.decrypted_cache_size, true));
+  // another reader may have decrypted it meanwhile
+  *entry = page_cache_pin(
+      cache, page->page_num, page->number_of_pages, version);
+  if (*entry) return success();
+  ensure(page_cache_insert(cache, page->page_num,
+      page->number_of_pages, version, buffer, entry));
+  return success();
+}
+// end::txn_decrypted_cache[]
+
 // tag::txn_decrypt_page[]
 static result_t txn_decrypt_page(txn_t *tx, page_t *page) {
-  size_t cancel_defer = 0;
-  void *buffer        = 0;
-  ensure(mem_alloc_page_aligned(
-      &buffer, page->number_of_pages * PAGE_SIZE));
-  try_defer(free, buffer, cancel_defer);
-  if ((page->page_num & PAGES_IN_METADATA_MASK) == page->page_num) {
-    size_t shift = PAGE_METADATA_CRYPTO_HEADER_SIZE;
-    ensure(txn_decrypt(&tx->state->db->options, page->address + shift,
-        PAGE_SIZE - shift, buffer + shift, page->address,
-        page->page_num));
-    memcpy(buffer, page->address, shift);
-  } else {
-    page_metadata_t *metadata;
+  db_state_t *db                 = tx->state->db;
+  page_cache_t *cache            = &db->decrypted_cache;
+  page_cache_entry_t *entry      = 0;
+  page_crypto_metadata_t version = {0};
+  page_metadata_t *metadata      = page->address;
+  bool is_metadata_page =
+      (page->page_num & PAGES_IN_METADATA_MASK) == page->page_num;
+  if (!is_metadata_page)
     ensure(txn_get_metadata(tx, page->page_num, &metadata));
-    ensure(txn_decrypt(&tx->state->db->options, page->address,
-        page->number_of_pages * PAGE_SIZE, buffer, metadata,
-        page->page_num));
-  }
   // <1>
+  if (db->options.decrypted_cache_size) {
+    version = metadata->cyrpto;
+    pthread_mutex_lock(&cache->lock);
+    if (cache->ring)
+      entry = page_cache_pin(
+          cache, page->page_num, page->number_of_pages, &version);
+    if (entry)
+      cache->hits++;
+    else
+      cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+  }
+  size_t cancel_defer = 0;
+  void *plain_text    = 0;
+  try_defer(free, plain_text, cancel_defer);
+  void *buffer = entry ? entry->address : 0;
+  if (!entry) {
+    ensure(mem_alloc_page_aligned(
+        &plain_text, page->number_of_pages * PAGE_SIZE));
+    buffer = plain_text;
+    if (is_metadata_page) {
+      size_t shift = PAGE_METADATA_CRYPTO_HEADER_SIZE;
+      ensure(txn_decrypt(db, page->address + shift,
+          PAGE_SIZE - shift, buffer + shift, page->address,
+          page->page_num));
+      memcpy(buffer, page->address, shift);
+    } else {
+      ensure(txn_decrypt(db, page->address,
+          page->number_of_pages * PAGE_SIZE, buffer, metadata,
+          page->page_num));
+    }
+  }
+  // <2>
+  if (!entry && db->options.decrypted_cache_size) {
+    pthread_mutex_lock(&cache->lock);
+    bool cached = !flopped(txn_decrypted_insert_locked(
+        db, page, &version, buffer, &entry));
+    pthread_mutex_unlock(&cache->lock);
+    ensure(cached, msg("Unable to add decrypted page to the cache"),
+        with(page->page_num, "%lu"));
+    if (entry) {
+      // owned by the cache now, unless it already had a copy
+      if (entry->address != plain_text) {
+        sodium_memzero(plain_text, page->number_of_pages * PAGE_SIZE);
+        free(plain_text);
+      }
+      plain_text = 0;
+      buffer     = entry->address;
+    }
+  }
   page_t existing = {.page_num = page->page_num};
   if (pagesmap_lookup(tx->working_set, &existing)) {
     // this can happen if we are using encryption AND 32 bits mode
     // let's replace the encrypted content with the plain text one
     memcpy(
         existing.address, buffer, page->number_of_pages * PAGE_SIZE);
-    sodium_memzero(buffer, page->number_of_pages * PAGE_SIZE);
-    free(buffer);
-    buffer = 0;
+    if (entry)
+      page_cache_unpin(cache, entry);
+    else
+      sodium_memzero(buffer, page->number_of_pages * PAGE_SIZE);
     memcpy(page, &existing, sizeof(page_t));
-  } else {
-    page->address = buffer;
-    ensure(pagesmap_put_new(&tx->working_set, page));
+    return success();
+  }
+  // <3>
+  page->address  = buffer;
+  page->previous = entry;  // pinned until the working set is cleared
+  if (flopped(pagesmap_put_new(&tx->working_set, page))) {
+    if (entry) page_cache_unpin(cache, entry);
+    return failure_code();
   }
   cancel_defer = 1;
   return success();
 }
 // end::txn_decrypt_page[]
 
+// tag::txn_page_versions[]
+// <1>
+// only the writer calls it, the table is never more than half full
+static txn_page_versions_bucket_t *txn_versions_bucket(
+    txn_page_versions_t *table, uint64_t page_num) {
+  size_t mask  = table->number_of_buckets - 1;
+  uint64_t key = page_num + 1;
+  for (size_t i = hash_permute_key(key) & mask;; i = (i + 1) & mask) {
+    txn_page_versions_bucket_t *b = &table->buckets[i];
+    if (b->key == key) return b;
+    if (!b->key) {
+      __atomic_store_n(&b->key, key, __ATOMIC_RELEASE);
+      table->used++;
+      return b;
+    }
+  }
+}
+
+// <2>
+static bool txn_versions_lookup(
+    db_state_t *db, uint64_t tx_id, page_t *page) {
+  txn_page_versions_t *table =
+      __atomic_load_n(&db->page_versions, __ATOMIC_ACQUIRE);
+  if (!table) return false;
+  size_t mask  = table->number_of_buckets - 1;
+  uint64_t key = page->page_num + 1;
+  for (size_t i = hash_permute_key(key) & mask;; i = (i + 1) & mask) {
+    uint64_t cur =
+        __atomic_load_n(&table->buckets[i].key, __ATOMIC_ACQUIRE);
+    if (!cur) return false;
+    if (cur != key) continue;
+    txn_page_version_t *v =
+        __atomic_load_n(&table->buckets[i].head, __ATOMIC_ACQUIRE);
+    while (v && v->tx_id > tx_id)
+      v = __atomic_load_n(&v->older, __ATOMIC_ACQUIRE);
+    if (!v) return false;
+    memcpy(page, &v->page, sizeof(page_t));
+    return true;
+  }
+}
+
+// <3>
+// everything that may fail happens before the WAL write, so linking
+// the versions of a committed transaction cannot fail
+static result_t txn_versions_prepare(
+    txn_state_t *state, txn_page_versions_t **fresh) {
+  size_t count = state->modified_pages->count;
+  ensure(mem_calloc((void *)&state->versions,
+      count * sizeof(txn_page_version_t)));
+  *fresh                     = 0;
+  txn_page_versions_t *table = state->db->page_versions;
+  if (table && (table->used + count) * 2 <= table->number_of_buckets)
+    return success();
+  size_t live    = table ? table->live : 0;
+  size_t buckets = next_power_of_two(MAX(64, (live + count) * 4));
+  ensure(mem_calloc((void *)fresh,
+      sizeof(txn_page_versions_t) +
+          buckets * sizeof(txn_page_versions_bucket_t)));
+  (*fresh)->number_of_buckets = buckets;
+  return success();
+}
+
+static void txn_versions_rebuild(
+    db_state_t *db, txn_state_t *state, txn_page_versions_t *fresh) {
+  txn_page_versions_t *table = db->page_versions;
+  for (size_t i = 0; table && i < table->number_of_buckets; i++) {
+    txn_page_version_t *head = table->buckets[i].head;
+    if (!head) continue;
+    txn_versions_bucket(fresh, head->page.page_num)->head = head;
+    fresh->live++;
+  }
+  __atomic_store_n(&db->page_versions, fresh, __ATOMIC_RELEASE);
+  // readers may still be probing the old table
+  state->replaced_versions = table;
+}
+
+static void txn_versions_publish(
+    txn_state_t *state, txn_page_versions_t *fresh) {
+  db_state_t *db = state->db;
+  if (fresh) txn_versions_rebuild(db, state, fresh);
+  txn_page_versions_t *table = db->page_versions;
+  size_t iter_state          = 0;
+  page_t *p;
+  while (pagesmap_get_next(state->modified_pages, &iter_state, &p)) {
+    txn_page_version_t *v =
+        &state->versions[state->number_of_versions++];
+    txn_page_versions_bucket_t *b =
+        txn_versions_bucket(table, p->page_num);
+    v->tx_id = state->tx_id;
+    v->page  = *p;
+    v->older = b->head;
+    if (v->older)
+      v->older->newer = v;
+    else
+      table->live++;
+    __atomic_store_n(&b->head, v, __ATOMIC_RELEASE);
+  }
+}
+
+// <4>
+// states go away oldest first, so their versions are always the tail
+static void txn_versions_prune(db_state_t *db, txn_state_t *state) {
+  for (size_t i = 0; i < state->number_of_versions; i++) {
+    txn_page_version_t *v = &state->versions[i];
+    if (v->newer) {
+      __atomic_store_n(&v->newer->older, 0, __ATOMIC_RELEASE);
+      continue;
+    }
+    txn_page_versions_bucket_t *b =
+        txn_versions_bucket(db->page_versions, v->page.page_num);
+    __atomic_store_n(&b->head, 0, __ATOMIC_RELEASE);
+    db->page_versions->live--;
+  }
+  state->number_of_versions = 0;
+}
+// end::txn_page_versions[]
+
 // tag::txn_raw_get_page[]
 result_t txn_raw_get_page(txn_t *tx, page_t *page) {
   errors_assert_empty();
@@ -243,13 +605,11 @@ result_t txn_raw_get_page(txn_t *tx, page_t *page) {
       pagesmap_lookup(tx->state->modified_pages, page))
     return success();
   if (pagesmap_lookup(tx->working_set, page)) return success();
-  txn_state_t *prev = tx->state;
-  while (prev) {
-    if (pagesmap_lookup(prev->modified_pages, page)) break;
-    prev = prev->prev_tx;
-  }
+  // committed but not yet on disk
+  txn_versions_lookup(tx->state->db, tx->state->tx_id, page);
 
-  if (!page->address) {
+  bool from_disk = !page->address;
+  if (from_disk) {
     if (!page->number_of_pages) page->number_of_pages = 1;
     ensure(pages_get(tx, page));
   }
@@ -258,8 +618,11 @@ result_t txn_raw_get_page(txn_t *tx, page_t *page) {
   if (!(tx->state->flags & txn_flags_apply_log)) {
     if (tx->state->flags & db_flags_encrypted) {
       ensure(txn_decrypt_page(tx, page));
-    } else {
+    } else if (!from_disk ||
+               pages_needs_validation(tx->state->db, page)) {
       ensure(txn_ensure_page_is_valid(tx, page));
+      // cached pages are validated once, when loaded
+      if (from_disk) pages_mark_validated(tx->state->db, page);
     }
   }
 
@@ -267,24 +630,110 @@ result_t txn_raw_get_page(txn_t *tx, page_t *page) {
 }
 // end::txn_raw_get_page[]
 
-// tag::txn_raw_modify_page[]
-result_t txn_raw_modify_page(txn_t *tx, page_t *page) {
-  errors_assert_empty();
+// tag::txn_page_slab[]
+// <1>
+// a run of _n_ pages comes from the class of the next power of two
+static uint32_t txn_page_slab_class(uint64_t number_of_pages) {
+  if (number_of_pages <= 1) return 0;
+  return (uint32_t)(64 - __builtin_clzll(number_of_pages - 1));
+}
 
-  ensure(tx->state->flags & TX_WRITE,
-      msg("Read transactions cannot modify the pages"),
-      with(tx->state->flags, "%d"));
+static bool txn_page_slab_owns(txn_page_slab_t *slab, void *address) {
+  return (uint8_t *)address >= slab->start &&
+         (uint8_t *)address < slab->end;
+}
 
-  if (pagesmap_lookup(tx->state->modified_pages, page)) {
+static result_t txn_page_slab_init_locked(db_state_t *db) {
+  txn_page_slab_t *slab = &db->page_slab;
+  uint64_t size         = TXN_PAGE_SLAB_CHUNK *
+                  ROUND_UP(db->options.page_slab_size,
+                      TXN_PAGE_SLAB_CHUNK);
+  // room to align the start, so huge pages can back whole chunks
+  ensure(pal_reserve_address_space(
+      size + TXN_PAGE_SLAB_CHUNK, &slab->reservation));
+  uintptr_t start = ((uintptr_t)slab->reservation.address +
+                        TXN_PAGE_SLAB_CHUNK - 1) &
+                    ~(uintptr_t)(TXN_PAGE_SLAB_CHUNK - 1);
+  slab->start     = (uint8_t *)start;
+  slab->next      = slab->start;
+  slab->committed = slab->start;
+  slab->end       = slab->start + size;
+  return success();
+}
+
+// <2>
+// reuse a freed run of the same class, or carve a new one past
+// _next_, committing chunks as needed
+static result_t txn_page_slab_take_locked(
+    db_state_t *db, uint32_t class, void **address) {
+  txn_page_slab_t *slab = &db->page_slab;
+  size_t size           = (size_t)PAGE_SIZE << class;
+  if (!slab->reservation.address)
+    ensure(txn_page_slab_init_locked(db));
+  if (slab->free_runs[class]) {
+    *address               = slab->free_runs[class];
+    slab->free_runs[class] = *(void **)*address;
+    slab->reuses++;
+  } else {
+    if ((size_t)(slab->end - slab->next) < size) return success();
+    enum pal_commit_flags flags = pal_commit_flags_none;
+    if (db->options.flags & db_flags_page_slab_populate)
+      flags |= pal_commit_flags_populate;
+    if (db->options.flags & db_flags_page_slab_huge_pages)
+      flags |= pal_commit_flags_huge_pages;
+    while (slab->next + size > slab->committed) {
+      span_t chunk = {
+          .address = slab->committed, .size = TXN_PAGE_SLAB_CHUNK};
+      ensure(pal_commit_address_space(&chunk, flags));
+      slab->committed += TXN_PAGE_SLAB_CHUNK;
+      slab->reserved_bytes += TXN_PAGE_SLAB_CHUNK;
+    }
+    *address = slab->next;
+    slab->next += size;
+  }
+  slab->allocations++;
+  slab->used_bytes += size;
+  return success();
+}
+
+static result_t txn_page_slab_alloc(db_state_t *db, page_t *page) {
+  txn_page_slab_t *slab = &db->page_slab;
+  uint32_t class        = txn_page_slab_class(page->number_of_pages);
+  void *address         = 0;
+  if (db->options.page_slab_size) {
+    pthread_mutex_lock(&slab->lock);
+    bool taken =
+        class >= TXN_PAGE_SLAB_CLASSES ||
+        !flopped(txn_page_slab_take_locked(db, class, &address));
+    if (taken && !address) slab->fallbacks++;
+    pthread_mutex_unlock(&slab->lock);
+    ensure(taken, msg("Unable to allocate from the page slab"),
+        with(page->number_of_pages, "%u"));
+  }
+  if (address) {
+    page->address = address;
     return success();
   }
-  // end::txn_raw_modify_page[]
+  return mem_alloc_page_aligned(
+      &page->address, PAGE_SIZE * page->number_of_pages);
+}
 
-  size_t done = 0;
-  if (!page->number_of_pages) page->number_of_pages = 1;
-  ensure(mem_alloc_page_aligned(
-      &page->address, PAGE_SIZE * page->number_of_pages));
-  try_defer(free, page->address, done);
+// <3>
+// the free list is threaded through the freed runs themselves
+static void txn_page_slab_release_locked(
+    txn_page_slab_t *slab, page_t *page) {
+  if (!txn_page_slab_owns(slab, page->address)) {
+    free(page->address);
+    return;
+  }
+  uint32_t class = txn_page_slab_class(page->number_of_pages);
+  *(void **)page->address = slab->free_runs[class];
+  slab->free_runs[class]  = page->address;
+  slab->used_bytes -= (uint64_t)PAGE_SIZE << class;
+}
+// end::txn_page_slab[]
+
+static result_t txn_copy_modified_page(txn_t *tx, page_t *page) {
   page_t original = {.page_num = page->page_num};
   ensure(txn_raw_get_page(tx, &original));
   if (original.number_of_pages == page->number_of_pages) {
@@ -297,13 +746,37 @@ result_t txn_raw_modify_page(txn_t *tx, page_t *page) {
   }
   ensure(pagesmap_put_new(&tx->state->modified_pages, page),
       msg("Failed to allocate entry"));
-  done = 1;
+  return success();
+}
+
+// tag::txn_raw_modify_page[]
+result_t txn_raw_modify_page(txn_t *tx, page_t *page) {
+  errors_assert_empty();
+
+  ensure(tx->state->flags & TX_WRITE,
+      msg("Read transactions cannot modify the pages"),
+      with(tx->state->flags, "%d"));
+
+  if (pagesmap_lookup(tx->state->modified_pages, page)) {
+    return success();
+  }
+  // end::txn_raw_modify_page[]
+
+  if (!page->number_of_pages) page->number_of_pages = 1;
+  ensure(txn_page_slab_alloc(tx->state->db, page));
+  if (flopped(txn_copy_modified_page(tx, page))) {
+    txn_page_slab_t *slab = &tx->state->db->page_slab;
+    pthread_mutex_lock(&slab->lock);
+    txn_page_slab_release_locked(slab, page);
+    pthread_mutex_unlock(&slab->lock);
+    return failure_code();
+  }
   return success();
 }
 
 // tag::txn_hash_page[]
-static result_t txn_hash_page(
-    page_t *page, uint8_t hash[crypto_generichash_BYTES]) {
+static result_t txn_hash_page(checksum_algorithm_t algorithm,
+    page_t *page, uint8_t hash[CHECKSUM_SIZE]) {
   bool is_metadata_page =
       (page->page_num & PAGES_IN_METADATA_MASK) == page->page_num;
 
@@ -313,12 +786,9 @@ static result_t txn_hash_page(
   size_t size = is_metadata_page ? PAGE_SIZE - sizeof(page_metadata_t)
                                  : page->number_of_pages * PAGE_SIZE;
 
-  if (crypto_generichash(
-          hash, crypto_generichash_BYTES, start, size, 0, 0)) {
-    failed(ENODATA,
-        msg("Unable to compute page hash for page, shouldn't happen"),
-        with(page->page_num, "%lu"));
-  }
+  ensure(checksum_compute(algorithm, start, size, hash),
+      msg("Unable to compute page hash for page, shouldn't happen"),
+      with(page->page_num, "%lu"));
   return success();
 }
 // end::txn_hash_page[]
@@ -335,19 +805,144 @@ static result_t tx_finalize_page(
     return txn_encrypt_page(tx, page->page_num, page->address,
         page->number_of_pages * PAGE_SIZE, metadata);
   } else {
-    return txn_hash_page(page, metadata->cyrpto.hash_blake2b);
+    return txn_hash_page(tx->state->db->options.checksum_algorithm,
+        page, metadata->cyrpto.hash_blake2b);
   }
 }
 // end::tx_finalize_page[]
 
+// tag::txn_finalizer[]
+// small commits aren't worth waking up the workers for
+#define TXN_FINALIZE_MIN_PAGES 32
+#define TXN_FINALIZE_CHUNK 8
+
+struct txn_finalize_job {
+  txn_t *tx;
+  page_t *pages;
+  page_metadata_t **metadata;
+  size_t count;
+  size_t next;
+  size_t in_flight;
+  uint64_t failed_page;
+  bool failed;
+  uint8_t _padding[7];
+};
+
+// must be called with the finalizer lock held, returns it held
+static bool txn_finalize_next_chunk(
+    txn_finalizer_t *f, txn_finalize_job_t *job) {
+  if (job->next == job->count) return false;
+  size_t first = job->next;
+  size_t last  = MIN(first + TXN_FINALIZE_CHUNK, job->count);
+  job->next    = last;
+  job->in_flight++;
+  pthread_mutex_unlock(&f->lock);
+  // <1>
+  uint64_t failed_page = 0;
+  bool failed          = false;
+  for (size_t i = first; i < last && !failed; i++) {
+    if (flopped(tx_finalize_page(
+            job->tx, &job->pages[i], job->metadata[i]))) {
+      errors_clear();  // reported by the committing thread
+      failed_page = job->pages[i].page_num;
+      failed      = true;
+    }
+  }
+  pthread_mutex_lock(&f->lock);
+  if (failed && !job->failed) {
+    job->failed      = true;
+    job->failed_page = failed_page;
+  }
+  job->in_flight--;
+  if (job->next == job->count && !job->in_flight)
+    pthread_cond_broadcast(&f->done);
+  return true;
+}
+
+static void *txn_finalizer_run(void *arg) {
+  txn_finalizer_t *f = arg;
+  pthread_mutex_lock(&f->lock);
+  while (!f->stop) {
+    if (!f->job || !txn_finalize_next_chunk(f, f->job))
+      pthread_cond_wait(&f->work, &f->lock);
+  }
+  pthread_mutex_unlock(&f->lock);
+  return 0;
+}
+
+static void txn_finalizer_stop(void *state) {
+  db_state_t *db     = *(db_state_t **)state;
+  txn_finalizer_t *f = &db->finalizer;
+  pthread_mutex_lock(&f->lock);
+  f->stop = true;
+  pthread_cond_broadcast(&f->work);
+  pthread_mutex_unlock(&f->lock);
+  for (size_t i = 0; i < f->number_of_workers; i++)
+    pthread_join(f->workers[i], 0);
+  f->number_of_workers = 0;
+}
+
+static result_t txn_finalizer_start(db_state_t *db) {
+  txn_finalizer_t *f = &db->finalizer;
+  ensure(txn_register_cleanup_action(&db->on_close,
+      txn_finalizer_stop, &db, sizeof(db_state_t *)));
+  for (size_t i = 0; i < db->options.finalize_workers; i++) {
+    int rc =
+        pthread_create(&f->workers[i], 0, txn_finalizer_run, f);
+    if (rc) {
+      failed(rc, msg("Unable to start a page finalizer thread"),
+          with(i, "%zu"));
+    }
+    f->number_of_workers++;
+  }
+  return success();
+}
+
+// <2>
+static result_t txn_finalize_pages(txn_t *tx, page_t *pages,
+    page_metadata_t **metadata, size_t count) {
+  db_state_t *db = tx->state->db;
+  if (!db->options.finalize_workers ||
+      count < TXN_FINALIZE_MIN_PAGES) {
+    for (size_t i = 0; i < count; i++)
+      ensure(tx_finalize_page(tx, &pages[i], metadata[i]));
+    return success();
+  }
+  txn_finalizer_t *f = &db->finalizer;
+  if (!f->number_of_workers) ensure(txn_finalizer_start(db));
+  txn_finalize_job_t job = {.tx = tx,
+      .pages                    = pages,
+      .metadata                 = metadata,
+      .count                    = count};
+  pthread_mutex_lock(&f->lock);
+  f->job = &job;
+  pthread_cond_broadcast(&f->work);
+  // the committing thread does its share of the work
+  while (txn_finalize_next_chunk(f, &job)) {
+  }
+  while (job.in_flight) pthread_cond_wait(&f->done, &f->lock);
+  f->job = 0;
+  pthread_mutex_unlock(&f->lock);
+  if (job.failed) {
+    failed(EINVAL, msg("Unable to finalize page"),
+        with(job.failed_page, "%lu"));
+  }
+  return success();
+}
+// end::txn_finalizer[]
+
 // tag::txn_finalize_modified_pages[]
 static result_t txn_finalize_modified_pages(txn_t *tx) {
   txn_state_t *state = tx->state;
   // <1>
+  size_t count = state->modified_pages->count;
   page_t *modified_pages;
-  ensure(mem_calloc((void *)&modified_pages,
-      state->modified_pages->count * sizeof(page_t)));
+  ensure(mem_calloc((void *)&modified_pages, count * sizeof(page_t)));
   defer(free, modified_pages);
+  page_metadata_t **metadata;
+  ensure(mem_calloc(
+      (void *)&metadata, count * sizeof(page_metadata_t *)));
+  defer(free, metadata);
   size_t modified_pages_idx = 0;
   size_t iter_state         = 0;
   page_t *current;
@@ -359,33 +954,96 @@ static result_t txn_finalize_modified_pages(txn_t *tx) {
         sizeof(page_t));
   }
   // <3>
+  // modifying the metadata may add pages, so it is done up front
+  size_t data_pages = 0;
   for (size_t i = 0; i < modified_pages_idx; i++) {
-    page_metadata_t *metadata;
+    page_metadata_t *entry;
     ensure(txn_modify_metadata(
-        tx, modified_pages[i].page_num, &metadata));
+        tx, modified_pages[i].page_num, &entry));
     if ((modified_pages[i].page_num & PAGES_IN_METADATA_MASK) ==
         modified_pages[i].page_num)
       // we handle metadata page separately, note that metadata pages
       // *must* be modified, that is why we call modify metadat first
       continue;
-
-    ensure(tx_finalize_page(tx, &modified_pages[i], metadata));
+    modified_pages[data_pages] = modified_pages[i];
+    metadata[data_pages++]     = entry;
   }
   // <4>
-  iter_state = 0;
+  // modifying the metadata may have added metadata pages
+  if (state->modified_pages->count > count) {
+    count = state->modified_pages->count;
+    ensure(mem_realloc(
+        (void *)&modified_pages, count * sizeof(page_t)));
+    ensure(mem_realloc(
+        (void *)&metadata, count * sizeof(page_metadata_t *)));
+  }
+  size_t metadata_pages = 0;
+  iter_state            = 0;
   while (pagesmap_get_next(
       tx->state->modified_pages, &iter_state, &current)) {
     if ((current->page_num & PAGES_IN_METADATA_MASK) !=
         current->page_num)
       continue;  // not a metadata page
-    page_metadata_t *entries = current->address;
-
-    ensure(tx_finalize_page(tx, current, entries));
+    modified_pages[data_pages + metadata_pages] = *current;
+    metadata[data_pages + metadata_pages++]     = current->address;
   }
+  // <5>
+  // the WAL gets the plain text, recovery re-encrypts with the
+  // same nonces, so the nonces must be set before it is sealed
+  if (state->flags & db_flags_encrypted) {
+    for (size_t i = 0; i < data_pages + metadata_pages; i++)
+      txn_generate_nonce(metadata[i]);
+    if (state->db->options.flags & db_flags_sealed_wal)
+      ensure(wal_prepare_sealed(state));
+  }
+  // each data page only touches its own metadata entry
+  ensure(txn_finalize_pages(
+      tx, modified_pages, metadata, data_pages));
+  // the entries are all set, the metadata pages can be finalized
+  ensure(txn_finalize_pages(tx, modified_pages + data_pages,
+      metadata + data_pages, metadata_pages));
   return success();
 }
 // end::txn_finalize_modified_pages[]
 
+// tag::txn_dirty_bytes[]
+static uint64_t txn_dirty_bytes(txn_state_t *state) {
+  uint64_t bytes    = 0;
+  size_t iter_state = 0;
+  page_t *p;
+  while (pagesmap_get_next(state->modified_pages, &iter_state, &p))
+    bytes += p->number_of_pages * PAGE_SIZE;
+  return bytes;
+}
+// end::txn_dirty_bytes[]
+
+// tag::txn_publish[]
+// readers open the last visible state, with group commit it moves
+// only once the WAL has the commit, so a reader never sees a commit
+// that a crash may lose. A failed batch is never published and the
+// writers after it are refused, see txn_create. Committers of the
+// same batch may get here in any order, an older state is already
+// covered by the visible one. Only states newer than the visible
+// one are kept from the GC, so `state` is alive while it is newer
+static void txn_publish(
+    db_state_t *db, txn_state_t *state, uint64_t tx_id) {
+  pthread_mutex_lock(&db->publish_lock);
+  txn_state_t *cur = db->last_visible_tx;
+  if (cur->tx_id < tx_id) {
+    // readers that may still see an older state pinned this or
+    // before, including the states this one covers
+    uint64_t epoch =
+        __atomic_load_n(&db->epochs.current, __ATOMIC_SEQ_CST);
+    do {
+      cur        = __atomic_load_n(&cur->next_tx, __ATOMIC_ACQUIRE);
+      cur->epoch = epoch;
+    } while (cur != state);
+    __atomic_store_n(&db->last_visible_tx, state, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&db->publish_lock);
+}
+// end::txn_publish[]
+
 // tag::txn_commit[]
 result_t txn_commit(txn_t *tx) {
   errors_assert_empty();
@@ -399,19 +1057,29 @@ result_t txn_commit(txn_t *tx) {
     ensure(txn_finalize_modified_pages(tx));
   }
 
+  txn_page_versions_t *fresh_versions;
+  ensure(txn_versions_prepare(tx->state, &fresh_versions));
+  size_t cancel_defer = 0;
+  try_defer(free, fresh_versions, cancel_defer);
   ensure(wal_append(tx->state));
+  cancel_defer = 1;
   // end::txn_commit[]
 
+  uint64_t tx_id = tx->state->tx_id;
   tx->state->flags |= TX_COMMITED;
   tx->state->usages = 1;
 
   // <1>
   // Update global references to the current span on commit
-  tx->state->db->last_write_tx->next_tx = tx->state;
-  tx->state->db->last_write_tx          = tx->state;
-  tx->state->db->last_tx_id             = tx->state->tx_id;
-  tx->state->db->map                    = tx->state->map;
-  tx->state->db->number_of_pages        = tx->state->number_of_pages;
+  db_state_t *db = tx->state->db;
+  db->last_tx_id      = tx->state->tx_id;
+  db->map             = tx->state->map;
+  db->number_of_pages = tx->state->number_of_pages;
+  txn_versions_publish(tx->state, fresh_versions);
+  // the next writer builds on it, readers wait for txn_publish
+  __atomic_store_n(
+      &db->last_write_tx->next_tx, tx->state, __ATOMIC_RELEASE);
+  __atomic_store_n(&db->last_write_tx, tx->state, __ATOMIC_SEQ_CST);
 
   // <2>
   while (tx->state->on_rollback) {
@@ -420,17 +1088,36 @@ result_t txn_commit(txn_t *tx) {
     free(cur);
   }
 
+  // <3>
+  if (db->options.flags & db_flags_background_checkpoint) {
+    txn_checkpointer_t *c = &db->checkpointer;
+    uint64_t bytes        = txn_dirty_bytes(tx->state);
+    pthread_mutex_lock(&c->lock);
+    c->dirty_bytes += bytes;
+    pthread_mutex_unlock(&c->lock);
+  }
+  // <4>
+  if (db->options.flags & db_flags_group_commit) {
+    // let the next writer proceed while we wait for the WAL
+    db->active_write_tx = 0;
+    txn_unlock(db);
+    ensure(wal_wait_until_durable(db, tx_id));
+  }
+  txn_publish(db, tx->state, tx_id);
   return success();
 }
 
 // tag::txn_free_single_tx_state[]
 implementation_detail void txn_free_single_tx_state(
     txn_state_t *state) {
-  size_t iter_state = 0;
+  size_t iter_state     = 0;
+  txn_page_slab_t *slab = &state->db->page_slab;
   page_t *p;
+  pthread_mutex_lock(&slab->lock);
   while (pagesmap_get_next(state->modified_pages, &iter_state, &p)) {
-    free(p->address);
+    txn_page_slab_release_locked(slab, p);
   }
+  pthread_mutex_unlock(&slab->lock);
   // <1>
   while (state->on_forget) {
     cleanup_callback_t *cur = state->on_forget;
@@ -438,7 +1125,9 @@ implementation_detail void txn_free_single_tx_state(
     state->on_forget = cur->next;
     free(cur);
   }
-  free(state->modified_pages);
+  pagesmap_free(state->modified_pages);
+  free(state->versions);
+  free(state->replaced_versions);
   free(state);
 }
 // end::txn_free_single_tx_state[]
@@ -453,13 +1142,19 @@ static void txn_free_registered_transactions(db_state_t *state) {
       break;
 
     if (cur->next_tx) cur->next_tx->prev_tx = 0;
+    txn_versions_prune(state, cur);
 
+    // txn_publish walks the chain from the visible state
+    pthread_mutex_lock(&state->publish_lock);
     state->transactions_to_free             = cur->next_tx;
     state->default_read_tx->next_tx         = cur->next_tx;
     state->default_read_tx->map             = cur->map;
     state->default_read_tx->number_of_pages = cur->number_of_pages;
     if (state->last_write_tx == cur)
       state->last_write_tx = state->default_read_tx;
+    if (state->last_visible_tx == cur)
+      state->last_visible_tx = state->default_read_tx;
+    pthread_mutex_unlock(&state->publish_lock);
 
     txn_free_single_tx_state(cur);
   }
@@ -467,20 +1162,30 @@ static void txn_free_registered_transactions(db_state_t *state) {
 // end::txn_free_registered_transactions[]
 
 // tag::txn_write_state_to_disk[]
-static result_t txn_write_state_to_disk(txn_state_t *s) {
+static result_t txn_write_pages_to_disk(
+    db_state_t *db, pages_map_t *pages, uint64_t tx_id) {
+  // sorted & coalesced by pages_write_batch, we need a copy
+  page_t *sorted;
+  ensure(mem_alloc((void *)&sorted, pages->count * sizeof(page_t)));
+  defer(free, sorted);
+  size_t count      = 0;
   size_t iter_state = 0;
   page_t *current;
-  while (
-      pagesmap_get_next(s->modified_pages, &iter_state, &current)) {
-    ensure(pages_write(s->db, current));
+  while (pagesmap_get_next(pages, &iter_state, &current)) {
+    memcpy(&sorted[count++], current, sizeof(page_t));
   }
+  ensure(pages_write_batch(db, sorted, count));
   // <1>
-  if (wal_will_checkpoint(s->db, s->tx_id)) {
-    ensure(pal_fsync(s->db->handle));
-    ensure(wal_checkpoint(s->db, s->tx_id));
+  if (wal_will_checkpoint(db, tx_id)) {
+    ensure(pal_fsync(db->handle));
+    ensure(wal_checkpoint(db, tx_id));
   }
   return success();
 }
+
+static result_t txn_write_state_to_disk(txn_state_t *s) {
+  return txn_write_pages_to_disk(s->db, s->modified_pages, s->tx_id);
+}
 // end::txn_write_state_to_disk[]
 
 // tag::txn_merge_unique_pages[]
@@ -505,18 +1210,282 @@ static result_t txn_merge_unique_pages(txn_state_t *state) {
 }
 // end::txn_merge_unique_pages[]
 
+// tag::txn_checkpointer[]
+// the checkpointer only reads committed states, which are immutable,
+// unlinking and freeing them is left to txn_gc on the user's thread
+static result_t txn_checkpoint_states(db_state_t *db,
+    txn_state_t *target, uint64_t checkpointed_tx_id,
+    uint64_t *bytes) {
+  pages_map_t *pages;
+  ensure(pagesmap_new(
+      next_power_of_two(target->modified_pages->count * 2), &pages));
+  defer(pagesmap_free, pages);
+  // <1>
+  txn_state_t *cur = target;
+  while (true) {
+    size_t iter_state = 0;
+    page_t *entry;
+    while (
+        pagesmap_get_next(cur->modified_pages, &iter_state, &entry)) {
+      *bytes += entry->number_of_pages * PAGE_SIZE;
+      page_t check = {.page_num = entry->page_num};
+      if (pagesmap_lookup(pages, &check)) continue;  // newer version
+      ensure(pagesmap_put_new(&pages, entry));
+    }
+    // older states may be freed concurrently, don't touch them
+    if (cur->tx_id <= checkpointed_tx_id + 1 || !cur->prev_tx) break;
+    cur = cur->prev_tx;
+  }
+  // <2>
+  ensure(txn_write_pages_to_disk(db, pages, target->tx_id));
+  return success();
+}
+
+// keeps the root cause, the errors are thread local
+static void txn_checkpointer_keep_error(txn_checkpointer_t *c) {
+  size_t count;
+  int *codes          = errors_get_codes(&count);
+  const char **errors = errors_get_messages(&count);
+  c->error_code       = count && codes[0] ? codes[0] : EIO;
+  c->error_reported   = false;
+  snprintf(c->error, sizeof(c->error), "%s", count ? errors[0] : "");
+}
+
+static result_t txn_checkpointer_report(int32_t code, char *error) {
+  failed(code, msg("A background checkpoint has failed"),
+      with(error, "%s"));
+}
+
+static void *txn_checkpointer_run(void *arg) {
+  db_state_t *db        = arg;
+  txn_checkpointer_t *c = &db->checkpointer;
+  pthread_mutex_lock(&c->lock);
+  while (true) {
+    while ((!c->target || c->failed) && !c->stop)
+      pthread_cond_wait(&c->work, &c->lock);
+    if (c->stop) break;  // the WAL has anything not yet written
+    // <3>
+    txn_state_t *target = c->target;
+    uint64_t from       = c->checkpointed_tx_id;
+    c->target           = 0;
+    c->busy             = true;
+    pthread_mutex_unlock(&c->lock);
+
+    uint64_t bytes = 0;
+    bool done =
+        !flopped(txn_checkpoint_states(db, target, from, &bytes));
+
+    pthread_mutex_lock(&c->lock);
+    c->busy = false;
+    if (done) {
+      c->checkpointed_tx_id = target->tx_id;
+      c->dirty_bytes -= MIN(bytes, c->dirty_bytes);
+      c->error_code = 0;
+    } else {
+      // reported on the next hand off, which retries the work, a
+      // newer target covers this one
+      if (!c->error_code) txn_checkpointer_keep_error(c);
+      errors_clear();
+      if (!c->target) c->target = target;
+      c->failed = true;
+    }
+    pthread_cond_broadcast(&c->done);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return 0;
+}
+
+static void txn_checkpointer_stop(void *state) {
+  db_state_t *db        = *(db_state_t **)state;
+  txn_checkpointer_t *c = &db->checkpointer;
+  pthread_mutex_lock(&c->lock);
+  c->stop = true;
+  pthread_cond_signal(&c->work);
+  pthread_mutex_unlock(&c->lock);
+  pthread_join(c->thread, 0);
+  c->running = false;
+}
+
+static result_t txn_checkpointer_start(db_state_t *db) {
+  txn_checkpointer_t *c = &db->checkpointer;
+  // everything before the oldest state in memory is on disk
+  c->checkpointed_tx_id = db->default_read_tx->next_tx->tx_id - 1;
+  int rc = pthread_create(&c->thread, 0, txn_checkpointer_run, db);
+  if (rc) {
+    failed(rc, msg("Unable to start the checkpointer thread"));
+  }
+  c->running = true;
+  ensure(txn_register_cleanup_action(&db->on_close,
+      txn_checkpointer_stop, &db, sizeof(db_state_t *)));
+  return success();
+}
+
+// must be called with the transactions lock held
+static result_t txn_checkpointer_hand_off(
+    db_state_t *db, txn_state_t *latest_unused) {
+  txn_checkpointer_t *c = &db->checkpointer;
+  if (!c->running) ensure(txn_checkpointer_start(db));
+  pthread_mutex_lock(&c->lock);
+  uint64_t checkpointed = c->checkpointed_tx_id;
+  uint64_t target_tx_id = c->target ? c->target->tx_id : 0;
+  if (latest_unused->tx_id > checkpointed &&
+      latest_unused->tx_id > target_tx_id) {
+    // <4>
+    c->target = latest_unused;
+  }
+  // a failed checkpoint kept its target, this retries it
+  c->failed = false;
+  if (c->target) pthread_cond_signal(&c->work);
+  int32_t code = 0;
+  char error[sizeof(c->error)];
+  if (c->error_code && !c->error_reported) {
+    code              = c->error_code;
+    c->error_reported = true;
+    memcpy(error, c->error, sizeof(error));
+  }
+  pthread_mutex_unlock(&c->lock);
+  // <5>
+  // the latest state may be freed at oldest_active_tx, so we need to
+  // stay strictly behind what the checkpointer is working on
+  db->oldest_active_tx =
+      MIN(latest_unused->tx_id + 1, checkpointed);
+  if (code) return txn_checkpointer_report(code, error);
+  return success();
+}
+
+// a failed checkpoint is retried once before the writer is refused,
+// so the dirty memory stays bounded while the disk is failing
+static result_t txn_checkpointer_backpressure(db_state_t *db) {
+  if (!(db->options.flags & db_flags_background_checkpoint))
+    return success();
+  txn_checkpointer_t *c = &db->checkpointer;
+  bool retried          = false;
+  pthread_mutex_lock(&c->lock);
+  while (c->dirty_bytes > db->options.checkpoint_dirty_limit) {
+    if (c->failed && !retried) {
+      c->failed = false;
+      retried   = true;
+      pthread_cond_signal(&c->work);
+    }
+    // only wait if there is work that will release memory
+    if (c->failed || (!c->target && !c->busy)) break;
+    pthread_cond_wait(&c->done, &c->lock);
+  }
+  bool refused = c->failed &&
+                 c->dirty_bytes > db->options.checkpoint_dirty_limit;
+  int32_t code = c->error_code;
+  char error[sizeof(c->error)];
+  if (refused) memcpy(error, c->error, sizeof(error));
+  pthread_mutex_unlock(&c->lock);
+  if (refused) return txn_checkpointer_report(code, error);
+  return success();
+}
+// end::txn_checkpointer[]
+
+// tag::txn_epoch_gc[]
+// <1>
+// every state up to the boundary is on disk, cutting the chain after
+// it hides all of them from new readers at once, they are freed when
+// the epoch has moved twice, so the readers that got past the cut
+// are gone
+static void txn_epoch_retire(db_state_t *db, uint64_t epoch) {
+  txn_state_t *boundary = 0;
+  txn_state_t *visible =
+      __atomic_load_n(&db->last_visible_tx, __ATOMIC_ACQUIRE);
+  for (txn_state_t *cur = db->default_read_tx->next_tx;
+       cur && cur->tx_id < visible->tx_id &&
+       cur->tx_id < db->oldest_active_tx;
+       cur = cur->next_tx) {
+    if (cur->tx_id <= db->epochs.retired_tx_id) continue;
+    txn_versions_prune(db, cur);
+    cur->epoch = epoch;
+    boundary   = cur;
+    __atomic_add_fetch(&db->epochs.retired, 1, __ATOMIC_RELAXED);
+  }
+  if (!boundary) return;
+  __atomic_store_n(&boundary->next_tx->prev_tx, 0, __ATOMIC_RELEASE);
+  db->epochs.retired_tx_id = boundary->tx_id;
+}
+
+// <2>
+// must be called with the transactions lock held
+static void txn_epoch_reclaim(db_state_t *db) {
+  uint64_t epoch = txn_epoch_advance(db);
+  while (true) {
+    txn_state_t *cur = db->default_read_tx->next_tx;
+    if (!cur || cur->tx_id > db->epochs.retired_tx_id ||
+        cur->epoch + 2 > epoch)
+      break;
+    db->transactions_to_free             = cur->next_tx;
+    db->default_read_tx->next_tx         = cur->next_tx;
+    db->default_read_tx->map             = cur->map;
+    db->default_read_tx->number_of_pages = cur->number_of_pages;
+    txn_free_single_tx_state(cur);
+    __atomic_sub_fetch(&db->epochs.retired, 1, __ATOMIC_RELAXED);
+    db->epochs.freed++;
+  }
+}
+
+// <3>
+// readers don't count their usages of a state, so the writer checks
+// the epochs instead, a state is written to disk once every reader
+// that might still use an older one is gone
+static result_t txn_epoch_gc(db_state_t *db) {
+  uint64_t epoch             = txn_epoch_advance(db);
+  txn_state_t *latest_unused = db->default_read_tx;
+  txn_state_t *visible =
+      __atomic_load_n(&db->last_visible_tx, __ATOMIC_ACQUIRE);
+  // the visible state is acquired without the lock, keep it, the
+  // ones after it may not be durable or stamped by txn_publish yet
+  while (latest_unused->next_tx &&
+         latest_unused->next_tx->tx_id < visible->tx_id &&
+         (latest_unused->next_tx->tx_id <= db->epochs.retired_tx_id ||
+             latest_unused->next_tx->epoch + 2 <= epoch) &&
+         // async commit, cannot write before it is in the WAL
+         wal_is_durable(db, latest_unused->next_tx->tx_id)) {
+    latest_unused = latest_unused->next_tx;
+  }
+  if (latest_unused != db->default_read_tx) {
+    if (db->options.flags & db_flags_background_checkpoint) {
+      ensure(txn_checkpointer_hand_off(db, latest_unused));
+    } else if (latest_unused->tx_id >= db->oldest_active_tx) {
+      // readers may be looking at these states, can't merge in place
+      uint64_t bytes = 0;
+      ensure(txn_checkpoint_states(db, latest_unused, 0, &bytes));
+      db->oldest_active_tx = latest_unused->tx_id + 1;
+    }
+  }
+  txn_epoch_retire(db, epoch);
+  txn_epoch_reclaim(db);
+  return success();
+}
+
+// <4>
+// a busy lock means a writer, it will collect when it closes
+static void txn_epoch_try_reclaim(db_state_t *db) {
+  if (!__atomic_load_n(&db->epochs.retired, __ATOMIC_RELAXED)) return;
+  if (pthread_mutex_trylock(&db->txn_lock)) return;
+  txn_epoch_reclaim(db);
+  txn_unlock(db);
+}
+// end::txn_epoch_gc[]
+
 // tag::txn_gc[]
 static result_t txn_gc(txn_state_t *state) {
   // <1>
   db_state_t *db              = state->db;
   state->can_free_after_tx_id = db->last_tx_id + 1;
+  if (db->options.flags & db_flags_concurrent_readers)
+    return txn_epoch_gc(db);
   // <2>
   txn_state_t *latest_unused = state->db->default_read_tx;
   if (latest_unused->usages)  // tx using the file directly
     return success();
   // <3>
-  while (
-      latest_unused->next_tx && latest_unused->next_tx->usages == 0) {
+  while (latest_unused->next_tx &&
+         latest_unused->next_tx->usages == 0 &&
+         // async commit, cannot write before it is in the WAL
+         wal_is_durable(db, latest_unused->next_tx->tx_id)) {
     latest_unused = latest_unused->next_tx;
   }
   if (latest_unused == db->default_read_tx) {
@@ -528,6 +1497,12 @@ static result_t txn_gc(txn_state_t *state) {
   if (latest_unused == db->last_write_tx) {
     latest_unused->can_free_after_tx_id = db->last_tx_id;
   }
+  if (db->options.flags & db_flags_background_checkpoint) {
+    // <6>
+    ensure(txn_checkpointer_hand_off(db, latest_unused));
+    txn_free_registered_transactions(db);
+    return success();
+  }
   // <5>
   ensure(txn_merge_unique_pages(latest_unused));
   ensure(txn_write_state_to_disk(latest_unused));
@@ -544,23 +1519,45 @@ implementation_detail void txn_clear_working_set(txn_t *tx) {
     page_t *p;
     while (pagesmap_get_next(tx->working_set, &iter_state, &p)) {
       if (tx->state->flags & db_flags_encrypted) {
+        if (p->previous) {  // shared plain text, see txn_decrypt_page
+          page_cache_unpin(
+              &tx->state->db->decrypted_cache, p->previous);
+          continue;
+        }
         sodium_memzero(p->address, p->number_of_pages * PAGE_SIZE);
       }
-      free(p->address);
+      pages_release(tx->state->db, p);
     }
-    free(tx->working_set);
+    pagesmap_free(tx->working_set);
   }
 }
 result_t txn_close(txn_t *tx) {
   if (!tx || !tx->state) return success();
   db_state_t *db = tx->state->db;
-  if (tx->state->tx_id == db->active_write_tx) {
+  // with group commit, only an uncommitted writer holds the lock
+  // and a concurrent reader never does
+  bool may_write = !tx->state->snapshot &&
+                   (!(tx->state->flags & TX_COMMITED) ||
+                    !(db->options.flags & db_flags_group_commit));
+  if (may_write && db->active_write_tx &&
+      tx->state->tx_id == db->active_write_tx) {
     db->active_write_tx = 0;
+    txn_unlock(db);
   }
   txn_clear_working_set(tx);
+  // a commit that failed after sealing its WAL record
+  if (tx->state->sealed_wal_record.address)
+    wal_discard_sealed(tx->state);
   op_result_t *res = btree_stack_free(&tx->state->tmp.stack);
   free(tx->state->tmp.buffer.address);
   // end::working_set_txn_close[]
+  if (tx->state->snapshot) {
+    txn_epoch_unpin(tx->state);
+    free(tx->state);
+    tx->state = 0;
+    txn_epoch_try_reclaim(db);
+    return res;
+  }
   if (!(tx->state->flags & TX_COMMITED)) {  // rollback
     // <1>
     while (tx->state->on_rollback) {
@@ -580,10 +1577,14 @@ result_t txn_close(txn_t *tx) {
     tx->state = 0;
     return res;
   }
+  txn_lock(db);
+  defer(txn_unlock, db);
   if (!db->transactions_to_free && tx->state != db->default_read_tx)
     db->transactions_to_free = tx->state;
 
-  if (--tx->state->usages == 0) {
+  // concurrent readers don't use the state, the writer collects
+  if (--tx->state->usages == 0 ||
+      (db->options.flags & db_flags_concurrent_readers)) {
     ensure(txn_gc(tx->state));
   }
 
@@ -0,0 +1 @@
+../../ch17/code/txn.c
\ No newline at end of file
@@ -15,6 +15,8 @@ static result_t db_init_file_header(db_t *db, txn_t *tx) {
   entry->file_header.page_size_power_of_two =
       (uint8_t)(log2(PAGE_SIZE));
   entry->file_header.version = GAVRAN_VERSION;
+  entry->file_header.checksum_algorithm =
+      db->state->options.checksum_algorithm;
   memcpy(&entry->file_header.magic, FILE_HEADER_MAGIC, 5);
   entry->file_header.number_of_pages =
       db->state->map.size / PAGE_SIZE;
@@ -123,8 +125,30 @@ static result_t db_is_new_file(db_t *db, bool *is_new) {
   return success();
 }
 
+// tag::db_load_checksum_algorithm[]
+// existing files keep the algorithm they were created with
+implementation_detail result_t db_load_checksum_algorithm(db_t *db) {
+  // read directly, validating the page requires the algorithm
+  void *buffer;
+  ensure(mem_alloc_page_aligned(&buffer, PAGE_SIZE));
+  defer(free, buffer);
+  ensure(pal_read_file(db->state->handle, 0, buffer, PAGE_SIZE));
+  file_header_t *header = &((page_metadata_t *)buffer)->file_header;
+  if (memcmp(FILE_HEADER_MAGIC, header->magic, 5))
+    return success();  // new file, will use the options
+  checksum_algorithm_t algorithm = header->checksum_algorithm;
+  ensure(checksum_is_known(algorithm),
+      msg("Unknown checksum algorithm in the file header"),
+      with(algorithm, "%d"),
+      with(db->state->handle->filename, "%s"));
+  db->state->options.checksum_algorithm = algorithm;
+  return success();
+}
+// end::db_load_checksum_algorithm[]
+
 // tag::db_init[]
 implementation_detail result_t db_init(db_t *db) {
+  ensure(db_load_checksum_algorithm(db));
   // <1>
   if ((db->state->options.flags & db_flags_log_shipping_target) ==
       db_flags_log_shipping_target)
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <errno.h>
+#include <pthread.h>
 #include <sodium.h>
 #include <stdint.h>
 #include <unistd.h>
@@ -51,6 +52,13 @@ typedef struct page {
 
 result_t pages_get(txn_t *tx, page_t *p);
 result_t pages_write(db_state_t *db, page_t *p);
+result_t pages_write_batch(
+    db_state_t *db, page_t *pages, size_t count);
+void pages_release(db_state_t *db, page_t *p);
+bool pages_needs_validation(db_state_t *db, page_t *p);
+void pages_mark_validated(db_state_t *db, page_t *p);
+void pages_invalidate_cache(
+    db_state_t *db, page_t *pages, size_t count);
 // end::paging_api[]
 
 // tag::page_crypto_metadata_t[]
@@ -138,15 +146,29 @@ typedef struct free_space_bitmap_heart {
   page_flags_t page_flags;
   uint8_t _padding1[3];
   uint32_t number_of_pages;
-  uint8_t _padding2[20];
+  uint64_t wal_dictionary_page;
+  // replaced dictionaries, chained by overflow.container_item_id
+  uint64_t wal_retired_dictionary_page;
+  uint8_t _padding2[8];
 } free_space_bitmap_heart_t;
 
+// tag::checksum_algorithm_t[]
+// integrity checks for pages and WAL records, blake2b is the default
+typedef enum __attribute__((__packed__)) checksum_algorithm {
+  checksum_blake2b = 0,
+  checksum_crc32c  = 1,  // torn writes only, not tampering
+} checksum_algorithm_t;
+
+#define CHECKSUM_SIZE 32
+// end::checksum_algorithm_t[]
+
 // tag::file_header[]
 #define FILE_HEADER_MAGIC "GVRN!"
 
 typedef struct file_header {
   page_flags_t page_flags;
-  uint8_t version;
+  uint8_t version : 4;
+  uint8_t checksum_algorithm : 4;  // zero for older files, blake2b
   uint8_t page_size_power_of_two;
   uint8_t magic[5];  // should be FILE_HEADER_MAGIC
   uint64_t number_of_pages;
@@ -203,13 +225,31 @@ typedef enum db_flags {
   db_flags_page_validation_once   = 1 << 7,
   db_flags_page_validation_always = 1 << 8,
   db_flags_log_shipping_target    = 1 << 9,
+  // commits share WAL writes, a commit is visible to readers only
+  // once it is durable, see txn_publish
+  db_flags_group_commit           = 1 << 10,
+  // commits are visible before they are durable, see db_flush_wal
+  db_flags_async_commit           = 1 << 11,
+  db_flags_background_checkpoint  = 1 << 12,
+  db_flags_io_uring               = 1 << 13,
+  db_flags_preallocate            = 1 << 14,
+  // compressed plain text WAL records, log shipping needs the key
+  db_flags_sealed_wal             = 1 << 15,
+  // read transactions may be created and used from any thread, the
+  // writer publishes each commit atomically, see txn_create
+  db_flags_concurrent_readers     = 1 << 16,
+  // how the page slab backs its chunks, see page_slab_size
+  db_flags_page_slab_populate     = 1 << 17,
+  db_flags_page_slab_huge_pages   = 1 << 18,
   db_flags_page_validation_none =
       db_flags_page_validation_once | db_flags_page_validation_always,
   db_flags_page_validation_none_mask =
       ~(db_flags_page_validation_once |
           db_flags_page_validation_always),
   db_flags_page_need_txn_working_set =
-      db_flags_encrypted | db_flags_avoid_mmap_io
+      db_flags_encrypted | db_flags_avoid_mmap_io,
+  db_flags_wal_queued_writes =
+      db_flags_group_commit | db_flags_async_commit
 
 } db_flags_t;
 
@@ -226,6 +266,11 @@ typedef void (*wal_write_callback_t)(
     void *state, uint64_t tx_id, span_t *wal_record);
 // end::wal_write_callback_t[]
 
+// tag::wal_archive_callback_t[]
+typedef result_t (*wal_archive_callback_t)(void *state,
+    uint64_t first_tx_id, uint64_t last_tx_id, span_t *segment);
+// end::wal_archive_callback_t[]
+
 // tag::database_page_validation_options[]
 typedef struct db_options {
   uint64_t minimum_size;
@@ -233,26 +278,285 @@ typedef struct db_options {
   uint64_t wal_size;
   uint8_t encryption_key[32];
   db_flags_t flags;
-  uint32_t _padding;
+  uint32_t wal_async_flush_ms;
   wal_write_callback_t wal_write_callback;
   void *wal_write_callback_state;
+  uint64_t wal_async_flush_bytes;
+  uint64_t checkpoint_dirty_limit;
+  uint64_t page_cache_size;
+  uint64_t map_reserve_size;
+  uint64_t file_extent_size;
+  int32_t wal_compression_level;
+  uint32_t wal_dictionary_size;
+  uint32_t wal_segments;
+  uint32_t wal_recovery_workers;
+  wal_archive_callback_t wal_archive_callback;
+  void *wal_archive_callback_state;
+  checksum_algorithm_t checksum_algorithm;  // for new files only
+  uint8_t _padding[3];
+  uint32_t finalize_workers;  // 0 hashes / encrypts on commit thread
+  uint32_t subkey_cache_size;  // derived page keys kept, 0 disables
+  uint8_t _padding2[4];
+  uint64_t decrypted_cache_size;  // plain text shared by all txns
+  uint64_t page_slab_size;  // for modified pages, 0 uses the heap
 } db_options_t;
 // end::database_page_validation_options[]
 
+typedef struct reusable_buffer {
+  void *address;
+  size_t size;
+  size_t used;
+} reusable_buffer_t;
+
 // tag::wal_data_structs[]
+#define WAL_MAX_SEGMENTS 16
+
 typedef struct wal_file_state {
   file_handle_t *handle;
   span_t span;
   uint64_t last_write_pos;
+  uint64_t first_tx_id;
   uint64_t last_tx_id;
 } wal_file_state_t;
 
+typedef struct wal_pending_write wal_pending_write_t;
+
+typedef struct wal_group_commit {
+  pthread_mutex_t lock;
+  pthread_cond_t written;
+  pthread_cond_t flush_needed;
+  pthread_t flusher;
+  wal_pending_write_t *head;
+  wal_pending_write_t *tail;
+  uint64_t pending_bytes;
+  uint64_t last_queued_tx_id;
+  uint64_t durable_tx_id;
+  uint64_t number_of_writes;
+  uint64_t number_of_records;
+  bool leader_active;
+  bool failed;
+  bool flusher_running;
+  bool stop_flusher;
+  uint8_t _padding[4];
+} wal_group_commit_t;
+
+typedef struct wal_compression {
+  pthread_mutex_t lock;
+  struct ZSTD_CCtx_s *cctx;
+  struct ZSTD_DCtx_s *dctx;
+  struct ZSTD_CDict_s *cdict;
+  struct ZSTD_DDict_s *ddict;
+  uint64_t cdict_page;  // dictionary used for new records
+  uint64_t ddict_page;  // last dictionary used for reading
+  uint64_t cdict_last_tx_id;  // last record compressed with cdict
+  uint64_t retired_tx_id;     // last record using a retired one
+  reusable_buffer_t output;
+  reusable_buffer_t samples;
+  reusable_buffer_t sample_sizes;
+} wal_compression_t;
+
+// tag::wal_buffer_pool_t[]
+#define WAL_BUFFER_POOL_SIZE 8
+
+typedef struct wal_buffer_pool {
+  pthread_mutex_t lock;
+  span_t buffers[WAL_BUFFER_POOL_SIZE];
+  size_t count;
+  uint64_t allocations;
+  uint64_t reuses;
+} wal_buffer_pool_t;
+// end::wal_buffer_pool_t[]
+
+// tag::wal_recovery_stats_t[]
+typedef struct wal_recovery_stats {
+  uint64_t number_of_records;
+  uint64_t bytes_replayed;
+  uint64_t number_of_pages_written;
+  uint64_t number_of_workers;
+  uint64_t elapsed_ns;
+} wal_recovery_stats_t;
+// end::wal_recovery_stats_t[]
+
 typedef struct wal_state {
   size_t current_append_file_index;
-  wal_file_state_t files[2];
+  size_t number_of_files;
+  wal_file_state_t files[WAL_MAX_SEGMENTS];
+  wal_group_commit_t group_commit;
+  wal_compression_t compression;
+  wal_buffer_pool_t buffer_pool;
+  wal_recovery_stats_t recovery;
 } wal_state_t;
 // end::wal_data_structs[]
 
+// tag::cleanup_callback_t[]
+typedef struct cleanup_callback {
+  void (*func)(void *state);
+  struct cleanup_callback *next;
+  char state[];
+} cleanup_callback_t;
+// end::cleanup_callback_t[]
+
+// tag::txn_checkpointer_t[]
+typedef struct txn_checkpointer {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  pthread_t thread;
+  txn_state_t *target;
+  uint64_t checkpointed_tx_id;
+  uint64_t dirty_bytes;
+  int32_t error_code;  // the last failure, kept until one succeeds
+  bool running;
+  bool busy;
+  bool stop;
+  bool failed;  // the target waits for a retry
+  bool error_reported;
+  uint8_t _padding[7];
+  char error[256];
+} txn_checkpointer_t;
+// end::txn_checkpointer_t[]
+
+// tag::txn_finalizer_t[]
+#define TXN_FINALIZER_MAX_WORKERS 16
+
+typedef struct txn_finalize_job txn_finalize_job_t;
+
+typedef struct txn_finalizer {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  pthread_t workers[TXN_FINALIZER_MAX_WORKERS];
+  txn_finalize_job_t *job;
+  size_t number_of_workers;
+  bool stop;
+  uint8_t _padding[7];
+} txn_finalizer_t;
+// end::txn_finalizer_t[]
+
+// tag::txn_epochs_t[]
+#define TXN_READER_SLOTS 64
+
+// threads are spread over the slots, a cache line each, open
+// readers are counted by the parity of the epoch they pinned
+typedef struct txn_reader_slot {
+  uint64_t readers[2];
+  uint8_t _padding[48];
+} txn_reader_slot_t;
+
+typedef struct txn_epochs {
+  uint64_t current;
+  uint64_t retired_tx_id;  // every state up to it is unlinked
+  uint64_t retired;        // unlinked, but not yet freed
+  uint64_t freed;
+  txn_reader_slot_t slots[TXN_READER_SLOTS];
+} txn_epochs_t;
+// end::txn_epochs_t[]
+
+// tag::txn_page_versions_t[]
+typedef struct txn_page_version txn_page_version_t;
+
+// newest first, a transaction takes the first one at or below its
+// own tx_id, see txn_raw_get_page
+struct txn_page_version {
+  txn_page_version_t *older;
+  txn_page_version_t *newer;  // only used by the writer, to prune
+  uint64_t tx_id;
+  page_t page;
+};
+
+typedef struct txn_page_versions_bucket {
+  uint64_t key;  // page_num + 1, zero is empty
+  txn_page_version_t *head;
+} txn_page_versions_bucket_t;
+
+// keys are never removed, the table is rebuilt once half full
+typedef struct txn_page_versions {
+  size_t number_of_buckets;
+  size_t used;
+  size_t live;  // keys that still have versions
+  txn_page_versions_bucket_t buckets[];
+} txn_page_versions_t;
+// end::txn_page_versions_t[]
+
+// tag::txn_page_slab_t[]
+// runs of 1, 2, 4 ... 256 pages, the largest is a whole chunk
+#define TXN_PAGE_SLAB_CLASSES 9
+#define TXN_PAGE_SLAB_CHUNK (PAGE_SIZE << (TXN_PAGE_SLAB_CLASSES - 1))
+
+// chunks are committed one after the other inside a reservation,
+// freed runs are kept for the next transactions until db_close
+typedef struct txn_page_slab {
+  pthread_mutex_t lock;
+  span_t reservation;
+  uint8_t *start;      // chunk aligned
+  uint8_t *next;       // never handed out from here on
+  uint8_t *committed;  // usable up to here
+  uint8_t *end;
+  void *free_runs[TXN_PAGE_SLAB_CLASSES];
+  uint64_t reserved_bytes;
+  uint64_t used_bytes;
+  uint64_t allocations;
+  uint64_t reuses;
+  uint64_t fallbacks;  // too large or no room, from the heap
+} txn_page_slab_t;
+// end::txn_page_slab_t[]
+
+// tag::pages_write_stats_t[]
+typedef struct pages_write_stats {
+  uint64_t number_of_syscalls;
+  uint64_t number_of_pages;
+  uint64_t bytes_written;
+} pages_write_stats_t;
+// end::pages_write_stats_t[]
+
+// tag::page_cache_t[]
+// a CLOCK cache of whole pages, shared by all transactions. The
+// page cache holds what we read from disk, the decrypted cache the
+// plain text of encrypted pages, keyed by their version as well
+typedef struct page_cache_entry {
+  struct page_cache_entry *next;  // hash chain
+  void *address;
+  uint64_t page_num;
+  size_t slot;
+  page_crypto_metadata_t version;  // nonce & mac, if encrypted
+  uint32_t number_of_pages;
+  uint32_t pins;
+  bool referenced;
+  bool validated;
+  bool detached;
+  uint8_t _padding[5];
+} page_cache_entry_t;
+
+typedef struct page_cache {
+  pthread_mutex_t lock;
+  page_cache_entry_t **ring;
+  page_cache_entry_t **buckets;
+  size_t capacity;
+  size_t number_of_buckets;
+  size_t hand;
+  uint64_t budget;
+  uint64_t used_bytes;
+  uint64_t invalidations;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  bool locked_memory;  // mlock'ed, wiped when freed
+  uint8_t _padding[7];
+} page_cache_t;
+// end::page_cache_t[]
+
+// tag::txn_subkey_cache_t[]
+typedef struct txn_subkey txn_subkey_t;
+
+typedef struct txn_subkey_cache {
+  pthread_mutex_t lock;
+  txn_subkey_t *entries;  // guarded memory, wiped on close
+  size_t capacity;
+  uint64_t hits;
+  uint64_t misses;
+} txn_subkey_cache_t;
+// end::txn_subkey_cache_t[]
+
 // tag::db_state_t[]
 typedef struct db_state {
   db_options_t options;
@@ -261,24 +565,31 @@ typedef struct db_state {
   uint64_t last_tx_id;
   file_handle_t *handle;
   wal_state_t wal_state;
-  txn_state_t *last_write_tx;
+  txn_state_t *last_write_tx;    // writers build on it
+  txn_state_t *last_visible_tx;  // readers open it, see txn_publish
   uint64_t active_write_tx;
   txn_state_t *default_read_tx;
   txn_state_t *transactions_to_free;
   uint64_t *first_read_bitmap;
   uint64_t original_number_of_pages;
   uint64_t oldest_active_tx;
+  pthread_mutex_t txn_lock;
+  pthread_mutex_t publish_lock;
+  txn_checkpointer_t checkpointer;
+  txn_finalizer_t finalizer;
+  cleanup_callback_t *on_close;
+  pages_write_stats_t write_stats;
+  page_cache_t page_cache;
+  txn_subkey_cache_t subkey_cache;
+  page_cache_t decrypted_cache;
+  pal_io_ring_t *io_ring;
+  span_t map_reservation;
+  txn_epochs_t epochs;
+  txn_page_versions_t *page_versions;
+  txn_page_slab_t page_slab;
 } db_state_t;
 // end::db_state_t[]
 
-// tag::cleanup_callback_t[]
-typedef struct cleanup_callback {
-  void (*func)(void *state);
-  struct cleanup_callback *next;
-  char state[];
-} cleanup_callback_t;
-// end::cleanup_callback_t[]
-
 // tag::btree_stack_t[]
 typedef struct btree_stack {
   uint64_t *pages;
@@ -288,12 +599,6 @@ typedef struct btree_stack {
 } btree_stack_t;
 // end::btree_stack_t[]
 
-typedef struct reusable_buffer {
-  void *address;
-  size_t size;
-  size_t used;
-} reusable_buffer_t;
-
 // tag::txn_state_t[]
 typedef struct txn_state {
   uint64_t tx_id;
@@ -305,7 +610,16 @@ typedef struct txn_state {
   cleanup_callback_t *on_rollback;
   txn_state_t *prev_tx;
   txn_state_t *next_tx;
+  txn_state_t *snapshot;  // shared by concurrent readers
+  txn_reader_slot_t *reader_slot;
+  uint64_t epoch;  // published, pinned or retired at
+  txn_page_version_t *versions;  // its pages in db->page_versions
+  uint64_t number_of_versions;
+  txn_page_versions_t *replaced_versions;  // freed along with it
   void *shipped_wal_record;
+  span_t *shipped_wal_records;  // when applying a batch
+  span_t sealed_wal_record;     // prepared before encryption
+  size_t number_of_shipped_wal_records;
   uint64_t can_free_after_tx_id;
   struct {
     reusable_buffer_t buffer;
@@ -327,6 +641,7 @@ result_t txn_close(txn_t *tx);
 enable_defer(txn_close);
 
 result_t txn_commit(txn_t *tx);
+result_t db_flush_wal(db_t *db);
 result_t txn_raw_get_page(txn_t *tx, page_t *page);
 
 result_t txn_raw_modify_page(txn_t *tx, page_t *page);
@@ -363,6 +678,13 @@ static inline bool bitmap_is_set(uint64_t *buffer, uint64_t pos) {
 
 result_t wal_apply_wal_record(db_t *db, reusable_buffer_t *tmp_buffer,
     uint64_t tx_id, span_t *wal_record);
+result_t wal_apply_wal_records(db_t *db, uint64_t first_tx_id,
+    span_t *wal_records, size_t count);
+result_t wal_train_dictionary(db_t *db);
+result_t wal_archive_to_directory(void *directory,
+    uint64_t first_tx_id, uint64_t last_tx_id, span_t *segment);
+result_t wal_restore_archive(const char *archive_directory,
+    const char *path, db_options_t *options, uint64_t target_tx_id);
 
 // tag::container_api[]
 // create / delete container
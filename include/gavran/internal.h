@@ -4,20 +4,49 @@
 
 // tag::pages_map_t[]
 typedef struct pages_hash_table {
-  size_t number_of_buckets;
-  size_t count;
+  size_t number_of_buckets;  // a power of two
+  size_t count;              // including those still in previous
+  size_t used;               // slots taken in this table
   size_t resize_required;
-  page_t entries[];
+  struct pages_hash_table *previous;  // moved over on each put
+  size_t migrated;                    // buckets of previous done
+  uint8_t *tags;  // 7 bits of the hash, empty or deleted
+  uint64_t *keys;
+  page_t *entries;
+  uint8_t data[];
 } pages_map_t;
 
 result_t pagesmap_put_new(pages_map_t **table_p, page_t *page);
 bool pagesmap_lookup(pages_map_t *table, page_t *page);
+bool pagesmap_remove(pages_map_t *table, page_t *page);
 bool pagesmap_get_next(
     pages_map_t *table, size_t *state, page_t **page);
 result_t pagesmap_new(
     size_t initial_number_of_elements, pages_map_t **table);
+void pagesmap_free(pages_map_t *table);
+static inline void defer_pagesmap_free(cancel_defer_t *cd) {
+  if (cd->cancelled && *cd->cancelled) return;
+  pagesmap_free(*(pages_map_t **)cd->target);
+}
 // end::pages_map_t[]
 
+// tag::page_cache_api[]
+// all must be called with the cache lock held, a null version
+// matches any entry of the page
+implementation_detail result_t page_cache_init(db_state_t *db,
+    page_cache_t *cache, uint64_t budget, bool locked_memory);
+implementation_detail page_cache_entry_t *page_cache_pin(
+    page_cache_t *cache, uint64_t page_num, uint64_t pages,
+    page_crypto_metadata_t *version);
+implementation_detail result_t page_cache_insert(
+    page_cache_t *cache, uint64_t page_num, uint64_t pages,
+    page_crypto_metadata_t *version, void *buffer,
+    page_cache_entry_t **entry);
+// takes the lock itself
+implementation_detail void page_cache_unpin(
+    page_cache_t *cache, page_cache_entry_t *entry);
+// end::page_cache_api[]
+
 implementation_detail void txn_free_single_tx_state(
     txn_state_t *state);
 
@@ -27,6 +56,27 @@ static inline void defer_txn_clear_working_set(cancel_defer_t *cd) {
   txn_clear_working_set(cd->target);
 }
 
+// byte identical diffs, scalar is the reference implementation
+implementation_detail void *wal_diff_page_simd(uint64_t *origin,
+    uint64_t *modified, size_t size, void *output);
+implementation_detail void *wal_diff_page_scalar(uint64_t *origin,
+    uint64_t *modified, size_t size, void *output);
+
+implementation_detail bool checksum_is_known(
+    checksum_algorithm_t algorithm);
+implementation_detail result_t checksum_compute(
+    checksum_algorithm_t algorithm, const void *data, size_t size,
+    uint8_t checksum[CHECKSUM_SIZE]);
+implementation_detail result_t db_load_checksum_algorithm(db_t *db);
+
+implementation_detail enum pal_file_creation_flags
+db_file_creation_flags(db_options_t *options);
+implementation_detail uint64_t db_align_to_file_extent(
+    db_options_t *options, uint64_t size);
+implementation_detail bool db_can_extend_map_in_place(
+    db_state_t *db, span_t *map, uint64_t new_size);
+implementation_detail result_t db_extend_map_in_place(
+    db_state_t *db, span_t *map, uint64_t new_size);
 implementation_detail result_t db_increase_file_size(
     txn_t *tx, uint64_t new_size);
 
@@ -84,6 +134,11 @@ implementation_detail bool bitmap_is_acceptable_match(
 // tag::wal_api[]
 result_t wal_open_and_recover(db_t *db);
 result_t wal_append(txn_state_t *tx);
+result_t wal_prepare_sealed(txn_state_t *tx);
+void wal_discard_sealed(txn_state_t *tx);
+result_t wal_wait_until_durable(db_state_t *db, uint64_t tx_id);
+bool wal_is_durable(db_state_t *db, uint64_t tx_id);
+bool wal_has_failed(db_state_t *db);
 bool wal_will_checkpoint(db_state_t *db, uint64_t tx_id);
 result_t wal_checkpoint(db_state_t *db, uint64_t tx_id);
 result_t wal_close(db_state_t *db);
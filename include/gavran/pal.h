@@ -8,7 +8,8 @@
 // tag::pal_file_creation_flags[]
 enum pal_file_creation_flags {
   pal_file_creation_flags_none = 0,
-  pal_file_creation_flags_durable = 1
+  pal_file_creation_flags_durable = 1,
+  pal_file_creation_flags_preallocate = 2
 };
 // end::pal_file_creation_flags[]
 
@@ -25,6 +26,8 @@ typedef struct pal_file_handle {
   };
   char *filename;
   uint64_t size;
+  enum pal_file_creation_flags flags;
+  uint32_t _padding;
 } file_handle_t;
 
 // working with files
@@ -51,3 +54,55 @@ result_t pal_write_file(file_handle_t *handle, uint64_t offset,
 result_t pal_read_file(file_handle_t *handle, uint64_t offset,
                        void *buffer, size_t size);
 // end::pal_api[]
+
+// tag::pal_write_file_vectored[]
+// every pwritev made, retries included, is added to syscalls, if set
+result_t pal_write_file_vectored(file_handle_t *handle,
+                                 uint64_t offset, span_t *buffers,
+                                 size_t count, uint64_t *syscalls);
+// end::pal_write_file_vectored[]
+
+// tag::pal_io_ring[]
+// batched, asynchronous I/O, a ring must be used by one thread at
+// a time, but may be handed over between threads
+typedef struct pal_io_ring pal_io_ring_t;
+
+enum pal_io_op { pal_io_op_read = 1, pal_io_op_write = 2 };
+
+typedef struct pal_io_request {
+  file_handle_t *handle;
+  span_t *buffers;  // must stay valid until completed
+  size_t count;
+  uint64_t offset;
+  enum pal_io_op op;
+  int result;  // errno, set on completion
+} pal_io_request_t;
+
+result_t pal_io_ring_create(uint32_t depth, pal_io_ring_t **ring);
+result_t pal_io_ring_close(pal_io_ring_t *ring);
+void defer_pal_io_ring_close(cancel_defer_t *cd);
+result_t pal_io_ring_submit(pal_io_ring_t *ring,
+                            pal_io_request_t *requests,
+                            size_t count);
+result_t pal_io_ring_wait(pal_io_ring_t *ring);
+uint64_t pal_io_ring_syscalls(pal_io_ring_t *ring);
+// end::pal_io_ring[]
+
+// tag::pal_reserve_address_space[]
+// stable addresses for a growing file, map into the reservation
+result_t pal_reserve_address_space(uint64_t size, span_t *range);
+result_t pal_mmap_fixed(file_handle_t *handle, uint64_t offset,
+                        span_t *m);
+// end::pal_reserve_address_space[]
+
+// tag::pal_commit_address_space[]
+enum pal_commit_flags {
+  pal_commit_flags_none = 0,
+  pal_commit_flags_populate = 1,  // fault the pages in up front
+  pal_commit_flags_huge_pages = 2  // transparent, if the kernel can
+};
+
+// anonymous read / write memory in part of a reservation
+result_t pal_commit_address_space(span_t *range,
+                                  enum pal_commit_flags flags);
+// end::pal_commit_address_space[]